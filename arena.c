@@ -0,0 +1,79 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN(n) (((n) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+
+/*
+ * arena_init - use size bytes at base as the first block.
+ * base is rounded up to the arena alignment, the bytes skipped are lost.
+ */
+void arena_init(arena_t *a, char *base, size_t size) {
+    size_t skip = ARENA_ALIGN((uintptr_t) base) - (uintptr_t) base;
+    a->base = base + (skip < size ? skip : size);
+    a->size = skip < size ? size - skip : 0;
+    a->used = 0;
+    a->blocks = NULL;
+}
+
+/*
+ * arena_alloc - len bytes aligned for any type, NULL if out of memory
+ */
+void *arena_alloc(arena_t *a, size_t len) {
+    arena_block_t *b = a->blocks;
+    size_t size;
+    void *p;
+
+    len = ARENA_ALIGN(len);
+    if (b == NULL && a->size - a->used >= len) {
+        p = a->base + a->used;
+        a->used += len;
+        return p;
+    }
+    if (b == NULL || b->size - b->used < len) {
+        size = len > ARENA_BLOCK ? len : ARENA_BLOCK;
+        if ((b = malloc(sizeof(arena_block_t) + size)) == NULL) return NULL;
+        b->next = a->blocks;
+        b->size = size;
+        b->used = 0;
+        a->blocks = b;
+    }
+    p = b->data + b->used;
+    b->used += len;
+    return p;
+}
+
+/*
+ * arena_strndup - NUL-terminated copy of the first len bytes of s
+ */
+char *arena_strndup(arena_t *a, const char *s, size_t len) {
+    char *p = arena_alloc(a, len + 1);
+    if (p == NULL) return NULL;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+/*
+ * arena_reset - free everything allocated, the first block is kept for reuse
+ */
+void arena_reset(arena_t *a) {
+    arena_block_t *b, *next;
+    for (b = a->blocks; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+    a->used = 0;
+    a->blocks = NULL;
+}
@@ -0,0 +1,46 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_ARENA_H
+#define NAIVE_HTTP_ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK 4096 /* minimum size of an overflow block */
+
+typedef struct _arena_block {
+    struct _arena_block *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) char data[];
+} arena_block_t;
+
+/*
+ * Bump allocator freed in bulk.
+ * Allocations come from a caller-provided first block, usually embedded in the
+ * object the arena serves; only what overflows it is malloc'ed, and released
+ * by arena_reset.
+ */
+typedef struct {
+    char *base; /* first block */
+    size_t size;
+    size_t used;
+    arena_block_t *blocks; /* overflow, newest first */
+} arena_t;
+
+void arena_init(arena_t *a, char *base, size_t size);
+
+void *arena_alloc(arena_t *a, size_t len);
+
+char *arena_strndup(arena_t *a, const char *s, size_t len);
+
+void arena_reset(arena_t *a);
+
+#endif //NAIVE_HTTP_ARENA_H
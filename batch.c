@@ -0,0 +1,214 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include "batch.h"
+#include "config.h"
+#include "errors.h"
+#include "namespace.h"
+#include "diskio.h"
+#include "misc.h"
+#include "tar.h"
+
+static const char zeros[2 * TAR_BLOCK]; /* entry padding, and the end-of-archive marker */
+
+static const char batch_header[] = "HTTP/1.0 200 OK\r\n"
+                                   "Server: Naive HTTP Server\r\n"
+                                   "Connection: close\r\n"
+                                   "Content-Type: application/x-tar\r\n\r\n";
+
+/* defined in http.c */
+void queue_protocol(transaction_t *trans);
+
+void queue_transmission(transaction_t *trans);
+
+void wait_disk(transaction_t *trans, disk_op_e op, disk_done_cb_t done);
+
+bool finish_if_aborted(int efd, transaction_t *trans);
+
+void client_error(int efd, transaction_t *trans, char *cause, error_e err);
+
+static const char *query_of(const char *uri);
+
+static void on_entry_opened(int efd, disk_job_t *job);
+
+static void close_entry(transaction_t *trans);
+
+static int fill_header(tar_header_t *h, const char *name, const struct stat *sbuf);
+
+static const char *query_of(const char *uri) {
+    const char *q = strchr(uri, '?');
+    return q != NULL ? q + 1 : NULL;
+}
+
+bool batch_requested(transaction_t *trans) {
+    const char *q = query_of(trans->req->uri);
+    return q != NULL && (strcmp(q, "tar") == 0 || strncmp(q, "tar=", 4) == 0);
+}
+
+/*
+ * batch_start - collect the manifest of a batch request.
+ * header_len bytes of read_buf hold the request header, a body manifest follows.
+ */
+void batch_start(int efd, transaction_t *trans, long header_len) {
+    const char *list = query_of(trans->req->uri) + 3, *length;
+    long len;
+
+    if (*list == '=') { /* ?tar=a,b,c */
+        for (len = 0, list++; list[len] && list[len] != '#'; len++) {
+            trans->read_buf[len] = list[len] == ',' ? '\n' : list[len];
+        }
+        trans->read_pos = len;
+    } else {
+        length = get_header(&trans->headers, H_CONTENT_LENGTH);
+        len = length != NULL ? strtol(length, NULL, 10) : 0;
+        if (len <= 0) {
+            client_error(efd, trans, "", E_NO_LENGTH);
+            return;
+        }
+        if (len > config.max_buf) {
+            client_error(efd, trans, "", E_TOO_LARGE);
+            return;
+        }
+        memmove(trans->read_buf, trans->read_buf + header_len, trans->read_pos - header_len);
+        trans->read_pos -= header_len;
+    }
+    trans->read_len = len;
+    trans->state = S_READ;
+    trans->next_stage = P_READ_MANIFEST;
+    queue_transmission(trans);
+}
+
+/*
+ * batch_begin - the manifest is in read_buf[0, read_len), start the response
+ */
+void batch_begin(int efd, transaction_t *trans) {
+    epoll_event_t event;
+    event.data.fd = trans->fd;
+    event.events = EPOLLOUT | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
+        unix_error("epoll ctl");
+    }
+    printf("batch of %ld manifest bytes\n", trans->read_len);
+    outq_push_str(&trans->outq, batch_header);
+    trans->batch_next = 0;
+    trans->state = S_WRITE;
+    trans->next_stage = P_BATCH_NEXT;
+    queue_protocol(trans);
+}
+
+/*
+ * batch_next - release the entry just sent and open the next one,
+ * or end the archive once the manifest is exhausted
+ */
+void batch_next(int efd, transaction_t *trans) {
+    char *end = trans->read_buf + trans->read_len, *line, *eol;
+    char uri[MAXLINE];
+    int dir_len = strcspn(trans->req->uri, "?#"), n;
+
+    close_entry(trans);
+    while (trans->batch_next < trans->read_len) {
+        line = trans->read_buf + trans->batch_next;
+        if ((eol = memchr(line, '\n', end - line)) == NULL) eol = end;
+        trans->batch_next = eol - trans->read_buf + 1;
+        if (eol > line && eol[-1] == '\r') eol--;
+        if (eol == line) continue;
+
+        /* manifest paths are URI paths relative to the requested directory */
+        n = snprintf(uri, sizeof(uri), "%.*s/%.*s", dir_len, trans->req->uri, (int) (eol - line), line);
+        if (n >= (int) sizeof(uri) || parse_uri(uri, trans->req->filename) == ERROR) {
+            printf("batch: skipping %.*s\n", (int) (eol - line), line);
+            trans->batch_skipped++;
+            continue;
+        }
+        /* open, check and lock the file off the loop. on_entry_opened continues. */
+        wait_disk(trans, D_OPEN_READ, on_entry_opened);
+        return;
+    }
+    printf("batch done: %d files, %d skipped\n", trans->batch_sent, trans->batch_skipped);
+    outq_push_mem(&trans->outq, zeros, sizeof(zeros));
+    trans->state = S_WRITE;
+    trans->next_stage = P_DONE;
+    queue_transmission(trans);
+}
+
+/* queue the entry header, the file and its padding */
+static void on_entry_opened(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    tar_header_t h;
+
+    if (job->result == OKAY) {
+        trans->read_fd = job->fd;
+        trans->haslock = true;
+    }
+    if (finish_if_aborted(efd, trans)) return;
+
+    trans->state = S_WRITE;
+    trans->next_stage = P_BATCH_NEXT;
+    if (job->result == ERROR || fill_header(&h, trans->req->filename, &job->sbuf) == ERROR) {
+        printf("batch: skipping %s\n", trans->req->filename);
+        trans->batch_skipped++;
+        queue_protocol(trans);
+        return;
+    }
+    outq_push_copy(&trans->outq, &h, sizeof(h));
+    outq_push_file(&trans->outq, trans->read_fd, 0, job->sbuf.st_size);
+    outq_push_mem(&trans->outq, zeros, -job->sbuf.st_size & (TAR_BLOCK - 1));
+    trans->batch_sent++;
+    queue_transmission(trans);
+}
+
+/* close the file of the entry just sent, which drops its lock */
+static void close_entry(transaction_t *trans) {
+    if (trans->read_fd < 0) return;
+    submit_disk_close(trans->read_fd, NULL, NULL);
+    trans->read_fd = INVALID_FD;
+    trans->haslock = false;
+}
+
+/*
+ * fill_header - ustar header of a regular file.
+ * Names over 100 bytes are split at a slash into prefix and name.
+ * Returns ERROR if the name or the size does not fit.
+ */
+static int fill_header(tar_header_t *h, const char *name, const struct stat *sbuf) {
+    size_t len = strlen(name), i;
+    const unsigned char *p;
+    unsigned int sum = 0;
+
+    memset(h, 0, sizeof(tar_header_t));
+    if (len <= sizeof(h->name)) {
+        memcpy(h->name, name, len);
+    } else {
+        for (i = len - sizeof(h->name) - 1; i <= sizeof(h->prefix) && name[i] != '/'; i++);
+        if (i > sizeof(h->prefix)) return ERROR;
+        memcpy(h->prefix, name, i);
+        memcpy(h->name, name + i + 1, len - i - 1);
+    }
+    if (sbuf->st_size >= 1L << 33) return ERROR; /* 11 octal digits */
+
+    snprintf(h->mode, sizeof(h->mode), "%07o", sbuf->st_mode & 0777);
+    snprintf(h->uid, sizeof(h->uid), "%07o", 0);
+    snprintf(h->gid, sizeof(h->gid), "%07o", 0);
+    snprintf(h->size, sizeof(h->size), "%011lo", (unsigned long) sbuf->st_size);
+    snprintf(h->mtime, sizeof(h->mtime), "%011lo", (unsigned long) sbuf->st_mtime);
+    h->typeflag = '0';
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+
+    /* the checksum is computed with its own field as spaces */
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    for (p = (const unsigned char *) h; p < (const unsigned char *) (h + 1); p++) sum += *p;
+    snprintf(h->chksum, sizeof(h->chksum) - 1, "%06o", sum);
+    return OKAY;
+}
@@ -0,0 +1,33 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_BATCH_H
+#define NAIVE_HTTP_BATCH_H
+
+#include <stdbool.h>
+#include "transaction.h"
+
+/*
+ * Batch download: GET <dir>?tar streams many files back as one ustar archive.
+ * The manifest lists one path per line, relative to <dir>, in the request body,
+ * or comma separated in the query as ?tar=a,b,c. Entry headers are built on
+ * the fly and file bodies go out with sendfile; the archive ends when the
+ * connection closes. Files that cannot be opened are left out.
+ */
+
+bool batch_requested(transaction_t *trans);
+
+void batch_start(int efd, transaction_t *trans, long header_len);
+
+void batch_begin(int efd, transaction_t *trans);
+
+void batch_next(int efd, transaction_t *trans);
+
+#endif //NAIVE_HTTP_BATCH_H
@@ -0,0 +1,155 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <iso646.h>
+#include <sys/epoll.h>
+#include "budget.h"
+#include "config.h"
+#include "diskio.h"
+#include "timer.h"
+#include "error_handler.h"
+#include "probes.h"
+
+static long in_flight = 0; /* bytes reserved by body reads */
+static long paused_bytes = 0; /* the part of in_flight held by paused transactions */
+static transaction_node_t *oldest = NULL, *newest = NULL; /* paused, oldest first */
+static int n_paused = 0;
+static long pauses = 0; /* since startup */
+static long long pressure_since = 0; /* monotonic ms the current episode started, 0 if none */
+
+static bool may_grant(long need);
+
+static void pause_reads(int efd, transaction_t *trans);
+
+static void resume_reads(int efd, transaction_t *trans);
+
+static void unlink_paused(transaction_t *trans);
+
+/* defined in http.c */
+void queue_transmission(transaction_t *trans);
+
+/*
+ * budget_admit - reserve the chunk read_n is about to fill.
+ * Returns false if trans was paused, budget_wake resumes it.
+ */
+bool budget_admit(int efd, transaction_t *trans) {
+    long need;
+
+    if (trans->paused) return false;
+    if (trans->body_spent) { /* the last chunk was handed on, keep only what is still buffered */
+        in_flight -= trans->body_held - trans->read_pos;
+        trans->body_held = trans->read_pos;
+        trans->body_spent = false;
+        budget_wake(efd);
+    }
+    need = trans->read_len - trans->body_held;
+    if (need <= 0) return true;
+    if (oldest == NULL && may_grant(need)) {
+        in_flight += need;
+        trans->body_held += need;
+        return true;
+    }
+    pause_reads(efd, trans);
+    return false;
+}
+
+/*
+ * budget_release - give back all trans holds, when it finishes
+ */
+void budget_release(int efd, transaction_t *trans) {
+    if (trans->paused) unlink_paused(trans);
+    in_flight -= trans->body_held;
+    trans->body_held = 0;
+    trans->body_spent = false;
+    budget_wake(efd);
+}
+
+/*
+ * budget_wake - resume paused transactions, oldest first, while there is room.
+ * Called when budget is given back and after every epoll batch for the disk queue.
+ */
+void budget_wake(int efd) {
+    transaction_t *trans;
+    long need;
+
+    while (oldest != NULL) {
+        trans = &oldest->transaction;
+        need = trans->read_len - trans->body_held;
+        if (need > 0 && not may_grant(need)) break;
+        unlink_paused(trans);
+        if (need > 0) {
+            in_flight += need;
+            trans->body_held += need;
+        }
+        resume_reads(efd, trans);
+    }
+}
+
+static bool may_grant(long need) {
+    if (config.upload_disk_backlog > 0 && disk_jobs_pending() >= config.upload_disk_backlog) return false;
+    if (config.upload_budget <= 0 || in_flight + need <= config.upload_budget) return true;
+    return in_flight == paused_bytes; /* nobody else would give any back */
+}
+
+static void pause_reads(int efd, transaction_t *trans) {
+    epoll_event_t event;
+
+    event.data.fd = trans->fd;
+    event.events = 0; /* errors and hangups are still reported */
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
+        unix_error("epoll ctl");
+    }
+    trans->paused = true;
+    trans->node->budget_older = newest;
+    trans->node->budget_newer = NULL;
+    if (newest) newest->budget_newer = trans->node;
+    else oldest = trans->node;
+    newest = trans->node;
+    n_paused += 1;
+    paused_bytes += trans->body_held;
+    pauses += 1;
+    PROBE3(pause, trans->fd, n_paused, in_flight);
+    if (pressure_since == 0) {
+        pressure_since = now_ms();
+        printf("upload backpressure on: %ld body bytes in flight, %d disk jobs queued\n",
+               in_flight, disk_jobs_pending());
+    }
+}
+
+static void resume_reads(int efd, transaction_t *trans) {
+    epoll_event_t event;
+
+    event.data.fd = trans->fd;
+    event.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
+        unix_error("epoll ctl");
+    }
+    PROBE3(resume, trans->fd, n_paused, in_flight);
+    update_access(trans);
+    queue_transmission(trans); /* whatever arrived while paused is waiting in the socket */
+}
+
+static void unlink_paused(transaction_t *trans) {
+    transaction_node_t *node = trans->node;
+
+    if (node->budget_older) node->budget_older->budget_newer = node->budget_newer;
+    else oldest = node->budget_newer;
+    if (node->budget_newer) node->budget_newer->budget_older = node->budget_older;
+    else newest = node->budget_older;
+    trans->paused = false;
+    n_paused -= 1;
+    paused_bytes -= trans->body_held;
+    if (oldest == NULL && pressure_since != 0) {
+        printf("upload backpressure off after %lld ms, %ld pauses since startup\n",
+               now_ms() - pressure_since, pauses);
+        pressure_since = 0;
+    }
+}
@@ -0,0 +1,41 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_BUDGET_H
+#define NAIVE_HTTP_BUDGET_H
+
+#include <stdbool.h>
+#include "transaction.h"
+
+/*
+ * Backpressure on request bodies.
+ *
+ * Before read_n fills a chunk of read_buf it reserves the chunk against
+ * config.upload_budget. The reservation is kept until the next chunk starts,
+ * so a chunk still being written by a disk worker counts, and is given back
+ * when the transaction finishes. A transaction that cannot get its chunk, or
+ * finds more than config.upload_disk_backlog disk jobs queued, is paused: its
+ * socket leaves EPOLLIN, the kernel's receive buffer fills and TCP flow control
+ * slows the client down. Paused transactions resume oldest first as budget is
+ * given back and the disk queue shrinks. When nothing else holds budget the
+ * oldest one is let through even past the limit, so a budget smaller than a
+ * chunk still makes progress.
+ *
+ * Transitions fire the pause and resume probes, see probes.h, and the first
+ * pause and the last resume of an episode are logged.
+ */
+
+bool budget_admit(int efd, transaction_t *trans);
+
+void budget_release(int efd, transaction_t *trans);
+
+void budget_wake(int efd);
+
+#endif //NAIVE_HTTP_BUDGET_H
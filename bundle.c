@@ -0,0 +1,120 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bundle.h"
+#include "error_handler.h"
+#include "misc.h"
+
+/* the bundle being served, mapped up to its payloads */
+static int fd = INVALID_FD;
+static const bundle_header_t *header;
+static const uint32_t *slots;
+static const bundle_entry_t *entries;
+static const char *strings;
+
+static int check_header(const bundle_header_t *h, const struct stat *sbuf);
+
+/*
+ * init_bundle - map the bundle at path, a no-op for "".
+ * Only the header is checked; entries are checked as they are found.
+ */
+int init_bundle(const char *path) {
+    struct stat sbuf;
+    bundle_header_t h;
+    const char *map;
+
+    if (path[0] == '\0') return OKAY;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &sbuf) < 0) {
+        unix_error("bundle: open");
+        return ERROR;
+    }
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || check_header(&h, &sbuf) == ERROR) {
+        app_error("bundle: not a bundle, truncated, or built on another kind of machine");
+        return ERROR;
+    }
+    map = mmap(NULL, h.payloads_off, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        unix_error("bundle: mmap");
+        return ERROR;
+    }
+    madvise((void *) map, h.payloads_off, MADV_RANDOM); /* lookups touch a slot and an entry */
+    header = (const bundle_header_t *) map;
+    slots = (const uint32_t *) (map + h.slots_off);
+    entries = (const bundle_entry_t *) (map + h.entries_off);
+    strings = map + h.strings_off;
+    if (strings[h.strings_len - 1] != '\0') { /* then every string ends within the table */
+        app_error("bundle: corrupt string table");
+        return ERROR;
+    }
+    printf("bundle %s: %u entries\n", path, h.n_entries);
+    return OKAY;
+}
+
+/*
+ * bundle_find - the entry of a path beneath the root, NULL if the bundle has none
+ */
+const bundle_entry_t *bundle_find(const char *path) {
+    uint64_t hash;
+    uint32_t mask, i, n, slot;
+    const bundle_entry_t *e;
+
+    if (header == NULL) return NULL;
+    hash = bundle_hash(path, strlen(path));
+    mask = header->n_slots - 1;
+    for (i = hash & mask, n = 0; n < header->n_slots; i = (i + 1) & mask, n++) {
+        if ((slot = slots[i]) == 0) return NULL;
+        if (slot > header->n_entries) return NULL; /* corrupt */
+        e = &entries[slot - 1];
+        if (e->hash != hash || e->path >= header->strings_len || strcmp(strings + e->path, path) != 0) continue;
+        if (e->type >= header->strings_len || e->offset < header->payloads_off ||
+            e->length > header->size - e->offset) {
+            return NULL;
+        }
+        return e;
+    }
+    return NULL;
+}
+
+const char *bundle_string(uint32_t off) {
+    return strings + off;
+}
+
+int bundle_fd() {
+    return fd;
+}
+
+uint64_t bundle_hash(const char *path, size_t len) { /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) path[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* the sections follow each other in order and end within the file */
+static int check_header(const bundle_header_t *h, const struct stat *sbuf) {
+    if (memcmp(h->magic, BUNDLE_MAGIC, sizeof(h->magic)) != 0) return ERROR;
+    if (h->size != (uint64_t) sbuf->st_size) return ERROR;
+    if (h->n_slots == 0 || (h->n_slots & (h->n_slots - 1)) != 0 || h->n_slots < h->n_entries) return ERROR;
+    if (h->slots_off != sizeof(bundle_header_t)) return ERROR;
+    if (h->entries_off != h->slots_off + (uint64_t) h->n_slots * sizeof(uint32_t)) return ERROR;
+    if (h->strings_off != h->entries_off + (uint64_t) h->n_entries * sizeof(bundle_entry_t)) return ERROR;
+    if (h->strings_len == 0 || h->strings_off + h->strings_len > h->payloads_off) return ERROR;
+    if (h->payloads_off > h->size) return ERROR;
+    return OKAY;
+}
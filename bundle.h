@@ -0,0 +1,64 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_BUNDLE_H
+#define NAIVE_HTTP_BUNDLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Asset bundle: many small read-only files packed into one, built by mkbundle.
+ *
+ *   header
+ *   slots      uint32_t[n_slots], open-addressed on bundle_hash(path), entry index + 1, 0 if empty
+ *   entries    bundle_entry_t[n_entries], sorted by path
+ *   strings    NUL-terminated paths and MIME types
+ *   payloads   each starting on a page boundary
+ *
+ * Integers are in host byte order; a bundle is built where it is served.
+ * The server maps everything before the payloads and never reads it in a loop,
+ * so loading takes the same time for ten entries or a million. Payloads are
+ * sent with sendfile at their offsets into the one bundle fd.
+ */
+
+#define BUNDLE_MAGIC "NHBUNDL1"
+#define BUNDLE_ALIGN 4096 /* payload alignment */
+#define BUNDLE_ETAG_LEN 32 /* hex digits of the ETag, the first half of the SHA-256 */
+
+typedef struct {
+    char magic[8];
+    uint32_t n_entries;
+    uint32_t n_slots; /* a power of two, at least twice n_entries */
+    uint64_t slots_off, entries_off, strings_off, strings_len;
+    uint64_t payloads_off; /* end of the mapped part */
+    uint64_t size; /* of the whole file, checked against fstat */
+} bundle_header_t;
+
+typedef struct {
+    uint64_t hash; /* bundle_hash of the path */
+    uint64_t offset; /* of the payload, from the start of the file */
+    uint64_t length;
+    uint32_t path; /* string table offsets */
+    uint32_t type;
+    char etag[BUNDLE_ETAG_LEN]; /* not NUL-terminated */
+} bundle_entry_t;
+
+int init_bundle(const char *path);
+
+const bundle_entry_t *bundle_find(const char *path);
+
+const char *bundle_string(uint32_t off);
+
+int bundle_fd();
+
+uint64_t bundle_hash(const char *path, size_t len);
+
+#endif //NAIVE_HTTP_BUNDLE_H
@@ -0,0 +1,437 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <ctype.h>
+#include "config.h"
+#include "error_handler.h"
+
+/*
+ * Configuration sources, later ones win:
+ *   1. built-in defaults
+ *   2. the config file given with -c, lines of "key = value", '#' starts a comment
+ *   3. command-line flags, "--key=value" or "--key value", and the positional port
+ * Sizes accept K/M/G suffixes.
+ */
+config_t config;
+
+typedef enum {
+    T_STR, T_INT, T_LONG, T_EVICT, T_PUBLISH, T_DURABILITY
+} option_type_e;
+
+typedef struct {
+    const char *name;
+    option_type_e type;
+    size_t offset;
+    bool reloadable;
+} option_t;
+
+#define OPT(field, type, reloadable) {#field, type, offsetof(config_t, field), reloadable}
+
+static const option_t options[] = {
+        OPT(port, T_STR, false),
+        OPT(root, T_STR, false),
+        OPT(max_buf, T_LONG, false),
+        OPT(max_event, T_INT, false),
+        OPT(max_transaction, T_INT, true),
+        OPT(max_hash, T_INT, false),
+        OPT(huge_pages, T_INT, false),
+        OPT(listenq, T_INT, true),
+        OPT(timeout, T_INT, true),
+        OPT(max_file_size, T_LONG, true),
+        OPT(drain_timeout, T_INT, true),
+        OPT(slow_request_ms, T_INT, true),
+        OPT(tcp_defer_accept, T_INT, true),
+        OPT(tcp_fastopen, T_INT, true),
+        OPT(tcp_nodelay, T_INT, true),
+        OPT(so_rcvbuf, T_INT, true),
+        OPT(so_sndbuf, T_INT, true),
+        OPT(so_busy_poll, T_INT, true),
+        OPT(tcp_notsent_lowat, T_INT, true),
+        OPT(proxy, T_STR, false),
+        OPT(proxy_connect_timeout, T_INT, true),
+        OPT(proxy_response_timeout, T_INT, true),
+        OPT(proxy_pool_size, T_INT, true),
+        OPT(proxy_idle_timeout, T_INT, true),
+        OPT(tls_cert, T_STR, false),
+        OPT(tls_key, T_STR, false),
+        OPT(tls_ktls, T_INT, true),
+        OPT(h2, T_INT, true),
+        OPT(h2_max_streams, T_INT, true),
+        OPT(disk_threads, T_INT, false),
+        OPT(dircache_size, T_INT, false),
+        OPT(dircache_ttl, T_INT, true),
+        OPT(rate_table_size, T_INT, false),
+        OPT(rate_decay, T_INT, true),
+        OPT(rate_reqs_per_sec, T_INT, true),
+        OPT(rate_reqs_burst, T_INT, true),
+        OPT(rate_max_conns, T_INT, true),
+        OPT(rate_bytes_per_sec, T_LONG, true),
+        OPT(rate_bytes_burst, T_LONG, true),
+        OPT(stream_min_size, T_LONG, true),
+        OPT(stream_window, T_LONG, true),
+        OPT(stream_evict, T_EVICT, true),
+        OPT(stream_evict_min_size, T_LONG, true),
+        OPT(untar_publish, T_PUBLISH, true),
+        OPT(dedup_dir, T_STR, false),
+        OPT(bundle, T_STR, false),
+        OPT(objstore_dir, T_STR, false),
+        OPT(objstore_max_size, T_LONG, true),
+        OPT(objstore_segment_size, T_LONG, false),
+        OPT(objstore_compact_garbage, T_INT, true),
+        OPT(warmup_file, T_STR, false),
+        OPT(warmup_table_size, T_INT, false),
+        OPT(warmup_half_life, T_INT, true),
+        OPT(warmup_interval, T_INT, true),
+        OPT(warmup_files, T_INT, true),
+        OPT(warmup_budget, T_LONG, true),
+        OPT(upload_durability, T_DURABILITY, true),
+        OPT(upload_sync_window, T_INT, true),
+        OPT(upload_budget, T_LONG, true),
+        OPT(upload_disk_backlog, T_INT, true),
+};
+
+#define N_OPTIONS (sizeof(options) / sizeof(options[0]))
+
+static const char *evict_names[] = {"never", "large", "streamed"};
+
+static const char *publish_names[] = {"entry", "archive"};
+
+static const char *durability_names[] = {"none", "fsync", "group"};
+
+/* command line, kept to be re-applied over the file on reload */
+static int saved_argc;
+static char **saved_argv;
+
+static void set_defaults(config_t *conf);
+
+static int parse_file(config_t *conf, const char *path);
+
+static int parse_args(config_t *conf, int argc, char **argv);
+
+static int set_option(config_t *conf, const char *key, const char *value);
+
+static int validate(config_t *conf);
+
+static void format_option(config_t *conf, const option_t *opt, char *buf, size_t len);
+
+/*
+ * load_config - build the configuration at startup.
+ * Returns ERROR after printing the reason on bad input.
+ */
+int load_config(int argc, char **argv) {
+    int i;
+    saved_argc = argc;
+    saved_argv = argv;
+    set_defaults(&config);
+    /* the config file comes first, whatever its position on the command line */
+    for (i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-c") == 0) strncpy(config.config_file, argv[i + 1], MAXLINE - 1);
+    }
+    if (config.config_file[0] && parse_file(&config, config.config_file) == ERROR) return ERROR;
+    if (parse_args(&config, argc, argv) == ERROR) return ERROR;
+    if (config.port[0] == '\0') {
+        usage(argv[0]);
+        return ERROR;
+    }
+    return validate(&config);
+}
+
+/*
+ * reload_config - re-read the config file and apply the reloadable settings.
+ * Changes to startup-only settings are reported and ignored.
+ * Returns ERROR, keeping the current configuration, if the file is invalid.
+ */
+int reload_config() {
+    config_t fresh;
+    char old_value[MAXLINE], new_value[MAXLINE];
+    size_t i;
+
+    set_defaults(&fresh);
+    strcpy(fresh.config_file, config.config_file);
+    if (fresh.config_file[0] && parse_file(&fresh, fresh.config_file) == ERROR) return ERROR;
+    if (parse_args(&fresh, saved_argc, saved_argv) == ERROR) return ERROR;
+    if (validate(&fresh) == ERROR) return ERROR;
+
+    for (i = 0; i < N_OPTIONS; i++) {
+        format_option(&config, &options[i], old_value, sizeof(old_value));
+        format_option(&fresh, &options[i], new_value, sizeof(new_value));
+        if (strcmp(old_value, new_value) == 0) continue;
+        if (options[i].reloadable) {
+            printf("config: %s %s -> %s\n", options[i].name, old_value, new_value);
+            set_option(&config, options[i].name, new_value);
+        } else {
+            printf("config: %s needs a restart, keeping %s\n", options[i].name, old_value);
+        }
+    }
+    return OKAY;
+}
+
+void print_config() {
+    char value[MAXLINE];
+    size_t i;
+    printf("Effective configuration%s%s:\n", config.config_file[0] ? " from " : "", config.config_file);
+    for (i = 0; i < N_OPTIONS; i++) {
+        format_option(&config, &options[i], value, sizeof(value));
+        printf("  %-24s %s%s\n", options[i].name, value, options[i].reloadable ? "" : " (restart)");
+    }
+}
+
+void usage(char *prog) {
+    size_t i;
+    fprintf(stderr, "usage: %s [-c <config file>] [--<key>=<value> ...] <port>\n", prog);
+    fprintf(stderr, "keys:");
+    for (i = 0; i < N_OPTIONS; i++) fprintf(stderr, " %s", options[i].name);
+    fprintf(stderr, "\n");
+}
+
+static void set_defaults(config_t *conf) {
+    memset(conf, 0, sizeof(config_t));
+    strcpy(conf->root, ".");
+    conf->max_buf = DEFAULT_MAX_BUF;
+    conf->max_event = DEFAULT_MAX_EVENT;
+    conf->max_transaction = DEFAULT_MAX_TRANSACTION;
+    conf->max_hash = DEFAULT_MAX_HASH;
+    conf->huge_pages = 0; /* back the transaction pool with huge pages, see transaction.c */
+    conf->listenq = DEFAULT_LISTENQ;
+    conf->timeout = DEFAULT_TIMEOUT;
+    conf->max_file_size = DEFAULT_MAX_FILE_SIZE;
+    conf->drain_timeout = 300; /* seconds in-flight transfers may take after an upgrade or SIGQUIT */
+    conf->slow_request_ms = 1000; /* log the stage breakdown of requests taking longer, 0 disables */
+    conf->tcp_defer_accept = 0; /* seconds to wait for request bytes before waking us on accept */
+    conf->tcp_fastopen = 0; /* TFO queue length on the listener */
+    conf->tcp_nodelay = 1;
+    conf->so_rcvbuf = 0;
+    conf->so_sndbuf = 0;
+    conf->so_busy_poll = 0; /* microseconds, raising it above net.core.busy_read needs CAP_NET_ADMIN */
+    conf->tcp_notsent_lowat = 0; /* bytes of unsent data below which a socket is writable */
+    conf->proxy_connect_timeout = 1000; /* ms */
+    conf->proxy_response_timeout = 30000; /* ms until the response header, and between body bytes */
+    conf->proxy_pool_size = 16; /* idle keep-alive connections per upstream */
+    conf->proxy_idle_timeout = 60; /* seconds an idle upstream connection is kept */
+    conf->tls_ktls = 1; /* offload sessions to kernel TLS when possible */
+    conf->h2 = 1; /* accept h2c, by prior knowledge or Upgrade */
+    conf->h2_max_streams = 100; /* SETTINGS_MAX_CONCURRENT_STREAMS */
+    conf->disk_threads = 4;
+    conf->dircache_size = 256;
+    conf->dircache_ttl = 5; /* seconds a cached directory fd is trusted, so renames are picked up */
+    conf->rate_table_size = 4096;
+    conf->rate_decay = 60; /* idle entries are reclaimed after this many seconds */
+    conf->rate_reqs_per_sec = 50;
+    conf->rate_reqs_burst = 100;
+    conf->rate_max_conns = 64;
+    conf->rate_bytes_per_sec = 0;
+    conf->rate_bytes_burst = 4194304; /* 4MiB */
+    conf->stream_min_size = 8388608; /* files at least 8MiB are streamed with readahead */
+    conf->stream_window = 4194304; /* readahead window ahead of the send cursor, 4MiB */
+    conf->stream_evict = EVICT_LARGE;
+    conf->untar_publish = PUBLISH_ARCHIVE;
+    conf->stream_evict_min_size = 104857600; /* 100MiB */
+    conf->objstore_max_size = 65536; /* larger uploads get a file of their own */
+    conf->objstore_segment_size = 67108864; /* 64MiB */
+    conf->objstore_compact_garbage = 50; /* percent of a sealed segment, 0 disables compaction */
+    conf->warmup_table_size = 4096; /* paths whose downloads are counted */
+    conf->warmup_half_life = 3600; /* seconds for a hit count to halve */
+    conf->warmup_interval = 60; /* seconds between summary writes, 0 writes it only when draining */
+    conf->warmup_files = 1000;
+    conf->warmup_budget = 268435456; /* 256MiB read ahead at startup */
+    conf->upload_durability = DURABILITY_NONE;
+    conf->upload_sync_window = 2; /* ms a group pass waits for more uploads, 0 takes what completed while the last one ran */
+    conf->upload_budget = 268435456; /* 256MiB of request bodies between sockets and disk, 0 for no limit */
+    conf->upload_disk_backlog = 64; /* queued disk jobs before body reads pause, 0 ignores the queue */
+}
+
+static int parse_file(config_t *conf, const char *path) {
+    FILE *fp;
+    char line[MAXLINE], *key, *value, *end;
+    int lineno = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        unix_error((char *) path);
+        return ERROR;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((end = strchr(line, '#')) != NULL) *end = '\0';
+        key = line;
+        while (isspace((unsigned char) *key)) key++;
+        if (*key == '\0') continue;
+        if ((value = strchr(key, '=')) == NULL) {
+            fprintf(stderr, "%s:%d: expected key = value\n", path, lineno);
+            fclose(fp);
+            return ERROR;
+        }
+        /* trim both sides */
+        end = value;
+        *value++ = '\0';
+        while (end > key && isspace((unsigned char) end[-1])) *--end = '\0';
+        while (isspace((unsigned char) *value)) value++;
+        end = value + strlen(value);
+        while (end > value && isspace((unsigned char) end[-1])) *--end = '\0';
+        if (set_option(conf, key, value) == ERROR) {
+            fprintf(stderr, "%s:%d: invalid setting %s = %s\n", path, lineno, key, value);
+            fclose(fp);
+            return ERROR;
+        }
+    }
+    fclose(fp);
+    return OKAY;
+}
+
+static int parse_args(config_t *conf, int argc, char **argv) {
+    int i;
+    char key[MAXLINE], *value, *eq;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            i++; /* already loaded */
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            strncpy(key, argv[i] + 2, MAXLINE - 1);
+            key[MAXLINE - 1] = '\0';
+            if ((eq = strchr(key, '=')) != NULL) {
+                *eq = '\0';
+                value = eq + 1;
+            } else if (i + 1 < argc) {
+                value = argv[++i];
+            } else {
+                value = "";
+            }
+            /* flags use dashes or underscores alike */
+            for (eq = key; *eq; eq++) if (*eq == '-') *eq = '_';
+            if (set_option(conf, key, value) == ERROR) {
+                fprintf(stderr, "invalid flag --%s %s\n", key, value);
+                usage(argv[0]);
+                return ERROR;
+            }
+        } else if (argv[i][0] != '-') {
+            strncpy(conf->port, argv[i], MAXLINE - 1);
+        } else {
+            usage(argv[0]);
+            return ERROR;
+        }
+    }
+    return OKAY;
+}
+
+/*
+ * set_option - parse value into the field named key
+ */
+static int set_option(config_t *conf, const char *key, const char *value) {
+    size_t i;
+    int j;
+    char *end;
+    long long n;
+    void *field;
+
+    for (i = 0; i < N_OPTIONS; i++) {
+        if (strcmp(options[i].name, key) == 0) break;
+    }
+    if (i == N_OPTIONS) return ERROR;
+    field = (char *) conf + options[i].offset;
+
+    switch (options[i].type) {
+        case T_STR:
+            if (strlen(value) >= MAXLINE) return ERROR;
+            strcpy((char *) field, value);
+            return OKAY;
+        case T_EVICT:
+            for (j = 0; j < (int) (sizeof(evict_names) / sizeof(evict_names[0])); j++) {
+                if (strcasecmp(value, evict_names[j]) == 0) {
+                    *(int *) field = j;
+                    return OKAY;
+                }
+            }
+            return ERROR;
+        case T_PUBLISH:
+            for (j = 0; j < (int) (sizeof(publish_names) / sizeof(publish_names[0])); j++) {
+                if (strcasecmp(value, publish_names[j]) == 0) {
+                    *(int *) field = j;
+                    return OKAY;
+                }
+            }
+            return ERROR;
+        case T_DURABILITY:
+            for (j = 0; j < (int) (sizeof(durability_names) / sizeof(durability_names[0])); j++) {
+                if (strcasecmp(value, durability_names[j]) == 0) {
+                    *(int *) field = j;
+                    return OKAY;
+                }
+            }
+            return ERROR;
+        case T_INT:
+        case T_LONG:
+            n = strtoll(value, &end, 10);
+            if (end == value || n < 0) return ERROR;
+            switch (*end) {
+                case 'k': case 'K': n <<= 10; end++; break;
+                case 'm': case 'M': n <<= 20; end++; break;
+                case 'g': case 'G': n <<= 30; end++; break;
+            }
+            if (*end != '\0') return ERROR;
+            if (options[i].type == T_INT) {
+                if (n > 0x7fffffff) return ERROR;
+                *(int *) field = (int) n;
+            } else {
+                *(long *) field = (long) n;
+            }
+            return OKAY;
+    }
+    return ERROR;
+}
+
+static int validate(config_t *conf) {
+    if (conf->max_buf < MAXLINE) {
+        app_error("config: max_buf must hold at least a request line");
+        return ERROR;
+    }
+    if (conf->max_event <= 0 || conf->max_transaction <= 0 || conf->max_hash <= 0 ||
+        conf->disk_threads <= 0 || conf->listenq <= 0) {
+        app_error("config: max_event, max_transaction, max_hash, listenq and disk_threads must be positive");
+        return ERROR;
+    }
+    if (conf->rate_table_size <= 0 || (conf->rate_table_size & (conf->rate_table_size - 1)) ||
+        conf->dircache_size <= 0 || (conf->dircache_size & (conf->dircache_size - 1)) ||
+        conf->warmup_table_size <= 0 || (conf->warmup_table_size & (conf->warmup_table_size - 1))) {
+        app_error("config: rate_table_size, dircache_size and warmup_table_size must be powers of 2");
+        return ERROR;
+    }
+    if (conf->stream_window <= 0) {
+        app_error("config: stream_window must be positive");
+        return ERROR;
+    }
+    return OKAY;
+}
+
+static void format_option(config_t *conf, const option_t *opt, char *buf, size_t len) {
+    void *field = (char *) conf + opt->offset;
+    switch (opt->type) {
+        case T_STR:
+            snprintf(buf, len, "%s", (char *) field);
+            break;
+        case T_INT:
+            snprintf(buf, len, "%d", *(int *) field);
+            break;
+        case T_LONG:
+            snprintf(buf, len, "%ld", *(long *) field);
+            break;
+        case T_EVICT:
+            snprintf(buf, len, "%s", evict_names[*(int *) field]);
+            break;
+        case T_PUBLISH:
+            snprintf(buf, len, "%s", publish_names[*(int *) field]);
+            break;
+        case T_DURABILITY:
+            snprintf(buf, len, "%s", durability_names[*(int *) field]);
+            break;
+    }
+}
@@ -0,0 +1,135 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_CONFIG_H
+#define NAIVE_HTTP_CONFIG_H
+
+#include <stdbool.h>
+#include "misc.h"
+
+/* defaults */
+#define DEFAULT_MAX_BUF 1048576 /* per-connection buffer size 1MiB */
+#define DEFAULT_MAX_EVENT 64 /* maximum epoll events per wakeup */
+#define DEFAULT_MAX_TRANSACTION 1024 /* maximum transactions */
+#define DEFAULT_MAX_HASH 4096 /* transaction hash map size */
+#define DEFAULT_LISTENQ 1024 /* listen backlog, as in CS:APP3e */
+#define DEFAULT_TIMEOUT 100 /* transaction time out time, in seconds */
+#define DEFAULT_MAX_FILE_SIZE 1073741824 /* Only accept files smaller than 1GiB */
+
+/* page-cache eviction policy behind the send cursor, see stream.c */
+#define EVICT_NEVER 0 /* keep everything cached */
+#define EVICT_LARGE 1 /* drop pages of files at least stream_evict_min_size large, they are one-shot */
+#define EVICT_STREAMED 2 /* drop pages of every streamed file */
+
+/* when unpacked tar entries become visible, see untar.c */
+#define PUBLISH_ENTRY 0 /* each entry as soon as it is complete */
+#define PUBLISH_ARCHIVE 1 /* all entries once the whole archive arrived, none if it did not */
+
+/* when uploads are acknowledged, see durable.h */
+#define DURABILITY_NONE 0 /* once in the page cache */
+#define DURABILITY_FSYNC 1 /* once synced on their own */
+#define DURABILITY_GROUP 2 /* once synced in a batch */
+
+/*
+ * Effective configuration.
+ * Built from defaults, then the config file, then command-line flags.
+ * Fields marked reloadable in config.c are re-read on SIGHUP; the others size
+ * data structures at startup and need a restart.
+ */
+typedef struct {
+    /* server */
+    char port[MAXLINE];
+    char root[MAXLINE];
+    char config_file[MAXLINE];
+    long max_buf;
+    int max_event;
+    int max_transaction;
+    int max_hash;
+    int huge_pages;
+    int listenq;
+    int timeout;
+    long max_file_size;
+    int drain_timeout;
+    int slow_request_ms;
+    /* socket tuning, 0 leaves the kernel default, see socket_util.c */
+    int tcp_defer_accept;
+    int tcp_fastopen;
+    int tcp_nodelay;
+    int so_rcvbuf;
+    int so_sndbuf;
+    int so_busy_poll;
+    int tcp_notsent_lowat;
+    /* reverse proxy, see proxy.c */
+    char proxy[MAXLINE];
+    int proxy_connect_timeout;
+    int proxy_response_timeout;
+    int proxy_pool_size;
+    int proxy_idle_timeout;
+    /* TLS termination, see tls.c */
+    char tls_cert[MAXLINE];
+    char tls_key[MAXLINE];
+    int tls_ktls;
+    /* HTTP/2, see h2.c */
+    int h2;
+    int h2_max_streams;
+    /* disk workers and namespace, see diskio.c and namespace.c */
+    int disk_threads;
+    int dircache_size;
+    int dircache_ttl;
+    /* per-client limits, 0 disables the corresponding limit, see ratelimit.c */
+    int rate_table_size;
+    int rate_decay;
+    int rate_reqs_per_sec;
+    int rate_reqs_burst;
+    int rate_max_conns;
+    long rate_bytes_per_sec;
+    long rate_bytes_burst;
+    /* large-file streaming, see stream.c */
+    long stream_min_size;
+    long stream_window;
+    int stream_evict;
+    long stream_evict_min_size;
+    /* tar uploads, see untar.c */
+    int untar_publish;
+    /* deduplicating uploads, "" stores every upload as is, see dedup.c */
+    char dedup_dir[MAXLINE];
+    /* asset bundle served before the root, "" for none, see bundle.h */
+    char bundle[MAXLINE];
+    /* small uploads in a log-structured store, "" for none, see objstore.h */
+    char objstore_dir[MAXLINE];
+    long objstore_max_size;
+    long objstore_segment_size;
+    int objstore_compact_garbage;
+    /* page-cache warmup from download history, "" for none, see warmup.h */
+    char warmup_file[MAXLINE];
+    int warmup_table_size;
+    int warmup_half_life;
+    int warmup_interval;
+    int warmup_files;
+    long warmup_budget;
+    /* upload durability, see durable.h */
+    int upload_durability;
+    int upload_sync_window;
+    /* backpressure on request bodies, see budget.h */
+    long upload_budget;
+    int upload_disk_backlog;
+} config_t;
+
+extern config_t config;
+
+int load_config(int argc, char **argv);
+
+int reload_config();
+
+void print_config();
+
+void usage(char *prog);
+
+#endif //NAIVE_HTTP_CONFIG_H
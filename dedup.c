@@ -0,0 +1,339 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <openssl/evp.h>
+#include "dedup.h"
+#include "config.h"
+#include "diskio.h"
+#include "arena.h"
+#include "errors.h"
+#include "namespace.h"
+#include "durable.h"
+
+typedef struct _dedup {
+    EVP_MD_CTX *digest; /* NULL until the body is read */
+    char expected[ETAG_LEN + 1]; /* from X-Content-SHA256, "" if not sent */
+    char etag[ETAG_LEN + 1];
+    char name[MAXLINE]; /* the uploaded name, filename is the temporary file meanwhile */
+    char object[MAXLINE];
+    bool stored; /* the object is new, its directory is synced too when durable */
+} dedup_t;
+
+static unsigned long uploads = 0; /* numbers the temporary files, with the pid as an upgrade runs two servers */
+
+/* defined in http.c */
+void queue_protocol(transaction_t *trans);
+
+void queue_transmission(transaction_t *trans);
+
+bool finish_if_aborted(int efd, transaction_t *trans);
+
+void client_error(int efd, transaction_t *trans, char *cause, error_e err);
+
+void send_continue(transaction_t *trans);
+
+static bool orphaned(int dirfd, const char *name);
+
+static bool in_store(const char *path);
+
+static int parse_digest(const char *value, char *hex);
+
+static int object_path(const char *hex, char *path);
+
+static void begin_upload(int efd, transaction_t *trans, dedup_t *d);
+
+static void store(int efd, transaction_t *trans, dedup_t *d);
+
+static void wait_store(transaction_t *trans, disk_op_e op, disk_done_cb_t done, const char *path,
+                       const char *target);
+
+static void on_stored(int efd, disk_job_t *job);
+
+static void on_linked(int efd, disk_job_t *job);
+
+static void sync_name(transaction_t *trans, const char *path);
+
+static void on_name_synced(int efd, disk_job_t *job);
+
+static void respond_created(int efd, transaction_t *trans, dedup_t *d);
+
+/*
+ * init_dedup - remove the temporary files of uploads cut short by a crash.
+ * Those of a live process, the other server during an upgrade, are kept.
+ */
+int init_dedup() {
+    struct dirent *ent;
+    DIR *dir;
+    int fd, removed = 0;
+
+    if (config.dedup_dir[0] == '\0') return OKAY;
+    if ((fd = ns_open(config.dedup_dir, O_RDONLY | O_DIRECTORY, 0)) < 0) {
+        if (errno == ENOENT) return OKAY; /* created by the first upload */
+        unix_error("dedup: open store");
+        return ERROR;
+    }
+    if ((dir = fdopendir(fd)) == NULL) {
+        unix_error("dedup: open store");
+        close(fd);
+        return ERROR;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        if (!orphaned(fd, ent->d_name)) continue;
+        if (unlinkat(fd, ent->d_name, 0) < 0) unix_error("dedup: remove temporary file");
+        else removed++;
+    }
+    closedir(dir);
+    if (removed > 0) printf("dedup: removed %d temporary files of interrupted uploads\n", removed);
+    return OKAY;
+}
+
+/*
+ * orphaned - whether name is a temporary file no process writes to.
+ * Names without a pid, from before it was added, count once they are older
+ * than the longest an old server may drain for.
+ */
+static bool orphaned(int dirfd, const char *name) {
+    struct stat sbuf;
+    unsigned long n;
+    int pid, end = 0;
+
+    if (sscanf(name, "upload-%d-%lu.tmp%n", &pid, &n, &end) == 2 && name[end] == '\0') {
+        return pid != getpid() && kill(pid, 0) < 0 && errno == ESRCH;
+    }
+    end = 0;
+    if (sscanf(name, "upload-%lu.tmp%n", &n, &end) == 1 && name[end] == '\0') {
+        return fstatat(dirfd, name, &sbuf, AT_SYMLINK_NOFOLLOW) == 0 &&
+               time(NULL) - sbuf.st_mtime > config.drain_timeout;
+    }
+    return false;
+}
+
+bool dedup_requested(transaction_t *trans) {
+    return config.dedup_dir[0] != '\0';
+}
+
+/*
+ * dedup_step - the P_DEDUP stage of an upload.
+ * First look up the announced digest, then, once serve_upload has written the
+ * body to a temporary file, store it under its digest.
+ */
+void dedup_step(int efd, transaction_t *trans) {
+    dedup_t *d = trans->dedup;
+    const char *expected;
+
+    if (d != NULL) {
+        store(efd, trans, d);
+        return;
+    }
+    if (in_store(trans->req->filename)) { /* names there must match their content */
+        client_error(efd, trans, trans->req->filename, E_FORBIDDEN);
+        return;
+    }
+    if ((d = arena_alloc(&trans->headers.arena, sizeof(dedup_t))) == NULL) {
+        unix_error("fatal: malloc");
+        exit(-2);
+    }
+    memset(d, 0, sizeof(dedup_t));
+    strcpy(d->name, trans->req->filename);
+    trans->dedup = d;
+
+    if ((expected = get_header(&trans->headers, H_CONTENT_SHA256)) != NULL) {
+        if (parse_digest(expected, d->expected) == ERROR) {
+            client_error(efd, trans, "X-Content-SHA256", E_BAD_HEADER);
+            return;
+        }
+        /* already stored: link it and skip the body. on_linked uploads it otherwise. */
+        strcpy(d->etag, d->expected);
+        if (object_path(d->expected, d->object) == ERROR) {
+            client_error(efd, trans, d->name, E_CREATE_FAILED);
+            return;
+        }
+        wait_store(trans, D_LINK, on_linked, d->object, d->name);
+        return;
+    }
+    begin_upload(efd, trans, d);
+}
+
+/* free the digest of an upload cut short */
+void dedup_finish(transaction_t *trans) {
+    dedup_t *d = trans->dedup;
+    if (d == NULL) return;
+    EVP_MD_CTX_free(d->digest);
+    trans->disk_job.digest = NULL;
+    trans->dedup = NULL; /* freed with the header arena */
+}
+
+static bool in_store(const char *path) {
+    size_t len = strlen(config.dedup_dir);
+    return strncmp(path, config.dedup_dir, len) == 0 && (path[len] == '/' || path[len] == '\0');
+}
+
+/* 64 hex digits, lowercased into hex */
+static int parse_digest(const char *value, char *hex) {
+    int i;
+    for (i = 0; i < ETAG_LEN; i++) {
+        if (!isxdigit((unsigned char) value[i])) return ERROR;
+        hex[i] = (char) tolower((unsigned char) value[i]);
+    }
+    hex[i] = '\0';
+    return value[i] == '\0' ? OKAY : ERROR;
+}
+
+static int object_path(const char *hex, char *path) {
+    return snprintf(path, MAXLINE, "%s/%.2s/%s", config.dedup_dir, hex, hex) < MAXLINE ? OKAY : ERROR;
+}
+
+/* write the body to a temporary file in the store, the disk workers hash it on the way */
+static void begin_upload(int efd, transaction_t *trans, dedup_t *d) {
+    if ((d->digest = EVP_MD_CTX_new()) == NULL || EVP_DigestInit_ex(d->digest, EVP_sha256(), NULL) != 1) {
+        app_error("fatal: EVP_DigestInit_ex");
+        exit(-2);
+    }
+    trans->disk_job.digest = d->digest;
+    if (snprintf(trans->req->filename, MAXLINE, "%s/upload-%d-%lu.tmp", config.dedup_dir, (int) getpid(),
+                 uploads++) >= MAXLINE) {
+        client_error(efd, trans, d->name, E_CREATE_FAILED);
+        return;
+    }
+    send_continue(trans);
+    trans->state = S_READ;
+    trans->next_stage = P_READ_REQ_BODY; /* continue_upload comes back to P_DEDUP */
+    queue_protocol(trans);
+}
+
+static void store(int efd, transaction_t *trans, dedup_t *d) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len, i;
+
+    trans->disk_job.digest = NULL;
+    if (EVP_DigestFinal_ex(d->digest, md, &len) != 1 || len * 2 != ETAG_LEN) {
+        app_error("EVP_DigestFinal_ex");
+        client_error(efd, trans, d->name, E_WRITE_FAILED);
+        return;
+    }
+    for (i = 0; i < len; i++) sprintf(d->etag + i * 2, "%02x", md[i]);
+    if ((d->expected[0] != '\0' && strcmp(d->etag, d->expected) != 0) || object_path(d->etag, d->object) == ERROR) {
+        submit_disk_close(INVALID_FD, trans->dest_file, trans->req->filename);
+        trans->dest_file = NULL;
+        trans->write_fd = INVALID_FD;
+        client_error(efd, trans, d->name, d->expected[0] != '\0' ? E_DIGEST_MISMATCH : E_CREATE_FAILED);
+        return;
+    }
+    memcpy(trans->disk_job.etag, d->etag, sizeof(d->etag));
+    wait_store(trans, D_STORE, on_stored, trans->req->filename, d->object);
+    trans->dest_file = NULL; /* closed by the job */
+    trans->write_fd = INVALID_FD;
+}
+
+/* like wait_disk, for the store's own paths */
+static void wait_store(transaction_t *trans, disk_op_e op, disk_done_cb_t done, const char *path,
+                       const char *target) {
+    disk_job_t *job = &trans->disk_job;
+    job->op = op;
+    job->done = done;
+    job->arg = trans;
+    strncpy(job->path, path, MAXLINE - 1);
+    job->path[MAXLINE - 1] = '\0';
+    job->fd = INVALID_FD;
+    job->file = trans->dest_file;
+    job->target = target;
+    trans->state = S_WAIT_DISK;
+    submit_disk_job(job);
+}
+
+static void on_stored(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    dedup_t *d = trans->dedup;
+    if (finish_if_aborted(efd, trans)) return;
+    if (job->result == ERROR) {
+        posix_error(job->err, "dedup: store");
+        client_error(efd, trans, d->name, E_WRITE_FAILED);
+        return;
+    }
+    printf("dedup: %s %s\n", job->existed ? "already stored" : "stored", d->etag);
+    d->stored = !job->existed;
+    wait_store(trans, D_LINK, on_linked, d->object, d->name);
+}
+
+static void on_linked(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    dedup_t *d = trans->dedup;
+    if (finish_if_aborted(efd, trans)) return;
+    if (job->result == ERROR && d->digest == NULL) { /* not stored yet, take the body after all */
+        begin_upload(efd, trans, d);
+        return;
+    }
+    if (job->result == ERROR) {
+        posix_error(job->err, "dedup: link");
+        client_error(efd, trans, d->name, E_CREATE_FAILED);
+        return;
+    }
+    if (d->digest == NULL) printf("dedup: %s linked without its body\n", d->name);
+    if (durable_uploads()) { /* the body was synced by continue_upload, the new names are left */
+        sync_name(trans, d->stored ? d->object : d->name);
+        return;
+    }
+    respond_created(efd, trans, d);
+}
+
+/* sync the directory holding path, on_name_synced goes on with the next */
+static void sync_name(transaction_t *trans, const char *path) {
+    disk_job_t *job = &trans->disk_job;
+    strncpy(job->path, path, MAXLINE - 1);
+    job->path[MAXLINE - 1] = '\0';
+    job->file = NULL;
+    job->fd = INVALID_FD;
+    job->target = NULL;
+    wait_sync(trans, on_name_synced);
+}
+
+static void on_name_synced(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    dedup_t *d = trans->dedup;
+    if (finish_if_aborted(efd, trans)) return;
+    if (job->result == ERROR) {
+        posix_error(job->err, "dedup: sync");
+        client_error(efd, trans, d->name, E_WRITE_FAILED);
+        return;
+    }
+    if (d->stored) { /* the object first, then the name linking to it */
+        d->stored = false;
+        sync_name(trans, d->name);
+        return;
+    }
+    respond_created(efd, trans, d);
+}
+
+static void respond_created(int efd, transaction_t *trans, dedup_t *d) {
+    epoll_event_t event;
+    outq_printf(&trans->outq, "HTTP/1.0 201 Created\r\n"
+                              "Server: Naive HTTP Server\r\n"
+                              "Connection: close\r\n"
+                              "ETag: \"%s\"\r\nContent-Length: 0\r\n\r\n", d->etag);
+    event.data.fd = trans->fd;
+    event.events = EPOLLOUT | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
+        unix_error("epoll ctl");
+    }
+    trans->state = S_WRITE;
+    trans->next_stage = P_DONE;
+    queue_transmission(trans);
+}
@@ -0,0 +1,36 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_DEDUP_H
+#define NAIVE_HTTP_DEDUP_H
+
+#include <stdbool.h>
+#include "transaction.h"
+
+/*
+ * Deduplicating uploads, on when config.dedup_dir is set.
+ * Bodies are hashed with SHA-256 by the disk workers as they are written, then
+ * stored once as <dedup_dir>/<2 hex>/<64 hex> and linked to the uploaded name.
+ * A client that sends X-Content-SHA256 gets a 201 without sending the body when
+ * that content is already stored, and a 400 if the body does not match it.
+ * The digest is the strong ETag of GETs through any of the names.
+ * Bodies are written to <dedup_dir>/upload-<pid>-<n>.tmp first; init_dedup
+ * removes those left behind by a process that is gone.
+ */
+
+int init_dedup();
+
+bool dedup_requested(transaction_t *trans);
+
+void dedup_step(int efd, transaction_t *trans);
+
+void dedup_finish(transaction_t *trans);
+
+#endif //NAIVE_HTTP_DEDUP_H
@@ -0,0 +1,445 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE /* readahead */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/xattr.h>
+#include "diskio.h"
+#include "error_handler.h"
+#include "namespace.h"
+#include "config.h"
+#include "objstore.h"
+
+#define ETAG_XATTR "user.naive_http.sha256" /* set on deduplicated bodies by D_STORE */
+
+/*
+ * Worker pool for blocking disk operations.
+ * Jobs go in through a mutex-protected queue and come back through a completion
+ * list; the workers signal the event loop with an eventfd, so a stalled
+ * open or write never freezes other connections.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static disk_job_t *pending_head = NULL, *pending_tail = NULL;
+static disk_job_t *done_head = NULL;
+static disk_job_t *free_jobs = NULL; /* recycled close jobs */
+static int in_flight = 0; /* submitted and not yet run */
+static int eventfd_ = INVALID_FD;
+
+static void *disk_worker(void *arg);
+
+static void run_job(disk_job_t *job);
+
+static void get_etag(disk_job_t *job);
+
+static int save_file(disk_job_t *job);
+
+static int sync_dir(const char *dir);
+
+static int sync_batch(disk_job_t *job);
+
+static int sync_data(disk_job_t *job);
+
+static bool same_file(const disk_job_t *a, const disk_job_t *b);
+
+static bool same_dir(const disk_job_t *a, const disk_job_t *b);
+
+static disk_job_t *alloc_job();
+
+/*
+ * init_disk_workers - create the completion eventfd and start the workers.
+ * Returns the eventfd, or ERROR.
+ */
+int init_disk_workers(int efd) {
+    int i, rc;
+    pthread_t tid;
+
+    eventfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventfd_ < 0) {
+        unix_error("eventfd");
+        return ERROR;
+    }
+    epoll_event_t event;
+    event.data.fd = eventfd_;
+    event.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, eventfd_, &event) < 0) {
+        unix_error("epoll add eventfd");
+        return ERROR;
+    }
+    for (i = 0; i < config.disk_threads; i++) {
+        if ((rc = pthread_create(&tid, NULL, disk_worker, NULL)) != 0) {
+            posix_error(rc, "pthread_create");
+            return ERROR;
+        }
+        pthread_detach(tid);
+    }
+    return eventfd_;
+}
+
+void submit_disk_job(disk_job_t *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&lock);
+    if (pending_tail) pending_tail->next = job;
+    else pending_head = job;
+    pending_tail = job;
+    in_flight += 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * submit_disk_close - close an upload/download file off the loop.
+ * If remove_path is given the file is removed before its lock is dropped.
+ */
+void submit_disk_close(int fd, FILE *file, char *remove_path) {
+    disk_job_t *job = alloc_job();
+    job->op = D_CLOSE;
+    job->done = NULL;
+    job->arg = NULL;
+    job->fd = fd;
+    job->file = file;
+    job->remove_path = remove_path != NULL;
+    if (remove_path) {
+        strncpy(job->path, remove_path, MAXLINE - 1);
+        job->path[MAXLINE - 1] = '\0'; /* a recycled job keeps whatever was there */
+    }
+    submit_disk_job(job);
+}
+
+/*
+ * submit_disk_advice - prefetch [ra_off, ra_off + ra_len) and evict [drop_off, drop_off + drop_len).
+ * fd is owned by the job and closed afterwards.
+ */
+void submit_disk_advice(int fd, long ra_off, long ra_len, long drop_off, long drop_len) {
+    disk_job_t *job = alloc_job();
+    job->op = D_ADVISE;
+    job->done = NULL;
+    job->arg = NULL;
+    job->fd = fd;
+    job->file = NULL;
+    job->off = ra_off;
+    job->len = ra_len;
+    job->drop_off = drop_off;
+    job->drop_len = drop_len;
+    submit_disk_job(job);
+}
+
+/* fire and forget jobs are recycled through a free list */
+static disk_job_t *alloc_job() {
+    disk_job_t *job;
+    pthread_mutex_lock(&lock);
+    job = free_jobs;
+    if (job) free_jobs = job->next;
+    pthread_mutex_unlock(&lock);
+    if (job == NULL && (job = malloc(sizeof(disk_job_t))) == NULL) {
+        unix_error("fatal: malloc");
+        exit(-1);
+    }
+    return job;
+}
+
+/*
+ * disk_jobs_pending - number of jobs not finished yet, e.g. closes that remove partial uploads
+ */
+int disk_jobs_pending() {
+    int n;
+    pthread_mutex_lock(&lock);
+    n = in_flight;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+/*
+ * handle_disk_event - run completion callbacks of finished jobs on the loop thread
+ */
+void handle_disk_event(int efd) {
+    uint64_t cnt;
+    disk_job_t *job, *next, *reversed = NULL;
+
+    if (read(eventfd_, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        unix_error("read eventfd");
+    }
+    pthread_mutex_lock(&lock);
+    job = done_head;
+    done_head = NULL;
+    pthread_mutex_unlock(&lock);
+
+    /* completions are pushed LIFO, restore submission order */
+    for (; job; job = next) {
+        next = job->next;
+        job->next = reversed;
+        reversed = job;
+    }
+    for (job = reversed; job; job = next) {
+        next = job->next;
+        job->done(efd, job);
+    }
+}
+
+static void *disk_worker(void *arg) {
+    disk_job_t *job;
+    uint64_t one = 1;
+    bool wake;
+    while (true) {
+        pthread_mutex_lock(&lock);
+        while (pending_head == NULL) pthread_cond_wait(&cond, &lock);
+        job = pending_head;
+        pending_head = job->next;
+        if (pending_head == NULL) pending_tail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        run_job(job);
+
+        pthread_mutex_lock(&lock);
+        in_flight -= 1;
+        /* the loop also looks at the queue going below the backlog that pauses body reads */
+        wake = job->done != NULL || in_flight == config.upload_disk_backlog - 1;
+        if (job->done) {
+            job->next = done_head;
+            done_head = job;
+        } else { /* fire and forget, recycle */
+            job->next = free_jobs;
+            free_jobs = job;
+        }
+        pthread_mutex_unlock(&lock);
+        if (wake && write(eventfd_, &one, sizeof(one)) < 0) {
+            unix_error("write eventfd");
+        }
+    }
+    return NULL;
+}
+
+static void run_job(disk_job_t *job) {
+    job->result = OKAY;
+    job->err = 0;
+    job->not_regular = false;
+    job->lock_busy = false;
+    switch (job->op) {
+        case D_OPEN_READ:
+            job->fd = ns_open(job->path, O_RDONLY | O_NONBLOCK, 0);
+            if (job->fd < 0) break;
+            if (fstat(job->fd, &job->sbuf) < 0) break;
+            if (!(S_ISREG(job->sbuf.st_mode)) || !(S_IRUSR & job->sbuf.st_mode)) {
+                job->not_regular = true;
+                break;
+            }
+            get_etag(job);
+            /* file size is not changed while the shared lock is held */
+            if (flock(job->fd, LOCK_SH | LOCK_NB) < 0) {
+                job->lock_busy = (errno == EWOULDBLOCK);
+                break;
+            }
+            return;
+        case D_OPEN_WRITE:
+            /*
+             * Create new file.
+             * Use exclusive file lock to deal with consistency.
+             * Permission: only owner can read/write.
+             */
+            job->fd = ns_open(job->path, O_WRONLY | O_CREAT, S_IWUSR | S_IRUSR);
+            if (job->fd < 0) break;
+            if (fstat(job->fd, &job->sbuf) < 0) break;
+            if (job->sbuf.st_nlink > 1) {
+                /* a name of a deduplicated body, replace it instead of writing through to the other names */
+                close(job->fd);
+                job->fd = INVALID_FD;
+                if (ns_unlink(job->path) < 0 && errno != ENOENT) break;
+                job->fd = ns_open(job->path, O_WRONLY | O_CREAT, S_IWUSR | S_IRUSR);
+                if (job->fd < 0) break;
+            }
+            if (flock(job->fd, LOCK_EX | LOCK_NB) < 0) {
+                job->lock_busy = (errno == EWOULDBLOCK);
+                break;
+            }
+            /* truncate only once the lock is ours, readers may still hold the old content */
+            if (ftruncate(job->fd, 0) < 0) break;
+            if ((job->file = fdopen(job->fd, "w")) == NULL) break;
+            return;
+        case D_WRITE:
+            if (fwrite(job->buf, sizeof(char), job->len, job->file) < job->len) break;
+            if (job->digest != NULL && EVP_DigestUpdate(job->digest, job->buf, job->len) != 1) break;
+            return;
+        case D_CLOSE:
+            if (job->remove_path && ns_unlink(job->path) < 0) {
+                unix_error("remove failed. But it's safe to ignore."); /* Just ignore. */
+            }
+            if (job->file != NULL) {
+                if (fclose(job->file) != 0) unix_error("fclose failed");
+            } else if (job->fd >= 0 && close(job->fd) < 0) {
+                unix_error("close file");
+            }
+            return;
+        case D_ADVISE:
+            if (job->len > 0) {
+                if (job->off == 0) posix_fadvise(job->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                if (readahead(job->fd, job->off, job->len) < 0) {
+                    posix_fadvise(job->fd, job->off, job->len, POSIX_FADV_WILLNEED);
+                }
+            }
+            if (job->drop_len > 0) posix_fadvise(job->fd, job->drop_off, job->drop_len, POSIX_FADV_DONTNEED);
+            close(job->fd);
+            return;
+        case D_PUBLISH:
+            if (job->file != NULL) {
+                FILE *file = job->file;
+                job->file = NULL; /* gone even if fclose fails */
+                if (fclose(file) != 0) break;
+            }
+            if (job->target != NULL && ns_rename(job->path, job->target) < 0) break;
+            return;
+        case D_STORE: {
+            FILE *file = job->file;
+            job->file = NULL;
+            /* ETags of GETs through any of its names. Without xattr support they just have none. */
+            fsetxattr(fileno(file), ETAG_XATTR, job->etag, ETAG_LEN, 0);
+            if (fclose(file) != 0) {
+                job->err = errno;
+                ns_unlink(job->path);
+                errno = job->err;
+                break;
+            }
+            job->existed = ns_link(job->path, job->target, false) < 0;
+            job->err = errno;
+            ns_unlink(job->path);
+            errno = job->err;
+            if (job->existed && job->err != EEXIST) break;
+            return;
+        }
+        case D_LINK:
+            if (ns_link(job->path, job->target, true) < 0) break;
+            return;
+        case D_APPEND: {
+            ssize_t n = pwrite(job->fd, job->buf, job->len, job->off);
+            if (n != job->len) {
+                if (n >= 0) errno = ENOSPC; /* short write */
+                break;
+            }
+            return;
+        }
+        case D_COMPACT:
+            if (objstore_copy(job) < 0) break;
+            if (fdatasync(job->fd) < 0) break; /* the copies are durable before the originals go */
+            if (unlink(job->path) < 0) break;
+            return;
+        case D_SAVE:
+            if (save_file(job) < 0) break;
+            return;
+        case D_WARM:
+            if ((job->fd = ns_open(job->path, O_RDONLY | O_NONBLOCK, 0)) < 0) break;
+            if (fstat(job->fd, &job->sbuf) == 0 && S_ISREG(job->sbuf.st_mode)) {
+                if (job->len > job->sbuf.st_size) job->len = job->sbuf.st_size;
+                if (readahead(job->fd, 0, job->len) < 0) posix_fadvise(job->fd, 0, job->len, POSIX_FADV_WILLNEED);
+            } else {
+                job->len = 0;
+            }
+            close(job->fd);
+            job->fd = INVALID_FD;
+            return;
+        case D_SYNC:
+            if (sync_data(job) < 0) break;
+            /* a new name is only durable once its directory is */
+            if (job->path[0] != '\0' && ns_sync_dir(job->path) < 0) break;
+            if (job->target != NULL && sync_dir(job->target) < 0) break;
+            return;
+        case D_SYNC_GROUP:
+            if (sync_batch(job) < 0) break;
+            return;
+    }
+    /* failed */
+    job->result = ERROR;
+    job->err = errno;
+    if ((job->op == D_OPEN_READ || job->op == D_OPEN_WRITE) && job->fd >= 0) {
+        close(job->fd);
+        job->fd = INVALID_FD;
+    }
+}
+
+/* digest recorded by D_STORE. Only deduplicated bodies have other names, so others skip the syscall. */
+static void get_etag(disk_job_t *job) {
+    ssize_t n = -1;
+    if (job->sbuf.st_nlink > 1) n = fgetxattr(job->fd, ETAG_XATTR, job->etag, ETAG_LEN);
+    job->etag[n == ETAG_LEN ? ETAG_LEN : 0] = '\0';
+}
+
+/* replace path with buf, so a crash leaves either the old or the new content */
+static int save_file(disk_job_t *job) {
+    char tmp[MAXLINE + 4];
+    int fd, saved;
+    ssize_t n;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", job->path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0) return ERROR;
+    if ((n = write(fd, job->buf, job->len)) != job->len || fsync(fd) < 0) {
+        saved = n >= 0 && n != job->len ? ENOSPC : errno;
+        close(fd);
+        unlink(tmp);
+        errno = saved;
+        return ERROR;
+    }
+    if (close(fd) < 0 || rename(tmp, job->path) < 0) return ERROR;
+    return OKAY;
+}
+
+static int sync_dir(const char *dir) {
+    int fd, rc, saved;
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) return ERROR;
+    rc = fsync(fd);
+    saved = errno;
+    close(fd);
+    errno = saved;
+    return rc;
+}
+
+/*
+ * sync_batch - a slice of a group sync.
+ * Uploads to the same directory, or records in the same segment, are synced
+ * once for the whole batch: by the slice holding the first of them.
+ */
+static int sync_batch(disk_job_t *job) {
+    disk_job_t *member;
+    int i, j;
+
+    for (i = job->batch_first; i < job->n_batch; i += job->batch_step) {
+        member = job->batch[i];
+        for (j = 0; j < i && !same_file(job->batch[j], member); j++);
+        if (j == i && sync_data(member) < 0) return ERROR;
+        for (j = 0; j < i && !same_dir(job->batch[j], member); j++);
+        if (j < i) continue;
+        if (member->path[0] != '\0' && ns_sync_dir(member->path) < 0) return ERROR;
+        if (member->target != NULL && sync_dir(member->target) < 0) return ERROR;
+    }
+    return OKAY;
+}
+
+/* flush and fdatasync the file of a D_SYNC, if it has one rather than only a new name */
+static int sync_data(disk_job_t *job) {
+    if (job->file != NULL) return fflush(job->file) == 0 && fdatasync(fileno(job->file)) == 0 ? OKAY : ERROR;
+    return job->fd >= 0 ? fdatasync(job->fd) : OKAY;
+}
+
+static bool same_file(const disk_job_t *a, const disk_job_t *b) {
+    return a->file != NULL ? a->file == b->file : b->file == NULL && a->fd == b->fd;
+}
+
+static bool same_dir(const disk_job_t *a, const disk_job_t *b) {
+    const char *slash_a = strrchr(a->path, '/'), *slash_b = strrchr(b->path, '/');
+    size_t len_a = slash_a ? slash_a - a->path : 0, len_b = slash_b ? slash_b - b->path : 0;
+    if ((a->target == NULL) != (b->target == NULL)) return false;
+    if (a->target != NULL) return strcmp(a->target, b->target) == 0;
+    if (a->path[0] == '\0' || b->path[0] == '\0') return a->path[0] == b->path[0];
+    return len_a == len_b && strncmp(a->path, b->path, len_a) == 0;
+}
@@ -0,0 +1,97 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_DISKIO_H
+#define NAIVE_HTTP_DISKIO_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include "misc.h"
+
+/* which blocking operation to run */
+typedef enum {
+    D_OPEN_READ, /* open, fstat and share-lock a file for download */
+    D_OPEN_WRITE, /* create, exclusive-lock, truncate and fdopen a file for upload */
+    D_WRITE, /* fwrite a buffer to an upload */
+    D_CLOSE, /* close descriptors, optionally removing the file first. Fire and forget. */
+    D_ADVISE, /* readahead a range and drop another from the page cache, then close fd. Fire and forget. */
+    D_PUBLISH, /* fclose file if set, then rename path over target if set */
+    D_STORE, /* tag file with etag and fclose it, then link path as target unless it exists, and unlink path */
+    D_LINK, /* link path over target, creating its directories */
+    /* object store files, outside the served root, see objstore.c */
+    D_APPEND, /* pwrite buf at off of fd */
+    D_COMPACT, /* copy moves from src_fd to fd, fdatasync fd, then unlink path */
+    D_SAVE, /* write buf to path.tmp, fsync it and rename it over path */
+    D_WARM, /* read ahead up to len bytes of path into the page cache, len becomes the bytes asked for */
+    /* upload durability, see durable.c */
+    D_SYNC, /* fflush and fdatasync file, or fdatasync fd if valid, then sync the directory of path beneath the root if set, and target */
+    D_SYNC_GROUP /* D_SYNC each of a slice of batch, skipping files and directories synced by an earlier entry */
+} disk_op_e;
+
+/* a record moved by D_COMPACT */
+typedef struct {
+    long from, to, len;
+} disk_move_t;
+
+#define ETAG_LEN 64 /* hex SHA-256 of a deduplicated body, see dedup.c */
+
+struct _disk_job;
+typedef void (*disk_done_cb_t)(int efd, struct _disk_job *job);
+
+/*
+ * A blocking operation handed to the workers.
+ * Transactions embed one, as they wait on at most one operation at a time.
+ */
+typedef struct _disk_job {
+    disk_op_e op;
+    disk_done_cb_t done; /* called on the event loop thread, NULL for fire and forget */
+    void *arg;
+    /* arguments */
+    char path[MAXLINE];
+    int fd;
+    FILE *file;
+    const char *buf;
+    long off, len;
+    long drop_off, drop_len;
+    bool remove_path;
+    const char *target; /* D_PUBLISH, D_STORE and D_LINK, must outlive the job */
+    EVP_MD_CTX *digest; /* D_WRITE hashes the buffer into it if set */
+    int src_fd; /* D_COMPACT */
+    const disk_move_t *moves;
+    int n_moves;
+    struct _disk_job **batch; /* D_SYNC_GROUP, jobs of the transactions waiting on it */
+    int n_batch, batch_first, batch_step; /* the slice is batch[first], batch[first + step], ... */
+    /* results */
+    int result; /* OKAY or ERROR */
+    int err; /* errno of the failed call */
+    bool not_regular;
+    bool lock_busy;
+    bool existed; /* D_STORE found target already stored */
+    struct stat sbuf;
+    char etag[ETAG_LEN + 1]; /* D_OPEN_READ: digest of a deduplicated file, or "". D_STORE: the digest. */
+    /* queue link */
+    struct _disk_job *next;
+} disk_job_t;
+
+int init_disk_workers(int efd);
+
+void submit_disk_job(disk_job_t *job);
+
+void submit_disk_close(int fd, FILE *file, char *remove_path);
+
+void submit_disk_advice(int fd, long ra_off, long ra_len, long drop_off, long drop_len);
+
+void handle_disk_event(int efd);
+
+int disk_jobs_pending();
+
+#endif //NAIVE_HTTP_DISKIO_H
@@ -0,0 +1,134 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "durable.h"
+#include "config.h"
+#include "timer.h"
+#include "error_handler.h"
+
+/* a group sync pass, split in slices over the disk workers */
+typedef struct {
+    disk_job_t **batch;
+    int n_batch;
+    int slices_left;
+    int result, err;
+    long long started;
+    disk_job_t slices[];
+} group_t;
+
+static disk_job_t **pending; /* waiting for the next pass */
+static int n_pending, pending_cap;
+static group_t *running; /* the pass in flight, NULL if none */
+static timer_entry_t window_timer;
+static bool timer_ready = false;
+
+static void start_group(int efd, void *arg);
+
+static void on_group_synced(int efd, disk_job_t *job);
+
+bool durable_uploads() {
+    return config.upload_durability != DURABILITY_NONE;
+}
+
+/*
+ * wait_sync - make what trans wrote durable, then call done like a disk job completion.
+ * The caller sets trans->disk_job.file or .fd, and .path or .target for the directory
+ * holding a new name. The transaction is parked in S_WAIT_DISK meanwhile.
+ */
+void wait_sync(transaction_t *trans, disk_done_cb_t done) {
+    disk_job_t *job = &trans->disk_job, **grown;
+    int cap;
+
+    job->op = D_SYNC;
+    job->done = done;
+    job->arg = trans;
+    trans->state = S_WAIT_DISK;
+    if (config.upload_durability != DURABILITY_GROUP) {
+        submit_disk_job(job);
+        return;
+    }
+    if (n_pending == pending_cap) {
+        cap = pending_cap ? pending_cap * 2 : 64;
+        if ((grown = realloc(pending, cap * sizeof(disk_job_t *))) == NULL) {
+            unix_error("fatal: realloc");
+            exit(-2);
+        }
+        pending = grown;
+        pending_cap = cap;
+    }
+    pending[n_pending++] = job;
+    if (!timer_ready) {
+        init_timer_entry(&window_timer, start_group, NULL);
+        timer_ready = true;
+    }
+    /* the window opens with the first upload, a pass in flight starts the next one itself */
+    if (running == NULL && !timer_pending(&window_timer)) schedule_timer(&window_timer, config.upload_sync_window);
+}
+
+/* sync the uploads that completed during the window in one pass */
+static void start_group(int efd, void *arg) {
+    int n = n_pending < config.disk_threads ? n_pending : config.disk_threads, i;
+    group_t *g;
+
+    if (running != NULL || n_pending == 0) return;
+    if ((g = calloc(1, sizeof(group_t) + n * sizeof(disk_job_t))) == NULL) {
+        unix_error("fatal: calloc");
+        exit(-2);
+    }
+    g->batch = pending;
+    g->n_batch = n_pending;
+    g->slices_left = n;
+    g->result = OKAY;
+    g->started = now_ms();
+    pending = NULL;
+    n_pending = pending_cap = 0;
+    running = g;
+    for (i = 0; i < n; i++) {
+        g->slices[i].op = D_SYNC_GROUP;
+        g->slices[i].done = on_group_synced;
+        g->slices[i].arg = g;
+        g->slices[i].fd = INVALID_FD;
+        g->slices[i].batch = g->batch;
+        g->slices[i].n_batch = g->n_batch;
+        g->slices[i].batch_first = i;
+        g->slices[i].batch_step = n;
+        submit_disk_job(&g->slices[i]);
+    }
+}
+
+/* release the whole batch once every slice is synced */
+static void on_group_synced(int efd, disk_job_t *job) {
+    group_t *g = (group_t *) job->arg;
+    disk_job_t *member;
+    int i;
+
+    if (job->result == ERROR) {
+        g->result = ERROR;
+        g->err = job->err;
+    }
+    if (--g->slices_left > 0) return;
+    running = NULL;
+    if (g->result == ERROR) posix_error(g->err, "group sync");
+    if (config.slow_request_ms > 0 && now_ms() - g->started >= config.slow_request_ms) {
+        printf("slow group sync of %d uploads in %lld ms\n", g->n_batch, now_ms() - g->started);
+    }
+    for (i = 0; i < g->n_batch; i++) {
+        member = g->batch[i];
+        member->result = g->result;
+        member->err = g->err;
+        member->done(efd, member);
+    }
+    free(g->batch);
+    free(g);
+    /* whatever completed during this pass has waited long enough */
+    start_group(efd, NULL);
+}
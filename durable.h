@@ -0,0 +1,40 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_DURABLE_H
+#define NAIVE_HTTP_DURABLE_H
+
+#include <stdbool.h>
+#include "transaction.h"
+#include "diskio.h"
+
+/*
+ * Upload durability, config.upload_durability:
+ *
+ *   none    uploads are acknowledged once written to the page cache
+ *   fsync   each upload is fdatasynced, with its directory, before it is acknowledged
+ *   group   uploads completing within upload_sync_window ms are made durable
+ *           together in one pass, then all acknowledged at once
+ *
+ * Syncs run on the disk workers. A group pass is spread over all of them and
+ * syncs each file, segment and directory once however many uploads it holds.
+ * One pass is in flight at a time; uploads completing meanwhile queue up for
+ * the next one.
+ *
+ * Plain uploads, objstore records, every entry of an untar and the names a
+ * dedup upload links are covered. Group pays off for many concurrent plain
+ * uploads; objstore appends already share segments, so use fsync with it.
+ */
+
+bool durable_uploads();
+
+void wait_sync(transaction_t *trans, disk_done_cb_t done);
+
+#endif //NAIVE_HTTP_DURABLE_H
@@ -15,6 +15,7 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
  * But our program needs to be robust. So just print the error message and manually recover.
  */
 
+#include <netdb.h>
 #include "error_handler.h"
 
 void unix_error(char *msg) { /* Unix-style error */
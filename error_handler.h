@@ -15,7 +15,6 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #include <stdio.h>
 #include <string.h>
 #include <sys/errno.h>
-#include <netdb.h>
 
 void unix_error(char *msg);
 
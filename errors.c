@@ -0,0 +1,79 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errors.h"
+#include "error_handler.h"
+#include "misc.h"
+
+/*
+ * Error responses are rendered once at startup into immutable blobs shared by
+ * every connection, so answering scanners and lock conflicts costs no formatting.
+ */
+static error_page_t pages[N_ERRORS] = {
+        [E_READ_FAILED] = {"400", "Bad Request", "Failed to read request line & header"},
+        [E_HEADER_TOO_LONG] = {"400", "Bad Request", "Request header too long"},
+        [E_BAD_REQUEST_LINE] = {"400", "Bad Request", "Invalid request line"},
+        [E_BAD_HEADER] = {"400", "Bad Request", "Invalid request header"},
+        [E_BAD_URI] = {"400", "Bad Request", "Invalid URI"},
+        [E_NO_LENGTH] = {"400", "Bad Request", "Content-Length must be provided and be positive."},
+        [E_TOO_LARGE] = {"400", "Bad Request", "File larger than limit."},
+        [E_FORBIDDEN] = {"403", "Forbidden", "Naive server couldn't read the file"},
+        [E_NOT_FOUND] = {"404", "Not found", "Naive server couldn't find this file"},
+        [E_OPEN_FAILED] = {"500", "Internal Server Error", "Cannot open file"},
+        [E_WRITE_FAILED] = {"500", "Internal Server Error", "Cannot write to the requested file."},
+        [E_NOT_IMPLEMENTED] = {"501", "Not Implemented", "Naive server does not implement this method"},
+        [E_LOCKED_WRITING] = {"503", "Service Unavailable", "File is being written."},
+        [E_LOCKED_BUSY] = {"503", "Service Unavailable", "File is being read/written."},
+        [E_CREATE_FAILED] = {"503", "Service Unavailable", "Cannot create the requested file."},
+        [E_TOO_MANY_CONNS] = {"429", "Too Many Requests", "Too many concurrent connections"},
+        [E_TOO_MANY_REQS] = {"429", "Too Many Requests", "Request rate limit exceeded"},
+        [E_BAD_GATEWAY] = {"502", "Bad Gateway", "Upstream server failed"},
+        [E_GATEWAY_TIMEOUT] = {"504", "Gateway Timeout", "Upstream server did not answer in time"},
+        [E_DIGEST_MISMATCH] = {"400", "Bad Request", "Body does not match X-Content-SHA256"},
+};
+
+const char error_body_tail[] = "\r\n<hr><em>The Tiny Web server</em>\r\n";
+
+static char *render(const char *fmt, int *len, ...);
+
+void init_error_pages() {
+    int i;
+    error_page_t *p;
+    for (i = 0; i < N_ERRORS; i++) {
+        p = &pages[i];
+        p->head = render("HTTP/1.0 %s %s\r\nContent-Type: text/html\r\nContent-Length: ", &p->head_len,
+                         p->errnum, p->shortmsg);
+        p->body_head = render("\r\n\r\n<html><title>Tiny Error</title><body bgcolor=ffffff>\r\n%s: %s\r\n<p>%s: ",
+                              &p->body_head_len, p->errnum, p->shortmsg, p->longmsg);
+        p->body_len = p->body_head_len - 4 + (int) sizeof(error_body_tail) - 1;
+        p->full = render("%s%d%s%s", &p->full_len, p->head, p->body_len, p->body_head, error_body_tail);
+    }
+}
+
+const error_page_t *get_error_page(error_e err) {
+    return &pages[err];
+}
+
+static char *render(const char *fmt, int *len, ...) {
+    va_list ap;
+    char buf[MAXLINE * 2], *blob;
+    va_start(ap, len);
+    *len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if ((blob = strdup(buf)) == NULL) {
+        unix_error("fatal: strdup");
+        exit(-1);
+    }
+    return blob;
+}
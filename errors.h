@@ -0,0 +1,61 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_ERRORS_H
+#define NAIVE_HTTP_ERRORS_H
+
+/* every error response the server sends */
+typedef enum {
+    E_READ_FAILED,
+    E_HEADER_TOO_LONG,
+    E_BAD_REQUEST_LINE,
+    E_BAD_HEADER,
+    E_BAD_URI,
+    E_NO_LENGTH,
+    E_TOO_LARGE,
+    E_FORBIDDEN,
+    E_NOT_FOUND,
+    E_OPEN_FAILED,
+    E_WRITE_FAILED,
+    E_NOT_IMPLEMENTED,
+    E_LOCKED_WRITING,
+    E_LOCKED_BUSY,
+    E_CREATE_FAILED,
+    E_TOO_MANY_CONNS,
+    E_TOO_MANY_REQS,
+    E_BAD_GATEWAY,
+    E_GATEWAY_TIMEOUT,
+    E_DIGEST_MISMATCH,
+    N_ERRORS
+} error_e;
+
+/*
+ * A pre-rendered error response.
+ * full is the whole response with an empty cause. When a cause is echoed the
+ * response is sent as head, Content-Length digits, body_head, cause, body_tail.
+ */
+typedef struct {
+    const char *errnum, *shortmsg, *longmsg;
+    char *full;
+    int full_len;
+    char *head; /* status line and headers up to the Content-Length value */
+    int head_len;
+    char *body_head; /* header terminator and body up to the cause */
+    int body_head_len;
+    int body_len; /* without the cause */
+} error_page_t;
+
+void init_error_pages();
+
+const error_page_t *get_error_page(error_e err);
+
+extern const char error_body_tail[];
+
+#endif //NAIVE_HTTP_ERRORS_H
@@ -0,0 +1,938 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <iso646.h>
+#include <sys/epoll.h>
+#include "h2.h"
+#include "tls.h"
+#include "namespace.h"
+#include "bundle.h"
+#include "objstore.h"
+#include "warmup.h"
+#include "errors.h"
+#include "config.h"
+#include "error_handler.h"
+
+/*
+ * HTTP/2 over cleartext TCP (h2c), entered with prior knowledge, i.e. the
+ * connection preface instead of a request line, or by an HTTP/1.1 Upgrade.
+ * A connection keeps its single transaction: frames are parsed out of
+ * read_buf, responses of all streams go through the one output queue. Each
+ * stream opens its file on the disk workers like an HTTP/1 download, and its
+ * body is sent as DATA frames whose payload is a file segment of the queue,
+ * i.e. with sendfile. Streams with data take turns a frame at a time, within
+ * the connection and stream send windows.
+ * Request bodies are not accepted; their flow-control credit is returned
+ * right away and the stream is answered 501.
+ */
+#define MAX_WINDOW 0x7fffffffL
+#define CONTROL_ROOM 64 /* output reserved before handling a frame, e.g. for a PING ack and GOAWAY */
+#define HEADERS_ROOM 256 /* a response HEADERS frame and RST_STREAM */
+#define H2_MIN_BUF (H2_PREFACE_LEN + H2_FRAME_HEADER + H2_MAX_FRAME)
+#define SERVER_NAME "Naive HTTP Server"
+
+/* frame types */
+enum {
+    F_DATA, F_HEADERS, F_PRIORITY, F_RST_STREAM, F_SETTINGS, F_PUSH_PROMISE, F_PING, F_GOAWAY, F_WINDOW_UPDATE,
+    F_CONTINUATION
+};
+
+/* frame flags */
+#define FL_END_STREAM 0x1
+#define FL_ACK 0x1
+#define FL_END_HEADERS 0x4
+#define FL_PADDED 0x8
+#define FL_PRIORITY 0x20
+
+/* error codes */
+enum {
+    H2E_NO_ERROR, H2E_PROTOCOL, H2E_INTERNAL, H2E_FLOW_CONTROL, H2E_SETTINGS_TIMEOUT, H2E_STREAM_CLOSED,
+    H2E_FRAME_SIZE, H2E_REFUSED_STREAM, H2E_CANCEL, H2E_COMPRESSION, H2E_CONNECT, H2E_ENHANCE_YOUR_CALM
+};
+
+/* settings parameters */
+enum {
+    SET_HEADER_TABLE_SIZE = 1, SET_ENABLE_PUSH, SET_MAX_CONCURRENT_STREAMS, SET_INITIAL_WINDOW_SIZE,
+    SET_MAX_FRAME_SIZE, SET_MAX_HEADER_LIST_SIZE
+};
+
+/* outcome of h2_read */
+enum {
+    RD_AGAIN, /* socket drained */
+    RD_BLOCKED, /* frames left in read_buf until the output queue drains */
+    RD_CLOSED
+};
+
+/* outcome of h2_write */
+enum {
+    WR_DRAINED, WR_WAIT, WR_FINISHED
+};
+
+/* request pseudo-header fields, collected while decoding a header block */
+typedef struct {
+    char method[MAXLINE];
+    char path[MAXLINE];
+    bool bad;
+} h2_request_t;
+
+static const char switching_protocols[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                          "Connection: Upgrade\r\n"
+                                          "Upgrade: h2c\r\n\r\n";
+
+/* defined in http.c */
+void finish_transaction(int efd, transaction_t *trans);
+
+void client_error(int efd, transaction_t *trans, char *cause, error_e err);
+
+const char *get_filetype(char *filename);
+
+error_e open_error(disk_job_t *job);
+
+void queue_transmission(transaction_t *trans);
+
+static h2_conn_t *new_conn(transaction_t *trans);
+
+static void enter_h2(int efd, transaction_t *trans, h2_conn_t *h);
+
+static int h2_read(h2_conn_t *h);
+
+static int h2_write(int efd, h2_conn_t *h);
+
+static bool process_frames(h2_conn_t *h);
+
+static int handle_frame(h2_conn_t *h, const unsigned char *f, long len);
+
+static int strip_padding(int flags, bool priority, const unsigned char **p, long *len);
+
+static int on_data(h2_conn_t *h, uint32_t id, int flags, const unsigned char *p, long len);
+
+static int on_headers(h2_conn_t *h, uint32_t id, int flags, const unsigned char *p, long len);
+
+static int on_continuation(h2_conn_t *h, uint32_t id, int flags, const unsigned char *p, long len);
+
+static int end_headers(h2_conn_t *h, uint32_t id, const unsigned char *block, long len, bool end_stream,
+                       bool is_new);
+
+static int on_rst_stream(h2_conn_t *h, uint32_t id, const unsigned char *p, long len);
+
+static int on_settings(h2_conn_t *h, uint32_t id, int flags, const unsigned char *p, long len);
+
+static int apply_settings(h2_conn_t *h, const unsigned char *p, long len);
+
+static int on_window_update(h2_conn_t *h, uint32_t id, const unsigned char *p, long len);
+
+static void collect_field(const char *name, size_t name_len, const char *value, size_t value_len, void *arg);
+
+static void open_stream(h2_conn_t *h, uint32_t id, h2_request_t *req, bool end_stream);
+
+static void on_stream_opened(int efd, disk_job_t *job);
+
+static void respond_error(h2_stream_t *s, error_e err);
+
+static h2_stream_t *find_stream(h2_conn_t *h, uint32_t id);
+
+static void reset_stream(h2_conn_t *h, h2_stream_t *s);
+
+static void finish_stream(h2_conn_t *h, h2_stream_t *s);
+
+static void close_stream(h2_conn_t *h, h2_stream_t *s);
+
+static void release_done(h2_conn_t *h);
+
+static void schedule_frames(h2_conn_t *h);
+
+static void queue_headers(h2_conn_t *h, h2_stream_t *s);
+
+static h2_stream_t *next_sender(h2_conn_t *h);
+
+static bool out_room(h2_conn_t *h, size_t bytes, int segs);
+
+static unsigned char *frame_payload(h2_conn_t *h);
+
+static void frame_end(h2_conn_t *h, int type, int flags, uint32_t id, long len);
+
+static void queue_u32_frame(h2_conn_t *h, int type, uint32_t id, uint32_t value);
+
+static void queue_settings(h2_conn_t *h);
+
+static int connection_error(h2_conn_t *h, int code);
+
+static long decode_base64url(const char *in, unsigned char *out, size_t room);
+
+static uint32_t get32(const unsigned char *p);
+
+static void put32(unsigned char *p, uint32_t v);
+
+void init_h2() {
+    init_hpack();
+    if (config.h2 && config.max_buf < H2_MIN_BUF) {
+        fprintf(stderr, "h2: max_buf is below %d, HTTP/2 is disabled\n", H2_MIN_BUF);
+    }
+}
+
+bool h2_enabled() {
+    return config.h2 && config.max_buf >= H2_MIN_BUF;
+}
+
+/*
+ * h2_upgrade_requested - an HTTP/1.1 GET or HEAD asking to continue in h2c
+ */
+bool h2_upgrade_requested(transaction_t *trans) {
+    const char *upgrade = get_header(&trans->headers, H_UPGRADE);
+
+    if (not h2_enabled() || strcmp(trans->req->version, "HTTP/1.1") != 0) return false;
+    if (strcasecmp(trans->req->method, "GET") != 0 && strcasecmp(trans->req->method, "HEAD") != 0) return false;
+    return upgrade != NULL && strstr(upgrade, "h2c") != NULL && get_header(&trans->headers, H_HTTP2_SETTINGS) != NULL;
+}
+
+/*
+ * h2_start - switch a connection that sent the preface to HTTP/2
+ */
+void h2_start(int efd, transaction_t *trans) {
+    printf("h2 with prior knowledge\n");
+    enter_h2(efd, trans, new_conn(trans));
+    queue_transmission(trans);
+}
+
+/*
+ * h2_upgrade - answer 101 to an h2c upgrade and serve the request as stream 1.
+ * header_len bytes of read_buf hold the HTTP/1.1 request.
+ */
+void h2_upgrade(int efd, transaction_t *trans, long header_len) {
+    h2_conn_t *h = new_conn(trans);
+    unsigned char settings[MAXLINE];
+    long len = decode_base64url(get_header(&trans->headers, H_HTTP2_SETTINGS), settings, sizeof(settings));
+    h2_request_t req;
+
+    if (len < 0 || len % 6 != 0 || apply_settings(h, settings, len) != H2E_NO_ERROR) {
+        free(h);
+        client_error(efd, trans, "", E_BAD_HEADER);
+        return;
+    }
+
+    printf("h2c upgrade\n");
+    outq_push_mem(&trans->outq, switching_protocols, sizeof(switching_protocols) - 1);
+    enter_h2(efd, trans, h);
+
+    /* the request becomes stream 1, already half-closed by the client */
+    strcpy(req.method, trans->req->method);
+    strcpy(req.path, trans->req->uri);
+    req.bad = false;
+    h->last_stream = 1;
+    open_stream(h, 1, &req, true);
+
+    /* keep what followed the request, normally the start of the preface */
+    memmove(trans->read_buf, trans->read_buf + header_len, trans->read_pos - header_len);
+    trans->read_pos -= header_len;
+    queue_transmission(trans);
+}
+
+/*
+ * h2_event - socket event or wakeup of an HTTP/2 connection
+ */
+void h2_event(int efd, transaction_t *trans) {
+    h2_conn_t *h = trans->h2;
+    int rc;
+    do {
+        rc = h2_read(h);
+        if (rc == RD_CLOSED) {
+            finish_transaction(efd, trans);
+            return;
+        }
+        /* frames left unprocessed for lack of output room are resumed once it drains */
+    } while (h2_write(efd, h) == WR_DRAINED && rc == RD_BLOCKED);
+}
+
+/*
+ * h2_finish - release the streams of a finishing connection.
+ * Streams whose file open is still in flight are freed by its completion.
+ */
+void h2_finish(transaction_t *trans) {
+    h2_conn_t *h = trans->h2;
+    h2_stream_t *s, *next;
+
+    if (h == NULL) return;
+    for (s = h->streams; s != NULL; s = next) {
+        next = s->next;
+        if (s->state == H2S_OPENING) {
+            s->conn = NULL;
+            continue;
+        }
+        if (s->fd >= 0) submit_disk_close(s->fd, NULL, NULL);
+        free(s);
+    }
+    for (s = h->done; s != NULL; s = next) {
+        next = s->next;
+        submit_disk_close(s->fd, NULL, NULL);
+        free(s);
+    }
+    hpack_table_free(&h->decoder);
+    free(h);
+    trans->h2 = NULL;
+}
+
+static h2_conn_t *new_conn(transaction_t *trans) {
+    h2_conn_t *h = malloc(sizeof(h2_conn_t));
+    if (h == NULL) {
+        unix_error("fatal: malloc");
+        exit(-2);
+    }
+    h->trans = trans;
+    hpack_table_init(&h->decoder);
+    h->preface_seen = false;
+    h->goaway = false;
+    h->closing = false;
+    h->last_stream = 0;
+    h->send_window = H2_DEFAULT_WINDOW;
+    h->initial_window = H2_DEFAULT_WINDOW;
+    h->n_streams = 0;
+    h->opened = 0;
+    h->streams = NULL;
+    h->done = NULL;
+    h->rr_last = 0;
+    h->hb_stream = 0;
+    h->hb_len = 0;
+    h->out_len = 0;
+    return h;
+}
+
+static void enter_h2(int efd, transaction_t *trans, h2_conn_t *h) {
+    epoll_event_t event;
+    event.data.fd = trans->fd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
+        unix_error("epoll ctl");
+    }
+    trans->h2 = h;
+    trans->state = S_H2;
+    queue_settings(h);
+}
+
+/* read and handle frames until the socket is drained or the output queue is full */
+static int h2_read(h2_conn_t *h) {
+    transaction_t *trans = h->trans;
+    ssize_t count;
+    while (true) {
+        if (process_frames(h)) return RD_BLOCKED;
+        if (h->closing) return RD_AGAIN;
+        /* never full here: what is left is less than one frame, and max_buf holds the largest */
+        count = conn_read(trans, trans->read_buf + trans->read_pos, config.max_buf - trans->read_pos);
+        if (count < 0) {
+            if (errno == EAGAIN) return RD_AGAIN;
+            unix_error("read");
+            return RD_CLOSED;
+        } else if (count == 0) { /* client closed connection */
+            return RD_CLOSED;
+        }
+        trans->read_pos += count;
+    }
+}
+
+/* queue frames of ready streams and flush, until the queue drains or the socket is full */
+static int h2_write(int efd, h2_conn_t *h) {
+    transaction_t *trans = h->trans;
+    ssize_t count;
+    long granted, wait_ms;
+    while (true) {
+        if (not h->closing) schedule_frames(h);
+        if (outq_empty(&trans->outq)) break;
+        granted = rate_take_bytes(trans->rate_bucket, trans->outq.pending, &wait_ms);
+        if (granted == 0) { /* out of tokens, park until refilled */
+            schedule_timer(&trans->pace_timer, wait_ms);
+            return WR_WAIT;
+        }
+        count = conn_flush(trans, granted);
+        rate_return_bytes(trans->rate_bucket, granted - (count > 0 ? count : 0));
+        if (count < 0) {
+            if (errno != EAGAIN) {
+                unix_error("write");
+                finish_transaction(efd, trans);
+                return WR_FINISHED;
+            }
+            return WR_WAIT; /* EAGAIN: no more can be written */
+        }
+        if (outq_empty(&trans->outq)) release_done(h);
+    }
+    release_done(h);
+    if (h->closing || (h->goaway && h->streams == NULL)) {
+        finish_transaction(efd, trans);
+        return WR_FINISHED;
+    }
+    return WR_DRAINED;
+}
+
+/*
+ * process_frames - handle the complete frames in read_buf and move the rest to its start.
+ * Returns true if it stopped for lack of output room.
+ */
+static bool process_frames(h2_conn_t *h) {
+    transaction_t *trans = h->trans;
+    unsigned char *buf = (unsigned char *) trans->read_buf;
+    long pos = 0, len;
+    bool blocked = false;
+
+    if (not h->preface_seen) {
+        if (memcmp(buf, H2_PREFACE, MIN(trans->read_pos, H2_PREFACE_LEN)) != 0) {
+            connection_error(h, H2E_PROTOCOL);
+            return false;
+        }
+        if (trans->read_pos < H2_PREFACE_LEN) return false;
+        h->preface_seen = true;
+        pos = H2_PREFACE_LEN;
+    }
+    while (not h->closing && trans->read_pos - pos >= H2_FRAME_HEADER) {
+        len = (buf[pos] << 16) | (buf[pos + 1] << 8) | buf[pos + 2];
+        if (len > H2_MAX_FRAME) { /* beyond our SETTINGS_MAX_FRAME_SIZE */
+            connection_error(h, H2E_FRAME_SIZE);
+            break;
+        }
+        if (trans->read_pos - pos < H2_FRAME_HEADER + len) break;
+        if (not out_room(h, CONTROL_ROOM, 1)) {
+            blocked = true;
+            break;
+        }
+        handle_frame(h, buf + pos, len);
+        pos += H2_FRAME_HEADER + len;
+    }
+    memmove(buf, buf + pos, trans->read_pos - pos);
+    trans->read_pos -= pos;
+    return blocked;
+}
+
+static int handle_frame(h2_conn_t *h, const unsigned char *f, long len) {
+    int type = f[3], flags = f[4];
+    uint32_t id = get32(f + 5) & 0x7fffffff;
+    const unsigned char *p = f + H2_FRAME_HEADER;
+
+    /* nothing may come between the frames of a header block */
+    if (h->hb_stream != 0 && (type != F_CONTINUATION || id != h->hb_stream)) {
+        return connection_error(h, H2E_PROTOCOL);
+    }
+    switch (type) {
+        case F_DATA:
+            return on_data(h, id, flags, p, len);
+        case F_HEADERS:
+            return on_headers(h, id, flags, p, len);
+        case F_CONTINUATION:
+            return on_continuation(h, id, flags, p, len);
+        case F_PRIORITY: /* advisory, streams are served round robin */
+            if (id == 0) return connection_error(h, H2E_PROTOCOL);
+            if (len != 5) queue_u32_frame(h, F_RST_STREAM, id, H2E_FRAME_SIZE);
+            return OKAY;
+        case F_RST_STREAM:
+            return on_rst_stream(h, id, p, len);
+        case F_SETTINGS:
+            return on_settings(h, id, flags, p, len);
+        case F_PING:
+            if (id != 0) return connection_error(h, H2E_PROTOCOL);
+            if (len != 8) return connection_error(h, H2E_FRAME_SIZE);
+            if (not(flags & FL_ACK)) {
+                memcpy(frame_payload(h), p, 8);
+                frame_end(h, F_PING, FL_ACK, 0, 8);
+            }
+            return OKAY;
+        case F_GOAWAY:
+            if (id != 0) return connection_error(h, H2E_PROTOCOL);
+            h->goaway = true; /* finish the open streams, then close */
+            return OKAY;
+        case F_WINDOW_UPDATE:
+            return on_window_update(h, id, p, len);
+        case F_PUSH_PROMISE: /* clients don't push */
+            return connection_error(h, H2E_PROTOCOL);
+        default: /* unknown types are ignored */
+            return OKAY;
+    }
+}
+
+/* drop the padding, and the priority fields of HEADERS, around a frame's payload */
+static int strip_padding(int flags, bool priority, const unsigned char **p, long *len) {
+    long pad = 0;
+    if (flags & FL_PADDED) {
+        if (*len < 1) return ERROR;
+        pad = **p;
+        (*p)++;
+        (*len)--;
+    }
+    if (priority && (flags & FL_PRIORITY)) {
+        if (*len < 5) return ERROR;
+        *p += 5;
+        *len -= 5;
+    }
+    if (pad > *len) return ERROR;
+    *len -= pad;
+    return OKAY;
+}
+
+static int on_data(h2_conn_t *h, uint32_t id, int flags, const unsigned char *p, long len) {
+    h2_stream_t *s;
+    if (id == 0 || id > h->last_stream) return connection_error(h, H2E_PROTOCOL);
+    /* request bodies are discarded, give the connection window back at once */
+    if (len > 0) queue_u32_frame(h, F_WINDOW_UPDATE, 0, len);
+    if (strip_padding(flags, false, &p, &len) == ERROR) return connection_error(h, H2E_PROTOCOL);
+    if ((s = find_stream(h, id)) != NULL && (flags & FL_END_STREAM)) s->remote_open = false;
+    return OKAY;
+}
+
+static int on_headers(h2_conn_t *h, uint32_t id, int flags, const unsigned char *p, long len) {
+    bool is_new;
+    if (id == 0 || (id & 1) == 0) return connection_error(h, H2E_PROTOCOL);
+    if (strip_padding(flags, true, &p, &len) == ERROR) return connection_error(h, H2E_PROTOCOL);
+    is_new = id > h->last_stream;
+    if (is_new) h->last_stream = id;
+    if (flags & FL_END_HEADERS) { /* the common case, decoded straight from read_buf */
+        return end_headers(h, id, p, len, flags & FL_END_STREAM, is_new);
+    }
+    if (len > H2_HEADER_BLOCK) return connection_error(h, H2E_ENHANCE_YOUR_CALM);
+    memcpy(h->hb, p, len);
+    h->hb_len = len;
+    h->hb_stream = id;
+    h->hb_end_stream = flags & FL_END_STREAM;
+    h->hb_new = is_new;
+    return OKAY;
+}
+
+static int on_continuation(h2_conn_t *h, uint32_t id, int flags, const unsigned char *p, long len) {
+    if (h->hb_stream == 0) return connection_error(h, H2E_PROTOCOL);
+    if (h->hb_len + len > H2_HEADER_BLOCK) return connection_error(h, H2E_ENHANCE_YOUR_CALM);
+    memcpy(h->hb + h->hb_len, p, len);
+    h->hb_len += len;
+    if (not(flags & FL_END_HEADERS)) return OKAY;
+    h->hb_stream = 0;
+    return end_headers(h, id, h->hb, h->hb_len, h->hb_end_stream, h->hb_new);
+}
+
+static int end_headers(h2_conn_t *h, uint32_t id, const unsigned char *block, long len, bool end_stream,
+                       bool is_new) {
+    h2_request_t req;
+    h2_stream_t *s;
+
+    req.method[0] = '\0';
+    req.path[0] = '\0';
+    req.bad = false;
+    /* always decoded, the dynamic table must stay in step with the client's */
+    if (hpack_decode(&h->decoder, block, len, collect_field, &req) == ERROR) {
+        return connection_error(h, H2E_COMPRESSION);
+    }
+    if (not is_new) { /* trailers */
+        if ((s = find_stream(h, id)) != NULL && end_stream) s->remote_open = false;
+        return OKAY;
+    }
+    if (h->n_streams >= config.h2_max_streams) {
+        queue_u32_frame(h, F_RST_STREAM, id, H2E_REFUSED_STREAM);
+        return OKAY;
+    }
+    /* the connection's admission paid for the first request, streams are requests too */
+    if (h->opened > 0 && not rate_take_request(h->trans->rate_bucket)) {
+        queue_u32_frame(h, F_RST_STREAM, id, H2E_REFUSED_STREAM);
+        return OKAY;
+    }
+    open_stream(h, id, &req, end_stream);
+    return OKAY;
+}
+
+static void collect_field(const char *name, size_t name_len, const char *value, size_t value_len, void *arg) {
+    h2_request_t *req = (h2_request_t *) arg;
+    char *dest;
+    if (strcmp(name, ":method") == 0) dest = req->method;
+    else if (strcmp(name, ":path") == 0) dest = req->path;
+    else return;
+    if (value_len >= MAXLINE) {
+        req->bad = true;
+        return;
+    }
+    memcpy(dest, value, value_len + 1);
+}
+
+static int on_rst_stream(h2_conn_t *h, uint32_t id, const unsigned char *p, long len) {
+    h2_stream_t *s;
+    if (id == 0 || id > h->last_stream) return connection_error(h, H2E_PROTOCOL);
+    if (len != 4) return connection_error(h, H2E_FRAME_SIZE);
+    if ((s = find_stream(h, id)) != NULL) {
+        printf("h2 stream %u reset by client, error %u\n", id, get32(p));
+        reset_stream(h, s);
+    }
+    return OKAY;
+}
+
+static int on_settings(h2_conn_t *h, uint32_t id, int flags, const unsigned char *p, long len) {
+    int code;
+    if (id != 0) return connection_error(h, H2E_PROTOCOL);
+    if (flags & FL_ACK) return len == 0 ? OKAY : connection_error(h, H2E_FRAME_SIZE);
+    if (len % 6 != 0) return connection_error(h, H2E_FRAME_SIZE);
+    if ((code = apply_settings(h, p, len)) != H2E_NO_ERROR) return connection_error(h, code);
+    frame_end(h, F_SETTINGS, FL_ACK, 0, 0);
+    return OKAY;
+}
+
+/* apply the client's settings, returns an error code */
+static int apply_settings(h2_conn_t *h, const unsigned char *p, long len) {
+    h2_stream_t *s;
+    long i, value, delta;
+    for (i = 0; i + 6 <= len; i += 6) {
+        value = get32(p + i + 2);
+        switch ((p[i] << 8) | p[i + 1]) {
+            case SET_ENABLE_PUSH:
+                if (value > 1) return H2E_PROTOCOL;
+                break;
+            case SET_INITIAL_WINDOW_SIZE: /* applies to open streams too */
+                if (value > MAX_WINDOW) return H2E_FLOW_CONTROL;
+                delta = value - h->initial_window;
+                for (s = h->streams; s != NULL; s = s->next) {
+                    if (s->window + delta > MAX_WINDOW) return H2E_FLOW_CONTROL;
+                    s->window += delta;
+                }
+                h->initial_window = value;
+                break;
+            case SET_MAX_FRAME_SIZE: /* we never send frames above the default */
+                if (value < H2_MAX_FRAME || value > 0xffffff) return H2E_PROTOCOL;
+                break;
+            default: /* our header blocks are never indexed, and we don't push */
+                break;
+        }
+    }
+    return H2E_NO_ERROR;
+}
+
+static int on_window_update(h2_conn_t *h, uint32_t id, const unsigned char *p, long len) {
+    h2_stream_t *s;
+    long inc;
+    if (len != 4) return connection_error(h, H2E_FRAME_SIZE);
+    inc = get32(p) & 0x7fffffff;
+    if (id == 0) {
+        if (inc == 0) return connection_error(h, H2E_PROTOCOL);
+        if (h->send_window + inc > MAX_WINDOW) return connection_error(h, H2E_FLOW_CONTROL);
+        h->send_window += inc;
+        return OKAY;
+    }
+    if (id > h->last_stream) return connection_error(h, H2E_PROTOCOL);
+    if ((s = find_stream(h, id)) == NULL) return OKAY; /* closed in the meantime */
+    if (inc == 0 || s->window + inc > MAX_WINDOW) {
+        queue_u32_frame(h, F_RST_STREAM, id, inc == 0 ? H2E_PROTOCOL : H2E_FLOW_CONTROL);
+        reset_stream(h, s);
+        return OKAY;
+    }
+    s->window += inc;
+    return OKAY;
+}
+
+/*
+ * open_stream - start serving a request.
+ * Files are opened off the loop, on_stream_opened queues the response.
+ */
+static void open_stream(h2_conn_t *h, uint32_t id, h2_request_t *req, bool end_stream) {
+    h2_stream_t *s, **tail;
+    const bundle_entry_t *entry;
+
+    if ((s = calloc(1, sizeof(h2_stream_t))) == NULL) {
+        unix_error("fatal: calloc");
+        exit(-2);
+    }
+    s->id = id;
+    s->conn = h;
+    s->remote_open = not end_stream;
+    s->status = 200;
+    s->fd = INVALID_FD;
+    s->window = h->initial_window;
+    for (tail = &h->streams; *tail != NULL; tail = &(*tail)->next);
+    *tail = s; /* ids only grow, so the list stays ordered */
+    h->n_streams++;
+    h->opened++;
+
+    printf("h2 stream %u: [%s] [%s]\n", id, req->method, req->path);
+    if (req->bad || req->method[0] == '\0' || req->path[0] == '\0') {
+        respond_error(s, E_BAD_REQUEST_LINE);
+        return;
+    }
+    if (strcmp(req->method, "HEAD") == 0) {
+        s->head = true;
+    } else if (strcmp(req->method, "GET") != 0) {
+        respond_error(s, E_NOT_IMPLEMENTED);
+        return;
+    }
+    if (parse_uri(req->path, s->job.path) == ERROR) {
+        respond_error(s, E_BAD_URI);
+        return;
+    }
+    if ((entry = bundle_find(s->job.path)) != NULL) { /* no open, stat or lock */
+        if ((s->fd = dup(bundle_fd())) < 0) {
+            unix_error("h2: dup bundle");
+            respond_error(s, E_OPEN_FAILED);
+            return;
+        }
+        s->off = (long) entry->offset;
+        s->size = (long) entry->length;
+        s->type = bundle_string(entry->type);
+        memcpy(s->job.etag, entry->etag, BUNDLE_ETAG_LEN);
+        s->job.etag[BUNDLE_ETAG_LEN] = '\0';
+        s->state = H2S_HEADERS;
+        return;
+    }
+    if ((s->fd = objstore_open(s->job.path, &s->off, &s->size, s->job.etag)) >= 0) {
+        s->state = H2S_HEADERS;
+        return;
+    }
+    s->fd = INVALID_FD;
+    s->state = H2S_OPENING;
+    s->job.op = D_OPEN_READ;
+    s->job.done = on_stream_opened;
+    s->job.arg = s;
+    s->job.fd = INVALID_FD;
+    submit_disk_job(&s->job);
+}
+
+static void on_stream_opened(int efd, disk_job_t *job) {
+    h2_stream_t *s = (h2_stream_t *) job->arg;
+    h2_conn_t *h = s->conn;
+
+    if (job->result == OKAY) {
+        s->fd = job->fd;
+        s->size = job->sbuf.st_size;
+        warmup_hit(job->path, s->size);
+    }
+    if (h == NULL) { /* the connection finished meanwhile */
+        if (s->fd >= 0) submit_disk_close(s->fd, NULL, NULL);
+        free(s);
+        return;
+    }
+    if (s->reset) {
+        close_stream(h, s);
+        return;
+    }
+    if (job->result == ERROR) respond_error(s, open_error(job));
+    s->state = H2S_HEADERS;
+    if (not timer_pending(&h->trans->pace_timer)) queue_transmission(h->trans);
+}
+
+/* answer a stream with a pre-rendered error page */
+static void respond_error(h2_stream_t *s, error_e err) {
+    const error_page_t *page = get_error_page(err);
+    s->status = atoi(page->errnum);
+    s->mem = page->full + page->full_len - page->body_len; /* the body ends the blob */
+    s->size = page->body_len;
+    s->state = H2S_HEADERS;
+}
+
+static h2_stream_t *find_stream(h2_conn_t *h, uint32_t id) {
+    h2_stream_t *s;
+    for (s = h->streams; s != NULL && s->id != id; s = s->next);
+    return s;
+}
+
+/* stop a stream on a reset. One whose file is being opened is closed once that completes. */
+static void reset_stream(h2_conn_t *h, h2_stream_t *s) {
+    if (s->state == H2S_OPENING) s->reset = true;
+    else close_stream(h, s);
+}
+
+/* the last frame of s is queued */
+static void finish_stream(h2_conn_t *h, h2_stream_t *s) {
+    if (s->remote_open) { /* the rest of the request body is not wanted */
+        queue_u32_frame(h, F_RST_STREAM, s->id, H2E_NO_ERROR);
+    }
+    close_stream(h, s);
+}
+
+/*
+ * close_stream - take s off the open streams.
+ * Its file may still back queued DATA frames, then it waits on the done list.
+ */
+static void close_stream(h2_conn_t *h, h2_stream_t *s) {
+    h2_stream_t **link;
+    for (link = &h->streams; *link != s; link = &(*link)->next);
+    *link = s->next;
+    h->n_streams--;
+    if (s->fd >= 0 && not outq_empty(&h->trans->outq)) {
+        s->next = h->done;
+        h->done = s;
+        return;
+    }
+    if (s->fd >= 0) submit_disk_close(s->fd, NULL, NULL);
+    free(s);
+}
+
+/* the output queue drained: close the files of finished streams and reuse the frame buffer */
+static void release_done(h2_conn_t *h) {
+    h2_stream_t *s;
+    while ((s = h->done) != NULL) {
+        h->done = s->next;
+        submit_disk_close(s->fd, NULL, NULL);
+        free(s);
+    }
+    h->out_len = 0;
+}
+
+/*
+ * schedule_frames - queue response headers, then DATA frames a stream at a time,
+ * as far as the send windows and the output queue allow.
+ */
+static void schedule_frames(h2_conn_t *h) {
+    outq_t *q = &h->trans->outq;
+    h2_stream_t *s, *next;
+    unsigned char *hdr;
+    long len;
+    bool end;
+
+    for (s = h->streams; s != NULL; s = next) {
+        next = s->next;
+        if (s->state != H2S_HEADERS) continue;
+        if (not out_room(h, HEADERS_ROOM, 1)) return;
+        queue_headers(h, s);
+    }
+    /*
+     * Then a frame header and its payload segment, and RST_STREAM if the request was not complete.
+     * After an upgrade, bodies wait for the client's preface and settings.
+     */
+    while (h->preface_seen && h->send_window > 0 && out_room(h, H2_FRAME_HEADER + CONTROL_ROOM, 3)) {
+        if ((s = next_sender(h)) == NULL) break;
+        len = s->size - s->sent;
+        if (len > s->window) len = s->window;
+        if (len > h->send_window) len = h->send_window;
+        if (len > H2_MAX_FRAME) len = H2_MAX_FRAME;
+        end = s->sent + len == s->size;
+
+        hdr = h->out + h->out_len;
+        hdr[0] = len >> 16;
+        hdr[1] = len >> 8;
+        hdr[2] = len;
+        hdr[3] = F_DATA;
+        hdr[4] = end ? FL_END_STREAM : 0;
+        put32(hdr + 5, s->id);
+        outq_push_mem(q, (char *) hdr, H2_FRAME_HEADER);
+        h->out_len += H2_FRAME_HEADER;
+        if (s->mem != NULL) outq_push_mem(q, s->mem + s->sent, len);
+        else outq_push_file(q, s->fd, s->off + s->sent, len);
+
+        s->sent += len;
+        s->window -= len;
+        h->send_window -= len;
+        h->rr_last = s->id;
+        if (end) finish_stream(h, s);
+    }
+}
+
+static void queue_headers(h2_conn_t *h, h2_stream_t *s) {
+    unsigned char *start = frame_payload(h), *p = start;
+    const char *type = s->mem != NULL ? "text/html" : s->type != NULL ? s->type : get_filetype(s->job.path);
+    char length[32], etag[ETAG_LEN + 3];
+    int n;
+    bool end = s->head || s->size == 0;
+
+    p += hpack_encode_status(p, s->status);
+    p += hpack_encode_literal(p, HPACK_SERVER, SERVER_NAME, sizeof(SERVER_NAME) - 1);
+    p += hpack_encode_literal(p, HPACK_CONTENT_TYPE, type, strlen(type));
+    n = snprintf(length, sizeof(length), "%ld", s->size);
+    p += hpack_encode_literal(p, HPACK_CONTENT_LENGTH, length, n);
+    if (s->mem == NULL && s->job.etag[0] != '\0') {
+        n = snprintf(etag, sizeof(etag), "\"%s\"", s->job.etag);
+        p += hpack_encode_literal(p, HPACK_ETAG, etag, n);
+    }
+    frame_end(h, F_HEADERS, FL_END_HEADERS | (end ? FL_END_STREAM : 0), s->id, p - start);
+    if (end) finish_stream(h, s);
+    else s->state = H2S_DATA;
+}
+
+/* the first stream after the last one served that may send, in id order, wrapping around */
+static h2_stream_t *next_sender(h2_conn_t *h) {
+    h2_stream_t *s, *first = NULL;
+    for (s = h->streams; s != NULL; s = s->next) {
+        if (s->state != H2S_DATA || s->window <= 0) continue;
+        if (s->id > h->rr_last) return s;
+        if (first == NULL) first = s;
+    }
+    return first;
+}
+
+static bool out_room(h2_conn_t *h, size_t bytes, int segs) {
+    return h->out_len + bytes <= H2_OUT_BUF && h->trans->outq.n + segs <= OUTQ_SEGS;
+}
+
+/* the payload of the next frame is written here, then queued by frame_end */
+static unsigned char *frame_payload(h2_conn_t *h) {
+    return h->out + h->out_len + H2_FRAME_HEADER;
+}
+
+static void frame_end(h2_conn_t *h, int type, int flags, uint32_t id, long len) {
+    unsigned char *p = h->out + h->out_len;
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, id);
+    outq_push_mem(&h->trans->outq, (char *) p, H2_FRAME_HEADER + len);
+    h->out_len += H2_FRAME_HEADER + len;
+}
+
+/* RST_STREAM and WINDOW_UPDATE */
+static void queue_u32_frame(h2_conn_t *h, int type, uint32_t id, uint32_t value) {
+    put32(frame_payload(h), value);
+    frame_end(h, type, 0, id, 4);
+}
+
+static void queue_settings(h2_conn_t *h) {
+    unsigned char *p = frame_payload(h);
+    p[0] = 0;
+    p[1] = SET_MAX_CONCURRENT_STREAMS;
+    put32(p + 2, config.h2_max_streams);
+    p[6] = 0;
+    p[7] = SET_ENABLE_PUSH;
+    put32(p + 8, 0);
+    frame_end(h, F_SETTINGS, 0, 0, 12);
+}
+
+/* send GOAWAY and close the connection once it is flushed */
+static int connection_error(h2_conn_t *h, int code) {
+    unsigned char *p = frame_payload(h);
+    printf("h2 connection error %d\n", code);
+    put32(p, h->last_stream);
+    put32(p + 4, code);
+    frame_end(h, F_GOAWAY, 0, 0, 8);
+    h->closing = true;
+    return ERROR;
+}
+
+/* decode the unpadded base64url of HTTP2-Settings, returns the length or ERROR */
+static long decode_base64url(const char *in, unsigned char *out, size_t room) {
+    unsigned int acc = 0;
+    int bits = 0, v;
+    size_t n = 0;
+    for (; *in != '\0' && *in != '='; in++) {
+        if (*in >= 'A' && *in <= 'Z') v = *in - 'A';
+        else if (*in >= 'a' && *in <= 'z') v = *in - 'a' + 26;
+        else if (*in >= '0' && *in <= '9') v = *in - '0' + 52;
+        else if (*in == '-') v = 62;
+        else if (*in == '_') v = 63;
+        else return ERROR;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == room) return ERROR;
+            out[n++] = (acc >> bits) & 0xff;
+        }
+    }
+    return n;
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
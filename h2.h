@@ -0,0 +1,102 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_H2_H
+#define NAIVE_HTTP_H2_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "transaction.h"
+#include "diskio.h"
+#include "hpack.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER 9
+#define H2_MAX_FRAME 16384 /* SETTINGS_MAX_FRAME_SIZE default: the largest frame we accept and send */
+#define H2_DEFAULT_WINDOW 65535
+#define H2_OUT_BUF 16384 /* frame headers, header blocks and control frames waiting in the output queue */
+#define H2_HEADER_BLOCK 16384 /* header block collected from HEADERS and CONTINUATION frames */
+
+/* where a stream is, from our side */
+typedef enum {
+    H2S_OPENING, /* file open in flight on a disk worker */
+    H2S_HEADERS, /* response header to be queued */
+    H2S_DATA /* body being queued as DATA frames */
+} h2_stream_state_e;
+
+struct _h2_conn;
+
+/* a request on an HTTP/2 connection */
+typedef struct _h2_stream {
+    uint32_t id;
+    h2_stream_state_e state;
+    struct _h2_conn *conn; /* NULL once the connection is gone while the open is in flight */
+    bool reset; /* RST_STREAM arrived while opening */
+    bool remote_open; /* the client has not ended its side yet */
+    bool head;
+    int status;
+    /* body: a file range sent with sendfile, or a pre-rendered error page */
+    int fd;
+    long off; /* where the body starts in fd, nonzero for bundle entries */
+    const char *type; /* MIME type of a bundle entry, NULL to derive it from job.path */
+    const char *mem;
+    long size;
+    long sent; /* body bytes queued */
+    long window; /* send window */
+    disk_job_t job; /* D_OPEN_READ, job.path is the file */
+    struct _h2_stream *next;
+} h2_stream_t;
+
+/*
+ * HTTP/2 state of a connection.
+ * All streams share the transaction: frames are parsed out of read_buf, and
+ * queued on trans->outq, with frame headers and small frames placed in out.
+ */
+typedef struct _h2_conn {
+    transaction_t *trans;
+    hpack_table_t decoder;
+    bool preface_seen;
+    bool goaway; /* received, no new streams */
+    bool closing; /* we sent GOAWAY for an error, close once flushed */
+    uint32_t last_stream; /* highest stream id the client opened */
+    long send_window; /* connection-level send window */
+    long initial_window; /* SETTINGS_INITIAL_WINDOW_SIZE of the client */
+    int n_streams;
+    long opened; /* streams ever opened, each after the first takes a request token */
+    h2_stream_t *streams; /* open, in id order */
+    h2_stream_t *done; /* fully queued, their files are closed once the queue drains */
+    uint32_t rr_last; /* stream that got the last DATA frame, for round robin */
+    /* header block spanning CONTINUATION frames */
+    uint32_t hb_stream; /* 0 when none is pending */
+    bool hb_end_stream;
+    bool hb_new;
+    size_t hb_len;
+    unsigned char hb[H2_HEADER_BLOCK];
+    /* backing store of queued frames, reset whenever trans->outq drains */
+    size_t out_len;
+    unsigned char out[H2_OUT_BUF];
+} h2_conn_t;
+
+void init_h2();
+
+bool h2_enabled();
+
+bool h2_upgrade_requested(transaction_t *trans);
+
+void h2_start(int efd, transaction_t *trans);
+
+void h2_upgrade(int efd, transaction_t *trans, long header_len);
+
+void h2_event(int efd, transaction_t *trans);
+
+void h2_finish(transaction_t *trans);
+
+#endif //NAIVE_HTTP_H2_H
@@ -0,0 +1,403 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <iso646.h>
+#include "hpack.h"
+#include "error_handler.h"
+#include "misc.h"
+
+/*
+ * HPACK (RFC 7541) for HTTP/2.
+ * The decoder keeps the dynamic table of a connection and handles Huffman
+ * coded strings with a bit-by-bit walk of a trie built once at startup.
+ * The encoder never indexes: responses are sent as literals without
+ * indexing, with static table names, so there is no encoder state to keep.
+ */
+#define HUFF_NODES 512 /* internal nodes of the code tree, 256 for 257 symbols */
+#define HUFF_EOS 256
+
+static const struct { const char *name, *value; } static_table[HPACK_STATIC] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* RFC 7541 appendix B: code and bit length for symbols 0-256 */
+static const uint32_t huff_code[257] = {
+    0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5,
+    0x0fffffe6, 0x0fffffe7, 0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9,
+    0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec, 0x0fffffed, 0x0fffffee,
+    0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+    0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9,
+    0x0ffffffa, 0x0ffffffb, 0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa,
+    0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa, 0x000003fa, 0x000003fb,
+    0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+    0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b,
+    0x0000001c, 0x0000001d, 0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb,
+    0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc, 0x00001ffa, 0x00000021,
+    0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+    0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068,
+    0x00000069, 0x0000006a, 0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e,
+    0x0000006f, 0x00000070, 0x00000071, 0x00000072, 0x000000fc, 0x00000073,
+    0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+    0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005,
+    0x00000025, 0x00000026, 0x00000027, 0x00000006, 0x00000074, 0x00000075,
+    0x00000028, 0x00000029, 0x0000002a, 0x00000007, 0x0000002b, 0x00000076,
+    0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+    0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd,
+    0x00001ffd, 0x0ffffffc, 0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8,
+    0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9, 0x003fffd6, 0x007fffda,
+    0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+    0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1,
+    0x007fffe2, 0x007fffe3, 0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5,
+    0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef, 0x003fffda, 0x001fffdd,
+    0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+    0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf,
+    0x007fffeb, 0x007fffec, 0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2,
+    0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef, 0x000fffea, 0x003fffe2,
+    0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+    0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2,
+    0x003fffe8, 0x01ffffec, 0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde,
+    0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed, 0x0007fff2, 0x001fffe3,
+    0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+    0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3,
+    0x07ffffe4, 0x07ffffe5, 0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6,
+    0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3, 0x003fffea, 0x003fffeb,
+    0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+    0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8,
+    0x07ffffe9, 0x07ffffea, 0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed,
+    0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee, 0x3fffffff,
+};
+
+static const uint8_t huff_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+/* children of each trie node per bit; 0 is unset, leaves are -(symbol + 1) */
+static int16_t huff_trie[HUFF_NODES][2];
+static int huff_nodes = 1;
+
+/* scratch for the field being decoded, the decoder runs on the event loop thread only */
+static char name_buf[HPACK_MAX_STRING + 1];
+static char value_buf[HPACK_MAX_STRING + 1];
+
+static int decode_int(const unsigned char **pp, const unsigned char *end, int prefix, size_t *value);
+
+static int decode_string(const unsigned char **pp, const unsigned char *end, char *out, size_t *len);
+
+static int lookup(hpack_table_t *t, size_t index, hpack_field_t *field);
+
+static void insert(hpack_table_t *t, const char *name, size_t name_len, const char *value, size_t value_len);
+
+static void evict(hpack_table_t *t, size_t need);
+
+static size_t encode_int(unsigned char *out, int prefix, unsigned char flags, size_t value);
+
+/*
+ * init_hpack - build the Huffman decoding trie
+ */
+void init_hpack() {
+    int sym, b, bit, node;
+    for (sym = 0; sym <= HUFF_EOS; sym++) {
+        node = 0;
+        for (b = huff_len[sym] - 1; b > 0; b--) {
+            bit = (huff_code[sym] >> b) & 1;
+            if (huff_trie[node][bit] == 0) huff_trie[node][bit] = huff_nodes++;
+            node = huff_trie[node][bit];
+        }
+        huff_trie[node][huff_code[sym] & 1] = -(sym + 1);
+    }
+}
+
+void hpack_table_init(hpack_table_t *t) {
+    t->first = 0;
+    t->n = 0;
+    t->size = 0;
+    t->max_size = HPACK_TABLE_SIZE;
+}
+
+void hpack_table_free(hpack_table_t *t) {
+    t->max_size = 0;
+    evict(t, 0);
+}
+
+/*
+ * hpack_decode - decode a complete header block, calling cb for every field.
+ * Any error is a connection-level COMPRESSION_ERROR, the table can't be trusted afterwards.
+ */
+int hpack_decode(hpack_table_t *t, const unsigned char *p, size_t len, hpack_field_cb_t cb, void *arg) {
+    const unsigned char *end = p + len;
+    hpack_field_t field;
+    size_t index, size, name_len, value_len;
+    bool indexing, seen_field = false;
+
+    while (p < end) {
+        if (*p & 0x80) { /* indexed field */
+            if (decode_int(&p, end, 7, &index) == ERROR || lookup(t, index, &field) == ERROR) return ERROR;
+            cb(field.name, field.name_len, field.value, field.value_len, arg);
+        } else if ((*p & 0xe0) == 0x20) { /* dynamic table size update, only before the first field */
+            if (decode_int(&p, end, 5, &size) == ERROR || size > HPACK_TABLE_SIZE || seen_field) return ERROR;
+            t->max_size = size;
+            evict(t, 0);
+            continue;
+        } else { /* literal, with incremental indexing (01), without (0000) or never indexed (0001) */
+            indexing = (*p & 0x40) != 0;
+            if (decode_int(&p, end, indexing ? 6 : 4, &index) == ERROR) return ERROR;
+            if (index == 0) {
+                if (decode_string(&p, end, name_buf, &name_len) == ERROR) return ERROR;
+            } else {
+                /* copied, inserting this field may evict the entry the name came from */
+                if (lookup(t, index, &field) == ERROR) return ERROR;
+                memcpy(name_buf, field.name, field.name_len + 1);
+                name_len = field.name_len;
+            }
+            if (decode_string(&p, end, value_buf, &value_len) == ERROR) return ERROR;
+            if (indexing) insert(t, name_buf, name_len, value_buf, value_len);
+            cb(name_buf, name_len, value_buf, value_len, arg);
+        }
+        seen_field = true;
+    }
+    return OKAY;
+}
+
+/*
+ * hpack_encode_status - encode :status, indexed when the static table has the code.
+ * out needs 5 bytes.
+ */
+size_t hpack_encode_status(unsigned char *out, int status) {
+    char digits[8];
+    switch (status) {
+        case 200: out[0] = 0x80 | 8; return 1;
+        case 204: out[0] = 0x80 | 9; return 1;
+        case 206: out[0] = 0x80 | 10; return 1;
+        case 304: out[0] = 0x80 | 11; return 1;
+        case 400: out[0] = 0x80 | 12; return 1;
+        case 404: out[0] = 0x80 | 13; return 1;
+        case 500: out[0] = 0x80 | 14; return 1;
+        default:
+            snprintf(digits, sizeof(digits), "%03d", status % 1000);
+            return hpack_encode_literal(out, HPACK_STATUS, digits, 3);
+    }
+}
+
+/*
+ * hpack_encode_literal - encode a literal without indexing, named by a static table entry.
+ * The value is not Huffman coded. out needs value_len + 8 bytes.
+ */
+size_t hpack_encode_literal(unsigned char *out, int name_index, const char *value, size_t value_len) {
+    size_t n = encode_int(out, 4, 0x00, name_index);
+    n += encode_int(out + n, 7, 0x00, value_len);
+    memcpy(out + n, value, value_len);
+    return n + value_len;
+}
+
+/* decode an integer with an N-bit prefix, RFC 7541 5.1 */
+static int decode_int(const unsigned char **pp, const unsigned char *end, int prefix, size_t *value) {
+    const unsigned char *p = *pp;
+    size_t mask = (1u << prefix) - 1, v;
+    int shift = 0;
+    if (p == end) return ERROR;
+    v = *p++ & mask;
+    if (v == mask) {
+        do {
+            if (p == end || shift > 21) return ERROR; /* 28 bits is plenty for any length or index */
+            v += (size_t) (*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+    }
+    *pp = p;
+    *value = v;
+    return OKAY;
+}
+
+/* decode a string literal into out, which holds HPACK_MAX_STRING bytes plus the NUL */
+static int decode_string(const unsigned char **pp, const unsigned char *end, char *out, size_t *len) {
+    const unsigned char *p = *pp;
+    size_t n, i, used = 0;
+    int b, node = 0, child, pad_bits = 0;
+    bool huffman, pad_ones = true;
+
+    if (p == end) return ERROR;
+    huffman = (*p & 0x80) != 0;
+    if (decode_int(&p, end, 7, &n) == ERROR || n > (size_t) (end - p)) return ERROR;
+    if (not huffman) {
+        if (n > HPACK_MAX_STRING) return ERROR;
+        memcpy(out, p, n);
+        used = n;
+    } else {
+        for (i = 0; i < n; i++) {
+            for (b = 7; b >= 0; b--) {
+                child = huff_trie[node][(p[i] >> b) & 1];
+                pad_ones = pad_ones && ((p[i] >> b) & 1);
+                pad_bits++;
+                if (child > 0) {
+                    node = child;
+                    continue;
+                }
+                /* a leaf: EOS must not appear in a string */
+                if (child == -(HUFF_EOS + 1) || used == HPACK_MAX_STRING) return ERROR;
+                out[used++] = (char) (-child - 1);
+                node = 0;
+                pad_bits = 0;
+                pad_ones = true;
+            }
+        }
+        /* padding is the most significant bits of EOS, i.e. up to 7 ones */
+        if (pad_bits > 7 || not pad_ones) return ERROR;
+    }
+    out[used] = '\0';
+    *len = used;
+    *pp = p + n;
+    return OKAY;
+}
+
+/* field at a 1-based index of the combined static and dynamic table */
+static int lookup(hpack_table_t *t, size_t index, hpack_field_t *field) {
+    if (index == 0) return ERROR;
+    if (index <= HPACK_STATIC) {
+        field->name = (char *) static_table[index - 1].name;
+        field->value = (char *) static_table[index - 1].value;
+        field->name_len = strlen(field->name);
+        field->value_len = strlen(field->value);
+        return OKAY;
+    }
+    index -= HPACK_STATIC + 1;
+    if (index >= (size_t) t->n) return ERROR;
+    *field = t->ring[(t->first + index) % HPACK_MAX_ENTRIES];
+    return OKAY;
+}
+
+static void insert(hpack_table_t *t, const char *name, size_t name_len, const char *value, size_t value_len) {
+    size_t need = name_len + value_len + 32;
+    hpack_field_t *field;
+    char *mem;
+
+    evict(t, need);
+    if (need > t->max_size) return; /* larger than the table: it just empties it */
+    if ((mem = malloc(name_len + value_len + 2)) == NULL) {
+        unix_error("fatal: malloc");
+        exit(-2);
+    }
+    t->first = (t->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    field = &t->ring[t->first];
+    field->name = mem;
+    field->value = mem + name_len + 1;
+    memcpy(field->name, name, name_len + 1);
+    memcpy(field->value, value, value_len + 1);
+    field->name_len = name_len;
+    field->value_len = value_len;
+    t->n++;
+    t->size += need;
+}
+
+/* drop the oldest entries until need more bytes fit */
+static void evict(hpack_table_t *t, size_t need) {
+    hpack_field_t *oldest;
+    while (t->n > 0 && t->size + need > t->max_size) {
+        oldest = &t->ring[(t->first + t->n - 1) % HPACK_MAX_ENTRIES];
+        t->size -= oldest->name_len + oldest->value_len + 32;
+        free(oldest->name);
+        t->n--;
+    }
+}
+
+static size_t encode_int(unsigned char *out, int prefix, unsigned char flags, size_t value) {
+    size_t mask = (1u << prefix) - 1, n = 1;
+    if (value < mask) {
+        out[0] = flags | value;
+        return 1;
+    }
+    out[0] = flags | mask;
+    value -= mask;
+    while (value >= 0x80) {
+        out[n++] = 0x80 | (value & 0x7f);
+        value >>= 7;
+    }
+    out[n++] = value;
+    return n;
+}
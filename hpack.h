@@ -0,0 +1,57 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_HPACK_H
+#define NAIVE_HTTP_HPACK_H
+
+#include <stddef.h>
+
+#define HPACK_STATIC 61 /* entries of the static table */
+#define HPACK_TABLE_SIZE 4096 /* dynamic table size, the SETTINGS_HEADER_TABLE_SIZE we keep */
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32) /* an entry costs at least 32 bytes */
+#define HPACK_MAX_STRING 8192 /* longest name or value accepted after decoding */
+
+/* static table indices of the names we send */
+#define HPACK_STATUS 8
+#define HPACK_CONTENT_LENGTH 28
+#define HPACK_CONTENT_TYPE 31
+#define HPACK_ETAG 34
+#define HPACK_SERVER 54
+
+typedef struct {
+    char *name; /* name and value share one allocation, both NUL-terminated */
+    char *value;
+    size_t name_len, value_len;
+} hpack_field_t;
+
+/* decoder state of a connection: the dynamic table, a ring with the newest entry first */
+typedef struct {
+    hpack_field_t ring[HPACK_MAX_ENTRIES];
+    int first, n;
+    size_t size; /* sum of entry sizes as defined by RFC 7541 4.1 */
+    size_t max_size; /* lowered by dynamic table size updates */
+} hpack_table_t;
+
+/* called for every decoded field, name and value are NUL-terminated and valid during the call */
+typedef void (*hpack_field_cb_t)(const char *name, size_t name_len, const char *value, size_t value_len, void *arg);
+
+void init_hpack();
+
+void hpack_table_init(hpack_table_t *t);
+
+void hpack_table_free(hpack_table_t *t);
+
+int hpack_decode(hpack_table_t *t, const unsigned char *p, size_t len, hpack_field_cb_t cb, void *arg);
+
+size_t hpack_encode_status(unsigned char *out, int status);
+
+size_t hpack_encode_literal(unsigned char *out, int name_index, const char *value, size_t value_len);
+
+#endif //NAIVE_HTTP_HPACK_H
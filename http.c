@@ -19,51 +19,93 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #include <stdbool.h>
 #include <sys/errno.h>
 #include <sys/file.h>
-#include <sys/sendfile.h>
 #include "http.h"
 #include "error_handler.h"
 #include "socket_util.h"
 #include "transaction.h"
-
+#include "stream.h"
+#include "namespace.h"
+#include "config.h"
+#include "errors.h"
+#include "proxy.h"
+#include "tls.h"
+#include "h2.h"
+#include "batch.h"
+#include "untar.h"
+#include "dedup.h"
+#include "bundle.h"
+#include "objstore.h"
+#include "warmup.h"
+#include "durable.h"
+#include "budget.h"
+#include "probes.h"
+
+
+/* one step of a transaction, see run_transactions() */
+typedef void (*step_t)(int efd, transaction_t *trans);
 
 /* protocol related event-handlers */
-void handle_protocol_event(int efd, transaction_t *trans);
+void queue_protocol(transaction_t *trans);
 
 void serve_download(int efd, transaction_t *trans);
 
+void serve_bundle(int efd, transaction_t *trans, const bundle_entry_t *entry);
+
+void serve_extent(int efd, transaction_t *trans, int fd, long off, const char *type);
+
 void serve_upload(int efd, transaction_t *trans);
 
 void finish_transaction(int efd, transaction_t *trans);
 
 void accept_connection(int fd, int efd);
 
-void read_request_header(transaction_t *trans, int efd);
+void resume_transaction(int efd, void *arg);
+
+void read_request_header(int efd, transaction_t *trans);
 
 void send_resp_header(int efd, transaction_t *trans);
 
-void client_error(int efd, transaction_t *trans, char *cause, char *errnum,
-                  char *shortmsg, char *longmsg);
+void send_continue(transaction_t *trans);
 
+void client_error(int efd, transaction_t *trans, char *cause, error_e err);
 
-/* transmission related event-handlers */
-void handle_transmission_event(int efd, transaction_t *trans);
+/* disk operations run by the worker pool, and their completions */
+void wait_disk(transaction_t *trans, disk_op_e op, disk_done_cb_t done);
+
+bool finish_if_aborted(int efd, transaction_t *trans);
+
+void on_download_opened(int efd, disk_job_t *job);
+
+error_e open_error(disk_job_t *job);
 
-void write_n(int efd, transaction_t *trans);
+bool etag_matches(transaction_t *trans);
 
-void write_file(int efd, transaction_t *trans);
+void not_modified(int efd, transaction_t *trans);
+
+void log_slow_request(transaction_t *trans);
+
+void on_upload_opened(int efd, disk_job_t *job);
+
+void on_upload_written(int efd, disk_job_t *job);
+
+void continue_upload(int efd, transaction_t *trans);
+
+void on_upload_synced(int efd, disk_job_t *job);
+
+
+/* transmission related event-handlers */
+void queue_transmission(transaction_t *trans);
+
+void write_out(int efd, transaction_t *trans);
 
 void read_n(int efd, transaction_t *trans);
 
 /* utility functions */
-void parse_uri(char *uri, char *filename);
-
-void get_filetype(char *filename, char *filetype);
+const char *get_filetype(char *filename);
 
 /* data structure related functions */
 
-void destroy_headers(http_headers_t *hdrs);
-
-void destroy_header_item(http_header_item_t *item);
+header_id_e intern_header(const char *name);
 
 void append_header(http_headers_t *hdrs, http_header_item_t *item);
 
@@ -80,22 +122,35 @@ void handle_request(int fd, int listenfd, int efd) {
     }
     transaction_t *trans = find_transaction_for_fd(fd);
     if (trans == NULL) {
+        if (proxy_handle_event(fd, efd)) return; /* an upstream connection */
         app_error("transaction not found.");
         return;
     }
     update_access(trans);
-    handle_transmission_event(efd, trans);
+    if (timer_pending(&trans->pace_timer)) return; /* parked by the limiter, the timer resumes it */
+    queue_transmission(trans);
     return;
 }
 
+/*
+ * resume_transaction - timer callback of a connection parked by the rate limiter
+ */
+void resume_transaction(int efd, void *arg) {
+    transaction_t *trans = (transaction_t *) arg;
+    update_access(trans);
+    queue_transmission(trans);
+}
+
 void accept_connection(int fd, int efd) {
     // debug_print(("accept connection.\n"));
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
     int connfd;
+    int admit;
+    rate_bucket_t *bucket;
 
-    clientlen = sizeof(clientaddr);
     while (true) { // edge-trigger mode, poll until accept succeeds
+        clientlen = sizeof(clientaddr);
         connfd = accept(fd, (SA *) &clientaddr, &clientlen);
         if (connfd < 0) { /* not ready */
             if (not(errno == EAGAIN || errno == EWOULDBLOCK)) {
@@ -113,6 +168,7 @@ void accept_connection(int fd, int efd) {
             close(connfd);
             return;
         }
+        tune_connfd(connfd);
         /* add to epoll */
         epoll_event_t event;
         event.data.fd = connfd;
@@ -132,19 +188,33 @@ void accept_connection(int fd, int efd) {
         }
         slot->fd = connfd;
         slot->state = S_READ_REQ_HEADER;
+        slot->timing.accepted = now_us();
+
+        /* per-client limits */
+        admit = rate_admit(&clientaddr, &bucket);
+        slot->rate_bucket = bucket;
+        PROBE2(accept, connfd, admit);
+        if (tls_enabled()) { /* no plaintext error page on a TLS port */
+            if (admit == RATE_OK) tls_accept(efd, slot);
+            else finish_transaction(efd, slot);
+        } else if (admit == RATE_TOO_MANY_CONNS) {
+            client_error(efd, slot, "", E_TOO_MANY_CONNS);
+        } else if (admit == RATE_TOO_MANY_REQS) {
+            client_error(efd, slot, "", E_TOO_MANY_REQS);
+        }
     }
 }
 
 
-void read_request_header(transaction_t *trans, int efd) {
+void read_request_header(int efd, transaction_t *trans) {
     // debug_print(("read request header.\n"));
     ssize_t count;
-    while (trans->read_pos <= MAXBUF - 1) {
-        count = read(trans->fd, trans->read_buf + trans->read_pos, MAXBUF - trans->read_pos);
+    while (trans->read_pos <= config.max_buf - 1) {
+        count = conn_read(trans, trans->read_buf + trans->read_pos, config.max_buf - trans->read_pos);
         if (count < 0) {
             if (errno != EAGAIN) {
                 unix_error("failed to read");
-                client_error(efd, trans, "", "400", "Bad Request", "Failed to read request line & header");
+                client_error(efd, trans, "", E_READ_FAILED);
                 return;
             } else { /* EAGAIN: done reading */
                 break;
@@ -159,8 +229,14 @@ void read_request_header(transaction_t *trans, int efd) {
         }
     }
 
-    if (trans->read_pos > MAXBUF - 1) { /* Buffer full */
-        client_error(efd, trans, "", "400", "Bad Request", "Request header too long");
+    /* HTTP/2 with prior knowledge starts with the connection preface instead of a request line */
+    if (h2_enabled() && memcmp(trans->read_buf, H2_PREFACE, MIN(trans->read_pos, H2_PREFACE_LEN)) == 0) {
+        if (trans->read_pos >= H2_PREFACE_LEN) h2_start(efd, trans);
+        return; /* otherwise wait for the rest of the preface */
+    }
+
+    if (trans->read_pos > config.max_buf - 1) { /* Buffer full */
+        client_error(efd, trans, "", E_HEADER_TOO_LONG);
         return;
     }
 
@@ -187,20 +263,22 @@ void read_request_header(transaction_t *trans, int efd) {
 
     // debug_print(("read entire header at %ld.\n", trans->parse_pos));
     /* parse request line and header */
-    if (sscanf(trans->read_buf, "%s %s %s", trans->method, trans->uri, trans->version) != 3) {
-        client_error(efd, trans, "", "400", "Bad Request", "Invalid request line");
+    if (sscanf(trans->read_buf, "%s %s %s", trans->req->method, trans->req->uri, trans->req->version) != 3) {
+        client_error(efd, trans, "", E_BAD_REQUEST_LINE);
         return;
     }
 
-    printf("Request line: [%s] [%s] [%s]\n", trans->method, trans->uri, trans->version);
-    char *tofree, *remain, *value_s, *key_s;
+    printf("Request line: [%s] [%s] [%s]\n", trans->req->method, trans->req->uri, trans->req->version);
+    PROBE3(header_done, trans->fd, trans->req->method, trans->req->uri);
+    trans->timing.header = now_us();
+    /* one copy of the header block in the arena, the items are slices of it */
+    char *remain, *value_s, *key_s;
     int header_len = trans->parse_pos + header_tail_len;
-    tofree = remain = calloc(sizeof(char), header_len + 1);
-    if (tofree == NULL) {
-        unix_error("fatal: calloc");
+    remain = arena_strndup(&trans->headers.arena, trans->read_buf, header_len);
+    if (remain == NULL) {
+        unix_error("fatal: malloc");
         exit(-2);
     }
-    strncpy(tofree, trans->read_buf, header_len);
 
     strsep(&remain, "\r\n"); /* skip request line */
     while ((value_s = strsep(&remain, "\r\n")) != NULL) {
@@ -210,104 +288,105 @@ void read_request_header(transaction_t *trans, int efd) {
 
         size_t value_len = strlen(value_s);
         if (value_len < 1 || value_s[0] != ' ') {
-            free(tofree);
-            client_error(efd, trans, "", "400", "Bad Request", "Invalid request header");
+            client_error(efd, trans, "", E_BAD_HEADER);
             return;
         }
         value_s += 1; // value_s points to the sp of ': ', move to the beginning.
 
-        http_header_item_t *item = (http_header_item_t *) malloc(sizeof(http_header_item_t));
-        strncpy(item->key, key_s, MAXLINE);
-        strncpy(item->value, value_s, MAXLINE);
+        http_header_item_t *item = arena_alloc(&trans->headers.arena, sizeof(http_header_item_t));
+        if (item == NULL) {
+            unix_error("fatal: malloc");
+            exit(-2);
+        }
+        item->id = intern_header(key_s);
+        item->key = key_s;
+        item->value = value_s;
 
         printf("KEY[%s] VALUE[%s]\n", item->key, item->value);
 
         append_header(&trans->headers, item);
     }
-    free(tofree);
 
-    if (strcasecmp(trans->method, "GET") == 0) trans->methodtype = GET;
-    else if (strcasecmp(trans->method, "POST") == 0) trans->methodtype = POST;
-        // else if (strcasecmp(trans->method, "HEAD") == 0) trans->methodtype = HEAD;
-    else {
-        client_error(efd, trans, trans->method, "501", "Not Implemented",
-                     "Naive server does not implement this method");
+    /* configured prefixes are forwarded to an upstream instead of the filesystem */
+    upstream_t *upstream = proxy_route(trans->req->uri);
+    if (upstream != NULL) {
+        proxy_start(efd, trans, upstream);
         return;
     }
 
-    /* Parse URI from request */
-    parse_uri(trans->uri, trans->filename);
-    int slash_cnt = 0;
-    int filename_len = strlen(trans->filename);
-    for (i = 0; i < filename_len; i++) {
-        if (trans->filename[i] == '/') {
-            slash_cnt += 1;
-        }
+    if (h2_upgrade_requested(trans)) {
+        h2_upgrade(efd, trans, header_len);
+        return;
     }
-    if (slash_cnt > 1) { /* File cannot be in subdir */
-        client_error(efd, trans, trans->filename, "403", "Forbidden", "File cannot be located in a directory.");
+
+    if (strcasecmp(trans->req->method, "GET") == 0) trans->methodtype = GET;
+    else if (strcasecmp(trans->req->method, "POST") == 0) trans->methodtype = POST;
+        // else if (strcasecmp(trans->req->method, "HEAD") == 0) trans->methodtype = HEAD;
+    else {
+        client_error(efd, trans, trans->req->method, E_NOT_IMPLEMENTED);
         return;
     }
 
+    /* ?tar lists files to send back as one archive */
+    if (trans->methodtype == GET && batch_requested(trans)) {
+        batch_start(efd, trans, header_len);
+        return;
+    }
 
-    /* Check file */
-    struct stat sbuf;
-    if (trans->methodtype == GET || trans->methodtype == HEAD) {
-        if (stat(trans->filename, &sbuf) < 0) {
-            client_error(efd, trans, trans->filename, "404", "Not found",
-                         "Naive server couldn't find this file");
-            return;
-        }
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-            client_error(efd, trans, trans->filename, "403", "Forbidden",
-                         "Naive server couldn't read the file");
-            return;
-        }
-        trans->filesize = sbuf.st_size;
+    /* ?untar unpacks the body beneath a directory, the root included */
+    bool untar = trans->methodtype == POST && untar_requested(trans);
 
+    /* Parse URI from request, into a path beneath the served root */
+    if ((untar ? parse_dir : parse_uri)(trans->req->uri, trans->req->filename) == ERROR) {
+        client_error(efd, trans, "", E_BAD_URI);
+        return;
     }
+
     /* check post header */
-    int content_len = -1;
+    long content_len = -1;
     if (trans->methodtype == POST) {
-        http_header_item_t *hdr_item = trans->headers.head;
-        while (hdr_item != NULL) {
-            if (strcmp(hdr_item->key, "Content-Length") == 0) {
-                // debug_print(("value [%s]\n", hdr_item->value));
-                content_len = strtol(hdr_item->value, NULL, 10);
-                if (content_len == 0) {
-                    unix_error("strtol failed");
-                    content_len = -1;
-                }
-                break;
+        const char *value = get_header(&trans->headers, H_CONTENT_LENGTH);
+        if (value != NULL) {
+            // debug_print(("value [%s]\n", value));
+            content_len = strtol(value, NULL, 10);
+            if (content_len == 0) {
+                unix_error("strtol failed");
+                content_len = -1;
             }
-            hdr_item = hdr_item->next;
         }
         if (content_len <= 0) {
-            client_error(efd, trans, trans->filename, "400", "Bad Request",
-                         "Content-Length must be provided and be positive.");
+            client_error(efd, trans, trans->req->filename, E_NO_LENGTH);
             return;
         }
-        if (content_len > MAX_FILE_SIZE) {
-            client_error(efd, trans, trans->filename, "400", "Bad Request", "File larger than limit.");
+        if (content_len > config.max_file_size) {
+            client_error(efd, trans, trans->req->filename, E_TOO_LARGE);
             return;
         }
         trans->filesize = content_len;
     }
 
     /* transfer state */
-    epoll_event_t event;
     int pos_i, pos_j;
+    const bundle_entry_t *entry;
+    long obj_off;
     switch (trans->methodtype) {
         case GET:
         case HEAD:
-            trans->state = S_WRITE;
-            trans->next_stage = P_SEND_RESP_HEADER;
-            event.data.fd = trans->fd;
-            event.events = EPOLLOUT | EPOLLET;
-            if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
-                unix_error("epoll ctl");
+            /* bundle entries need no lookup, open or lock */
+            if ((entry = bundle_find(trans->req->filename)) != NULL) {
+                serve_bundle(efd, trans, entry);
+                return;
             }
-            break;
+            /* nor do stored objects, the fd is a dup of their segment's */
+            if ((trans->read_fd = objstore_open(trans->req->filename, &obj_off, &trans->filesize,
+                                                trans->req->etag)) >= 0) {
+                serve_extent(efd, trans, trans->read_fd, obj_off, get_filetype(trans->req->filename));
+                return;
+            }
+            trans->read_fd = INVALID_FD;
+            /* open, check and lock the file off the loop. on_download_opened continues. */
+            wait_disk(trans, D_OPEN_READ, on_download_opened);
+            return;
         case POST:
             /* copy remaining part */
             /* use for-loop instead of memcpy to avoid overlap */
@@ -316,91 +395,96 @@ void read_request_header(transaction_t *trans, int efd) {
             }
             trans->read_pos = pos_i;
             trans->state = S_READ;
-            trans->next_stage = P_READ_REQ_BODY;
+            if (untar) {
+                trans->next_stage = P_UNTAR;
+            } else if (objstore_wanted(trans) || objstore_holds(trans->req->filename)) {
+                trans->next_stage = P_OBJSTORE; /* stores it, or drops the stored version first */
+            } else {
+                trans->next_stage = dedup_requested(trans) ? P_DEDUP : P_READ_REQ_BODY;
+            }
+            /* dedup asks for the body only if the digest it was told is not stored yet */
+            if (trans->next_stage != P_DEDUP) send_continue(trans);
             break;
     }
-    handle_protocol_event(efd, trans);
+    queue_protocol(trans);
 }
 
 /*
- * parse_uri - parse URI into filename
+ * send_continue - answer Expect: 100-continue once the body is wanted.
+ * Only HTTP/1.1 clients that are still holding the body back get it. Nothing
+ * was sent on the connection before, so the interim response fits the empty
+ * send buffer and is written in place; if it does not, the client sends the
+ * body anyway when its own wait runs out.
  */
-void parse_uri(char *uri, char *filename) {
-    strcpy(filename, ".");
-    strncat(filename, uri, MAXLINE);
+void send_continue(transaction_t *trans) {
+    const char *expect = get_header(&trans->headers, H_EXPECT);
+
+    if (expect == NULL || strcasecmp(expect, "100-continue") != 0 || trans->read_pos > 0 ||
+        strcmp(trans->req->version, "HTTP/1.0") == 0)
+        return;
+    outq_push_str(&trans->outq, "HTTP/1.1 100 Continue\r\n\r\n");
+    while (not outq_empty(&trans->outq) && conn_flush(trans, trans->outq.pending) > 0);
+    outq_init(&trans->outq);
 }
 
 void send_resp_header(int efd, transaction_t *trans) {
     // debug_print(("send_resp_header\n"));
-    char filetype[MAXLINE];
-    int header_len;
-
-    /* Send response headers to client */
-    get_filetype(trans->filename, filetype);
-    header_len = snprintf(trans->write_buf, sizeof(trans->write_buf), "HTTP/1.0 200 OK\r\n");
-    header_len += snprintf(trans->write_buf + header_len, sizeof(trans->write_buf) - header_len,
-                           "Server: Naive HTTP Server\r\n");
-    header_len += snprintf(trans->write_buf + header_len, sizeof(trans->write_buf) - header_len,
-                           "Connection: close\r\n");
-    header_len += snprintf(trans->write_buf + header_len, sizeof(trans->write_buf) - header_len,
-                           "Content-Length: %ld\r\n", trans->filesize);
-    header_len += snprintf(trans->write_buf + header_len, sizeof(trans->write_buf) - header_len,
-                           "Content-Type: %s\r\n\r\n", filetype);
-
-    trans->write_len = strlen(trans->write_buf);
+    /* Queue response headers, the body follows them in the same flush */
+    outq_push_str(&trans->outq, "HTTP/1.0 200 OK\r\n"
+                                "Server: Naive HTTP Server\r\n"
+                                "Connection: close\r\n");
+    if (trans->req->etag[0] != '\0') outq_printf(&trans->outq, "ETag: \"%s\"\r\n", trans->req->etag);
+    outq_printf(&trans->outq, "Content-Length: %ld\r\nContent-Type: %s\r\n\r\n",
+                trans->filesize, get_filetype(trans->req->filename));
     trans->next_stage = P_SEND_RESP_BODY;
-    handle_transmission_event(efd, trans);
+    queue_protocol(trans);
 }
 
-void write_n(int efd, transaction_t *trans) {
-    // debug_print(("write all %ld\n", trans->write_len));
+/*
+ * write_out - flush the output queue to the socket
+ */
+void write_out(int efd, transaction_t *trans) {
+    // debug_print(("write out %ld\n", trans->outq.pending));
     ssize_t count;
-    while (trans->write_pos < trans->write_len) {
-        count = write(trans->fd, trans->write_buf, trans->write_len - trans->write_pos);
+    long granted, wait_ms, file_pos;
+    while (not outq_empty(&trans->outq)) {
+        granted = rate_take_bytes(trans->rate_bucket, trans->outq.pending, &wait_ms);
+        if (granted == 0) { /* out of tokens, park until refilled */
+            schedule_timer(&trans->pace_timer, wait_ms);
+            return;
+        }
+        count = conn_flush(trans, granted);
+        rate_return_bytes(trans->rate_bucket, granted - (count > 0 ? count : 0));
         if (count < 0) {
-            if (count == EAGAIN) return; /* no more can be written */
-            else {
+            if (errno != EAGAIN) {
                 unix_error("write");
                 finish_transaction(efd, trans);
-                return;
             }
-        } else if (count == 0) { /* client closed socket */
-            // debug_print(("client closed.\n"));
-            finish_transaction(efd, trans);
-        } else {
-            // debug_print(("%ld bytes written.\n", count));
-            trans->write_pos += count;
+            return; /* EAGAIN: no more can be written */
+        }
+        if ((file_pos = outq_file_offset(&trans->outq)) >= 0) {
+            trans->write_pos = file_pos;
+            stream_advance(trans);
         }
     }
     /* write task done! */
     printf("write task done\n");
-    handle_protocol_event(efd, trans);
-}
-
-void write_file(int efd, transaction_t *trans) {
-    // debug_print(("write file to socket\n"));
-    int rc;
-    while (trans->write_pos < trans->filesize) {
-        rc = sendfile(trans->fd, trans->read_fd, &trans->write_pos, trans->filesize - trans->write_pos);
-        if (rc < 0) {
-            if (errno != EAGAIN) {
-                unix_error("sendfile");
-                finish_transaction(efd, trans);
-            }
-            return;
-        }
-        // debug_print(("send file: %d bytes sent.\n", rc));
-    }
-    /* write done */
-    printf("whole file wrote to socket\n");
-    handle_protocol_event(efd, trans);
+    queue_protocol(trans);
 }
 
 void read_n(int efd, transaction_t *trans) {
     // debug_print(("read_n %ld\n", trans->read_len));
     ssize_t count = 0;
+    long granted, wait_ms;
+    if (not budget_admit(efd, trans)) return; /* paused until there is room, see budget.h */
     while (trans->read_pos < trans->read_len) {
-        count = read(trans->fd, trans->read_buf, MIN(trans->read_len, MAXBUF - trans->read_pos));
+        granted = rate_take_bytes(trans->rate_bucket, trans->read_len - trans->read_pos, &wait_ms);
+        if (granted == 0) { /* out of tokens, park until refilled */
+            schedule_timer(&trans->pace_timer, wait_ms);
+            return;
+        }
+        count = conn_read(trans, trans->read_buf + trans->read_pos, granted);
+        rate_return_bytes(trans->rate_bucket, granted - (count > 0 ? count : 0));
         if (count < 0) {
             if (errno != EAGAIN) {
                 unix_error("read");
@@ -411,205 +495,469 @@ void read_n(int efd, transaction_t *trans) {
             /* client closed socket. */
             // debug_print(("client closed.\n"));
             finish_transaction(efd, trans);
+            return;
         } else {
             // debug_print(("%ld bytes read.\n", count));
             trans->read_pos += count;
         }
     }
     /* no more or buffer full */
-    handle_protocol_event(efd, trans);
+    trans->body_spent = true;
+    queue_protocol(trans);
 }
 
 /*
- * serve_download - copy a file back to the client
+ * serve_bundle - copy an entry of the asset bundle back to the client
  */
-void serve_download(int efd, transaction_t *trans) {
-    // debug_print(("serve download\n"));
-    int fd;
-    fd = open(trans->filename, O_RDONLY, 0);
-    if (fd < 0) {
-        unix_error("open file");
-        client_error(efd, trans, trans->filename, "500", "Internal Server Error", "Cannot open file");
+void serve_bundle(int efd, transaction_t *trans, const bundle_entry_t *entry) {
+    memcpy(trans->req->etag, entry->etag, BUNDLE_ETAG_LEN);
+    trans->req->etag[BUNDLE_ETAG_LEN] = '\0';
+    trans->filesize = (long) entry->length;
+    serve_extent(efd, trans, bundle_fd(), (long) entry->offset, bundle_string(entry->type));
+}
+
+/*
+ * serve_extent - copy filesize bytes at off of fd back to the client, tagged with req->etag
+ */
+void serve_extent(int efd, transaction_t *trans, int fd, long off, const char *type) {
+    epoll_event_t event;
+    trans->timing.opened = now_us();
+    if (etag_matches(trans)) {
+        not_modified(efd, trans);
         return;
     }
+    outq_push_str(&trans->outq, "HTTP/1.0 200 OK\r\n"
+                                "Server: Naive HTTP Server\r\n"
+                                "Connection: close\r\n");
+    outq_printf(&trans->outq, "ETag: \"%s\"\r\nContent-Length: %ld\r\nContent-Type: %s\r\n\r\n",
+                trans->req->etag, trans->filesize, type);
+    outq_push_file(&trans->outq, fd, off, trans->filesize);
 
-    /* add read lock */
-    /* file size is not changed. This function is called directly after filesize is set. No writting. */
-    if (flock(fd, LOCK_SH | LOCK_NB) == -1) {
-        if (errno == EWOULDBLOCK) {
-            /* lock failed */
-            client_error(efd, trans, trans->filename, "503", "Service Unavaliable", "File is being written.");
-        } else {
-            unix_error("lock failed");
-            client_error(efd, trans, trans->filename, "500", "Internal Server Error", "Cannot acquire read lock.");
-        }
-        return;
+    event.data.fd = trans->fd;
+    event.events = EPOLLOUT | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
+        unix_error("epoll ctl");
     }
-    trans->haslock = true;
+    trans->state = S_WRITE;
+    trans->next_stage = P_DONE;
+    queue_transmission(trans);
+}
+
+/*
+ * serve_download - copy a file back to the client
+ * The file has been opened and read-locked by on_download_opened.
+ */
+void serve_download(int efd, transaction_t *trans) {
+    // debug_print(("serve download\n"));
     trans->write_pos = 0;
-    trans->read_fd = fd;
-    trans->state = S_WRITE_FILE;
+    outq_push_file(&trans->outq, trans->read_fd, 0, trans->filesize);
+    trans->state = S_WRITE;
     trans->next_stage = P_DONE;
-    handle_transmission_event(efd, trans);
+    queue_transmission(trans);
 }
 
 void serve_upload(int efd, transaction_t *trans) {
-    // debug_print(("serve upload %s\n", trans->filename));
-    if (trans->write_fd == INVALID_FD) {
-        /*
-        * Create new file.
-        * Use exclusive file lock to deal with consistency.
-        * Permission: only owner can read/write.
-        *
-        */
-        trans->write_fd = open(trans->filename, O_WRONLY | O_CREAT, S_IWUSR | S_IRUSR);
-        if (trans->write_fd <= 0) {
-            unix_error("Could not open file.");
-            client_error(efd, trans, trans->filename, "503", "Service Unavailable",
-                         "Cannot create the requested file.");
-            return;
-        }
-        /* add write lock */
-        if (flock(trans->write_fd, LOCK_EX | LOCK_NB) == -1) {
-            if (errno == EWOULDBLOCK) {
-                /* lock failed */
-                client_error(efd, trans, trans->filename, "503", "Service Unavaliable", "File is being read/written.");
-            } else {
-                unix_error("lock failed");
-                client_error(efd, trans, trans->filename, "500", "Internal Server Error", "Cannot acquire write lock.");
-            }
-            return;
-        }
-        trans->haslock = true;
-
-        /* write file */
-        trans->dest_file = fdopen(trans->write_fd, "w");
-        if (not trans->dest_file) {
-            unix_error("failed to open dest_file");
-            client_error(efd, trans, trans->filename, "503", "Service Unavailable",
-                         "Cannot create the requested file.");
-            return;
-        }
+    // debug_print(("serve upload %s\n", trans->req->filename));
+    if (trans->dest_file == NULL) {
+        /* create and lock the file off the loop. on_upload_opened comes back here. */
+        wait_disk(trans, D_OPEN_WRITE, on_upload_opened);
+        return;
     }
-    /* read buffer->file */
-    if (fwrite(trans->read_buf, sizeof(char), trans->read_pos, trans->dest_file) < trans->read_pos) {
-        unix_error("fwrite");
-        client_error(efd, trans, trans->filename, "500", "Server Internal Error",
-                     "Cannot write to the requested file.");
+    if (trans->read_pos > 0) {
+        /* read buffer->file */
+        wait_disk(trans, D_WRITE, on_upload_written);
         return;
     }
+    continue_upload(efd, trans);
+}
+
+/*
+ * continue_upload - account the flushed buffer and read more of the body
+ */
+void continue_upload(int efd, transaction_t *trans) {
     // debug_print(("%ld bytes wrote to file.\n", trans->read_pos));
     trans->saved_pos += trans->read_pos;
     trans->read_pos = 0;
     if (trans->saved_pos < trans->filesize) { /* Read more */
-        trans->read_len = MIN(MAXBUF, trans->filesize - trans->saved_pos);
+        trans->read_len = MIN(config.max_buf, trans->filesize - trans->saved_pos);
     } else { /* whole file uploaded */
         printf("file uploaded!\n");
-        trans->next_stage = P_DONE;
+        trans->next_stage = trans->dedup != NULL ? P_DEDUP : P_DONE;
         trans->read_len = 0;
+        if (durable_uploads()) { /* closing the connection acknowledges it, so sync first */
+            trans->disk_job.file = trans->dest_file; /* path is still the upload's */
+            trans->disk_job.target = NULL;
+            wait_sync(trans, on_upload_synced);
+            return;
+        }
+    }
+    trans->state = S_READ;
+    queue_transmission(trans);
+}
+
+/*
+ * wait_disk - hand a blocking operation of trans to the disk workers.
+ * The transaction is parked in S_WAIT_DISK and ignores socket events until done is called.
+ */
+void wait_disk(transaction_t *trans, disk_op_e op, disk_done_cb_t done) {
+    disk_job_t *job = &trans->disk_job;
+    job->op = op;
+    job->done = done;
+    job->arg = trans;
+    strncpy(job->path, trans->req->filename, MAXLINE - 1);
+    job->path[MAXLINE - 1] = '\0';
+    job->fd = INVALID_FD;
+    job->file = trans->dest_file;
+    job->buf = trans->read_buf;
+    job->len = trans->read_pos;
+    trans->state = S_WAIT_DISK;
+    submit_disk_job(job);
+}
+
+/*
+ * finish_if_aborted - finish a transaction that was closed while its disk job was in flight
+ */
+bool finish_if_aborted(int efd, transaction_t *trans) {
+    if (not trans->abort_pending) return false;
+    trans->state = S_INVALID;
+    finish_transaction(efd, trans);
+    return true;
+}
+
+void on_download_opened(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    trans->timing.opened = now_us();
+    if (job->result == OKAY) {
+        trans->read_fd = job->fd;
+        trans->haslock = true;
+        trans->filesize = job->sbuf.st_size;
+        strcpy(trans->req->etag, job->etag);
+        stream_start(trans);
+        warmup_hit(trans->req->filename, trans->filesize);
+    }
+    if (finish_if_aborted(efd, trans)) return;
+
+    if (job->result == ERROR) {
+        client_error(efd, trans, trans->req->filename, open_error(job));
+        return;
+    }
+    if (etag_matches(trans)) {
+        not_modified(efd, trans);
+        return;
     }
-    handle_transmission_event(efd, trans);
+
+    epoll_event_t event;
+    event.data.fd = trans->fd;
+    event.events = EPOLLOUT | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
+        unix_error("epoll ctl");
+    }
+    trans->state = S_WRITE;
+    trans->next_stage = P_SEND_RESP_HEADER;
+    queue_protocol(trans);
+}
+
+/*
+ * open_error - the error page for a failed D_OPEN_READ
+ */
+error_e open_error(disk_job_t *job) {
+    if (job->not_regular || job->err == EACCES || job->err == EXDEV || job->err == ELOOP) {
+        /* EXDEV and ELOOP: the path escapes the served root */
+        return E_FORBIDDEN;
+    } else if (job->lock_busy) {
+        return E_LOCKED_WRITING;
+    } else if (job->err == ENOENT || job->err == ENOTDIR) {
+        return E_NOT_FOUND;
+    }
+    posix_error(job->err, "open file");
+    return E_OPEN_FAILED;
+}
+
+/*
+ * etag_matches - whether If-None-Match names the ETag of the file, so the client's copy is current
+ */
+bool etag_matches(transaction_t *trans) {
+    const char *value = get_header(&trans->headers, H_IF_NONE_MATCH), *p;
+    size_t len = strlen(trans->req->etag);
+    if (value == NULL || len == 0) return false;
+    if (strcmp(value, "*") == 0) return true;
+    for (p = value; (p = strstr(p, trans->req->etag)) != NULL; p += len) {
+        if (p > value && p[-1] == '"' && p[len] == '"') return true;
+    }
+    return false;
+}
+
+void not_modified(int efd, transaction_t *trans) {
+    epoll_event_t event;
+    outq_printf(&trans->outq, "HTTP/1.0 304 Not Modified\r\n"
+                              "Server: Naive HTTP Server\r\n"
+                              "Connection: close\r\n"
+                              "ETag: \"%s\"\r\n\r\n", trans->req->etag);
+    event.data.fd = trans->fd;
+    event.events = EPOLLOUT | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
+        unix_error("epoll ctl");
+    }
+    trans->state = S_WRITE;
+    trans->next_stage = P_DONE;
+    queue_transmission(trans);
+}
+
+void on_upload_opened(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    trans->timing.opened = now_us();
+    if (job->result == OKAY) {
+        trans->write_fd = job->fd;
+        trans->dest_file = job->file;
+        trans->haslock = true;
+    }
+    if (finish_if_aborted(efd, trans)) return;
+
+    if (job->result == ERROR) {
+        if (job->lock_busy) {
+            client_error(efd, trans, trans->req->filename, E_LOCKED_BUSY);
+        } else {
+            posix_error(job->err, "Could not open file.");
+            client_error(efd, trans, trans->req->filename, E_CREATE_FAILED);
+        }
+        return;
+    }
+    serve_upload(efd, trans);
+}
+
+void on_upload_written(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    if (finish_if_aborted(efd, trans)) return;
+    if (job->result == ERROR) {
+        posix_error(job->err, "fwrite");
+        client_error(efd, trans, trans->req->filename, E_WRITE_FAILED);
+        return;
+    }
+    continue_upload(efd, trans);
+}
+
+void on_upload_synced(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    if (finish_if_aborted(efd, trans)) return;
+    if (job->result == ERROR) {
+        posix_error(job->err, "sync upload");
+        client_error(efd, trans, trans->req->filename, E_WRITE_FAILED);
+        return;
+    }
+    trans->state = S_READ;
+    queue_transmission(trans);
 }
 
 /*
  * get_filetype - derive file type from file name
  */
-void get_filetype(char *filename, char *filetype) {
+const char *get_filetype(char *filename) {
     if (strstr(filename, ".html"))
-        strcpy(filetype, "text/html");
+        return "text/html";
     else if (strstr(filename, ".gif"))
-        strcpy(filetype, "image/gif");
+        return "image/gif";
     else if (strstr(filename, ".png"))
-        strcpy(filetype, "image/png");
+        return "image/png";
     else if (strstr(filename, ".jpg"))
-        strcpy(filetype, "image/jpeg");
+        return "image/jpeg";
     else
-        strcpy(filetype, "application/octet-stream");
+        return "application/octet-stream";
 }
 
 void finish_transaction(int efd, transaction_t *trans) {
     // debug_print(("finish transaction\n"));
 
-    int active_fd = INVALID_FD;
+    if (trans->state == S_WAIT_DISK) { /* a worker still uses the buffers, finish on completion */
+        trans->abort_pending = true;
+        return;
+    }
+    PROBE3(finish, trans->fd, trans->state, trans->next_stage);
+    trans->timing.done = now_us();
+    if (trans->h2 == NULL) log_slow_request(trans); /* an HTTP/2 connection carries many requests */
+
+    cancel_timer(&trans->pace_timer);
+    rate_release(trans->rate_bucket);
+    trans->rate_bucket = NULL;
+    budget_release(efd, trans);
+    proxy_finish(efd, trans);
+    tls_finish(trans);
+    h2_finish(trans);
+    untar_finish(trans);
+    dedup_finish(trans);
+    destroy_headers(&trans->headers);
 
     if (epoll_ctl(efd, EPOLL_CTL_DEL, trans->fd, NULL) < 0) {
         unix_error("epoll del");
     }
-
-    /* It's fine to close fd more than once. Just ignore the error. */
-    active_fd = trans->read_fd > 0 ? trans->read_fd : trans->write_fd;
     if (close(trans->fd) < 0) {
         unix_error("close socket");
     }
-    if (trans->haslock && active_fd > 0 && flock(active_fd, LOCK_UN | LOCK_NB) < 0) {
-        unix_error("unlock");
-    }
-    if (trans->read_fd > 0 && close(trans->read_fd) < 0) {
-        unix_error("close read fd");
+
+    /*
+     * Files are closed by the disk workers, which drops the locks.
+     * An incomplete upload is removed before its lock is released.
+     */
+    if (trans->read_fd >= 0) {
+        stream_finish(trans);
+        submit_disk_close(trans->read_fd, NULL, NULL);
     }
     if (trans->dest_file != NULL) {
-        if (fclose(trans->dest_file) != 0) {
-            unix_error("fclose failed");
-        }
-        if (trans->saved_pos != trans->filesize && remove(trans->filename) == ERROR) { /* Remove created file */
-            unix_error("remove failed. But it's safe to ignore."); /* Just ignore. */
-        }
-    }
-    if (trans->write_fd > 0 && close(trans->write_fd) < 0) {
-        unix_error("close write fd. Usually safe to ignore.");
+        submit_disk_close(INVALID_FD, trans->dest_file,
+                          trans->saved_pos != trans->filesize ? trans->req->filename : NULL);
+    } else if (trans->write_fd >= 0) {
+        submit_disk_close(trans->write_fd, NULL, NULL);
     }
     remove_transaction_from_slots(trans);
 }
 
-void handle_protocol_event(int efd, transaction_t *trans) {
-    switch (trans->next_stage) {
-        case P_READ_REQ_BODY:
-            serve_upload(efd, trans);
-            break;
-        case P_SEND_RESP_BODY:
-            serve_download(efd, trans);
-            break;
-        case P_SEND_RESP_HEADER:
-            send_resp_header(efd, trans);
-            break;
-        case P_DONE:
-            finish_transaction(efd, trans);
-            break;
-        case P_INVALID:
-            app_error("fatal: invalid stage");
-            exit(-2);
-            break;
-    }
+/* milliseconds between two stage timestamps, -1 if either stage was not reached */
+static double stage_ms(long long from, long long to) {
+    return from && to ? (to - from) / 1000.0 : -1;
 }
 
-void handle_transmission_event(int efd, transaction_t *trans) {
-    switch (trans->state) {
-        case S_READ_REQ_HEADER:
-            read_request_header(trans, efd);
-            break;
-        case S_READ:
-            read_n(efd, trans);
-            break;
-        case S_WRITE:
-            write_n(efd, trans);
-            break;
-        case S_WRITE_FILE:
-            write_file(efd, trans);
-            break;
-        case S_INVALID:
-            app_error("fatal: invalid state");
-            exit(-2);
-            break;
+/*
+ * log_slow_request - one line with the stage breakdown of a request slower than config.slow_request_ms.
+ * header is the client sending its request, open the disk workers opening and locking the file,
+ * first byte the response waiting for the socket or the limiter, send the transfer itself.
+ */
+void log_slow_request(transaction_t *trans) {
+    trans_timing_t *t = &trans->timing;
+    double total = stage_ms(t->accepted, t->done);
+    long long ready = t->opened ? t->opened : t->header;
+
+    if (config.slow_request_ms <= 0 || total < config.slow_request_ms) return;
+    printf("slow request: %s %s total %.3fms header %.3fms open %.3fms first byte %.3fms send %.3fms "
+           "in %ld out %ld eagain %d wakeups %d\n",
+           trans->req->method[0] ? trans->req->method : "-", trans->req->uri[0] ? trans->req->uri : "-", total,
+           stage_ms(t->accepted, t->header), stage_ms(t->header, t->opened), stage_ms(ready, t->first_byte),
+           stage_ms(t->first_byte, t->done), t->bytes_in, t->bytes_out, t->eagains, t->wakeups);
+}
+
+static void invalid_state(int efd, transaction_t *trans) {
+    app_error("fatal: invalid state");
+    exit(-2);
+}
+
+static void invalid_stage(int efd, transaction_t *trans) {
+    app_error("fatal: invalid stage");
+    exit(-2);
+}
+
+static void wait_for_disk(int efd, transaction_t *trans) {
+    /* resumed by the disk job completion */
+}
+
+/* the transmission step of each state, run when the socket is ready */
+static const step_t transmission_steps[] = {
+        [S_INVALID] = invalid_state,
+        [S_READ_REQ_HEADER] = read_request_header,
+        [S_READ] = read_n,
+        [S_WRITE] = write_out,
+        [S_WAIT_DISK] = wait_for_disk,
+        [S_PROXY] = proxy_event,
+        [S_TLS_HANDSHAKE] = tls_handshake,
+        [S_H2] = h2_event,
+};
+
+/* the protocol step of each stage, run when the previous one finished its I/O */
+static const step_t protocol_steps[] = {
+        [P_INVALID] = invalid_stage,
+        [P_SEND_RESP_HEADER] = send_resp_header,
+        [P_SEND_RESP_BODY] = serve_download,
+        [P_READ_REQ_BODY] = serve_upload,
+        [P_READ_MANIFEST] = batch_begin,
+        [P_BATCH_NEXT] = batch_next,
+        [P_UNTAR] = untar_step,
+        [P_DEDUP] = dedup_step,
+        [P_OBJSTORE] = objstore_step,
+        [P_DONE] = finish_transaction,
+};
+
+/*
+ * queue_protocol - run the protocol step of trans->next_stage from the run queue
+ */
+void queue_protocol(transaction_t *trans) {
+    runq_push(trans, RUN_PROTOCOL);
+}
+
+/*
+ * queue_transmission - run the transmission step of trans->state from the run queue
+ */
+void queue_transmission(transaction_t *trans) {
+    runq_push(trans, RUN_TRANSMISSION);
+}
+
+/*
+ * run_transactions - run queued steps until no transaction is ready.
+ * Steps never call each other, they queue the transaction for the next one,
+ * so the stack stays one step deep however many stages a request goes
+ * through in one wakeup. Called once after every epoll batch.
+ */
+void run_transactions(int efd) {
+    transaction_t *trans;
+    run_e run;
+
+    while ((trans = runq_pop(&run)) != NULL) {
+        if (run == RUN_PROTOCOL) {
+            PROBE3(protocol, trans->fd, trans->state, trans->next_stage);
+            protocol_steps[trans->next_stage](efd, trans);
+        } else {
+            PROBE3(transmission, trans->fd, trans->state, trans->next_stage);
+            transmission_steps[trans->state](efd, trans);
+        }
     }
 }
 
+/* spelling of each interned header name, matched case-insensitively */
+#define HDR(id, name) [id] = {name, sizeof(name) - 1}
+static const struct {
+    const char *name;
+    size_t len;
+} header_names[N_HEADER_IDS] = {
+        HDR(H_HOST, "Host"),
+        HDR(H_CONTENT_LENGTH, "Content-Length"),
+        HDR(H_CONTENT_TYPE, "Content-Type"),
+        HDR(H_TRANSFER_ENCODING, "Transfer-Encoding"),
+        HDR(H_CONNECTION, "Connection"),
+        HDR(H_RANGE, "Range"),
+        HDR(H_ACCEPT_ENCODING, "Accept-Encoding"),
+        HDR(H_IF_NONE_MATCH, "If-None-Match"),
+        HDR(H_IF_MODIFIED_SINCE, "If-Modified-Since"),
+        HDR(H_EXPECT, "Expect"),
+        HDR(H_UPGRADE, "Upgrade"),
+        HDR(H_HTTP2_SETTINGS, "HTTP2-Settings"),
+        HDR(H_CONTENT_SHA256, "X-Content-SHA256"),
+};
+
 /*
  * init_headers Initialize a http_headers_t struct
+ * space is the first block of the arena, it outlives the transaction.
  */
-void init_headers(http_headers_t *hdrs) {
+void init_headers(http_headers_t *hdrs, char *space, size_t size) {
     hdrs->len = 0;
     hdrs->head = NULL;
     hdrs->tail = NULL;
+    memset(hdrs->known, 0, sizeof(hdrs->known));
+    arena_init(&hdrs->arena, space, size);
+}
+
+/*
+ * intern_header - id of a header name, H_OTHER if the server ignores it
+ */
+header_id_e intern_header(const char *name) {
+    size_t len = strlen(name);
+    int id;
+    for (id = H_OTHER + 1; id < N_HEADER_IDS; id++) {
+        if (header_names[id].len == len && strcasecmp(header_names[id].name, name) == 0) return id;
+    }
+    return H_OTHER;
+}
+
+/*
+ * get_header - value of the first header with an interned name, NULL if absent
+ */
+const char *get_header(const http_headers_t *hdrs, header_id_e id) {
+    return hdrs->known[id] ? hdrs->known[id]->value : NULL;
 }
 
 /*
@@ -617,6 +965,7 @@ void init_headers(http_headers_t *hdrs) {
  */
 void append_header(http_headers_t *hdrs, http_header_item_t *item) {
     item->next = NULL;
+    if (item->id != H_OTHER && hdrs->known[item->id] == NULL) hdrs->known[item->id] = item;
     if (hdrs->len == 0) {
         hdrs->len = 1;
         hdrs->head = item;
@@ -630,37 +979,39 @@ void append_header(http_headers_t *hdrs, http_header_item_t *item) {
 
 /*
  * destroy_headers Destroy a http_headers_t struct
+ * Frees all items at once, the arena's first block is kept for the next request.
  */
 void destroy_headers(http_headers_t *hdrs) {
-    destroy_header_item(hdrs->head);
+    arena_reset(&hdrs->arena);
+    hdrs->len = 0;
+    hdrs->head = NULL;
+    hdrs->tail = NULL;
+    memset(hdrs->known, 0, sizeof(hdrs->known));
 }
 
 /*
- * destroy_header_item Destroy a http_header_item_t struct
+ * client_error - send a pre-rendered error page and close the connection once sent.
+ * Without a cause the whole response is one shared blob. Otherwise the cause is
+ * spliced between the page's static fragments, only the length is formatted.
+ * cause must stay valid until the transaction finishes.
  */
-void destroy_header_item(http_header_item_t *item) {
-    if (item == NULL) return;
-    if (item->next != NULL) destroy_header_item(item->next);
-    free(item);
-}
-
-void client_error(int efd, transaction_t *trans, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-    int n;
-    int body_len = 0;
-    char body[MAXBUF];
+void client_error(int efd, transaction_t *trans, char *cause, error_e err) {
+    const error_page_t *page = get_error_page(err);
+    long cause_len = strlen(cause);
     epoll_event_t event;
-    printf("client error %s %s %s\n", errnum, shortmsg, longmsg);
-    /* Build the HTTP response body */
-    body_len = snprintf(body, sizeof(body) - body_len, "<html><title>Tiny Error</title>");
-    body_len += snprintf(body + body_len, sizeof(body) - body_len, "<body bgcolor=""ffffff"">\r\n");
-    body_len += snprintf(body + body_len, sizeof(body) - body_len, "%s: %s\r\n", errnum, shortmsg);
-    body_len += snprintf(body + body_len, sizeof(body) - body_len, "<p>%s: %s\r\n", longmsg, cause);
-    body_len += snprintf(body + body_len, sizeof(body) - body_len, "<hr><em>The Tiny Web server</em>\r\n");
-    /* Print the HTTP response */
-    n = snprintf(trans->write_buf, sizeof(trans->write_buf), "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    n += snprintf(trans->write_buf + n, sizeof(trans->write_buf) - n, "Content-Type: text/html\r\n");
-    n += snprintf(trans->write_buf + n, sizeof(trans->write_buf) - n, "Content-Length: %d\r\n\r\n", body_len);
-    n += snprintf(trans->write_buf + n, sizeof(trans->write_buf) - n, "%s", body);
+    printf("client error %s %s %s\n", page->errnum, page->shortmsg, page->longmsg);
+
+    /* drop whatever was queued, e.g. a response header */
+    outq_init(&trans->outq);
+    if (cause_len == 0) {
+        outq_push_mem(&trans->outq, page->full, page->full_len);
+    } else {
+        outq_push_mem(&trans->outq, page->head, page->head_len);
+        outq_printf(&trans->outq, "%ld", page->body_len + cause_len);
+        outq_push_mem(&trans->outq, page->body_head, page->body_head_len);
+        outq_push_mem(&trans->outq, cause, cause_len);
+        outq_push_str(&trans->outq, error_body_tail);
+    }
 
     event.data.fd = trans->fd;
     event.events = EPOLLOUT | EPOLLET;
@@ -668,16 +1019,15 @@ void client_error(int efd, transaction_t *trans, char *cause, char *errnum, char
         unix_error("epoll ctl");
     }
 
-    trans->write_len = n;
     trans->state = S_WRITE;
     trans->next_stage = P_DONE;
-    trans->write_pos = 0;
-    handle_transmission_event(efd, trans);
+    queue_transmission(trans);
 }
 
 void handle_epoll_error(int fd, int efd) {
     transaction_t *trans = find_transaction_for_fd(fd);
     if (trans == NULL) {
+        if (proxy_handle_event(fd, efd)) return;
         if (close(fd) < 0) unix_error("epoll error, close fd");
         return;
     } else {
@@ -14,17 +14,30 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 
 #include <sys/epoll.h>
 #include "misc.h"
+#include "arena.h"
 
 void handle_request(int fd, int listenfd, int efd);
 
 void handle_epoll_error(int fd, int efd);
 
+void run_transactions(int efd);
+
+/* header names the server looks at, interned while parsing */
+typedef enum {
+    H_OTHER, H_HOST, H_CONTENT_LENGTH, H_CONTENT_TYPE, H_TRANSFER_ENCODING, H_CONNECTION, H_RANGE,
+    H_ACCEPT_ENCODING, H_IF_NONE_MATCH, H_IF_MODIFIED_SINCE, H_EXPECT, H_UPGRADE, H_HTTP2_SETTINGS,
+    H_CONTENT_SHA256,
+    N_HEADER_IDS
+} header_id_e;
+
 /*
  * entity of request header
+ * key and value are slices of the header block copied into the header arena.
  */
 typedef struct _http_header_item_t {
-    char key[MAXLINE];
-    char value[MAXLINE];
+    header_id_e id;
+    const char *key;
+    const char *value;
     struct _http_header_item_t *next;
 } http_header_item_t;
 
@@ -34,6 +47,10 @@ typedef struct _http_header_item_t {
 typedef struct {
     int len;
     http_header_item_t *head, *tail;
+    http_header_item_t *known[N_HEADER_IDS]; /* first item with each interned name */
+    arena_t arena; /* items and strings, freed in bulk by destroy_headers */
 } http_headers_t;
 
+const char *get_header(const http_headers_t *hdrs, header_id_e id);
+
 #endif //NAIVE_HTTP_HTTP_H
@@ -2,26 +2,51 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
 #include "socket_util.h"
 #include "error_handler.h"
 #include "http.h"
 #include "transaction.h"
+#include "ratelimit.h"
+#include "timer.h"
+#include "diskio.h"
+#include "namespace.h"
+#include "bundle.h"
+#include "objstore.h"
+#include "dedup.h"
+#include "warmup.h"
+#include "budget.h"
+#include "config.h"
+#include "errors.h"
+#include "upgrade.h"
+#include "proxy.h"
+#include "tls.h"
+#include "h2.h"
+
+static void handle_signal_event(int sigfd, int efd, int *listenfd, int *upgradefd);
 
 int main(int argc, char **argv) {
     printf("Hello, World!\n");
 
-    int listenfd;
+    int listenfd, timerfd, diskfd, sigfd, upgradefd = INVALID_FD;
 
-    /* Check command-line arguments */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    /* Check command-line arguments and config file */
+    if (load_config(argc, argv) == ERROR) {
         return -1;
     }
+    print_config();
 
-    if ((listenfd = open_listenfd(argv[1])) < 0) {
+    /* after a binary upgrade the listen socket comes from the old process */
+    init_upgrade(argv);
+    if ((listenfd = inherit_listenfd()) == INVALID_FD) {
+        listenfd = open_listenfd(config.port, config.listenq);
+    }
+    if (listenfd < 0) {
         app_error("Fatal. Cannot open listen socket.");
         return -1;
     }
+    tune_listenfd(listenfd);
 
     /* setup epoll */
     int efd = epoll_create1(0);
@@ -37,7 +62,11 @@ int main(int argc, char **argv) {
         unix_error("Fatal. Failed to add listen fd to epoll");
         return -1;
     }
-    epoll_event_t events[MAXEVENT];
+    epoll_event_t *events = malloc(sizeof(epoll_event_t) * config.max_event);
+    if (events == NULL) {
+        unix_error("Fatal. malloc events");
+        return -1;
+    }
 
     /* ignore SIGPIPE */
     struct sigaction new_act, old_act;
@@ -47,21 +76,104 @@ int main(int argc, char **argv) {
         return -1;
     }
 
+    /*
+     * SIGHUP reloads the config, SIGUSR2 upgrades the binary and SIGQUIT drains and exits.
+     * Block them before any thread starts, so they are only delivered through the signalfd.
+     */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGQUIT);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0 || (sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        unix_error("Fatal. signalfd");
+        return -1;
+    }
+    event.data.fd = sigfd;
+    event.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, sigfd, &event) < 0) {
+        unix_error("Fatal. Failed to add signalfd to epoll");
+        return -1;
+    }
+
+    /* serve the root directory */
+    if (init_namespace(config.root) < 0) {
+        app_error("Fatal. Cannot open the served directory.");
+        return -1;
+    }
+
+    /* and the asset bundle in front of it */
+    if (init_bundle(config.bundle) == ERROR) {
+        app_error("Fatal. Cannot load the asset bundle.");
+        return -1;
+    }
+
     /* initialize transactions */
+    init_error_pages();
+    init_h2();
+    if (init_tls() == ERROR) {
+        app_error("Fatal. Cannot load the TLS certificate.");
+        return -1;
+    }
+    if (init_proxy() == ERROR) {
+        app_error("Fatal. Invalid proxy routes.");
+        return -1;
+    }
     init_transaction_slots();
+    init_rate_limiter();
+    if ((timerfd = init_timers(efd)) < 0) {
+        app_error("Fatal. Cannot setup timers.");
+        return -1;
+    }
+    if ((diskfd = init_disk_workers(efd)) < 0) {
+        app_error("Fatal. Cannot start disk workers.");
+        return -1;
+    }
+    if (init_objstore(config.objstore_dir) == ERROR) {
+        app_error("Fatal. Cannot open the object store.");
+        return -1;
+    }
+    if (init_dedup() == ERROR) {
+        app_error("Fatal. Cannot open the dedup store.");
+        return -1;
+    }
+    if (init_warmup() == ERROR) {
+        app_error("Fatal. Cannot start the page-cache warmup.");
+        return -1;
+    }
 
     /* Setup and running ! */
-    printf("Server up and running at port %s\n", argv[1]);
+    printf("Server up and running at port %s\n", config.port);
+    upgrade_ready();
 
     /* Wait for epoll event and handle it */
-    int n, i;
+    int n, i, rc;
     while (true) {
-        n = epoll_wait(efd, events, MAXEVENT, -1);
+        n = epoll_wait(efd, events, config.max_event, -1);
         if (n == -1) {
             unix_error("Fatal. epoll wait failed");
             return -1;
         }
         for (i = 0; i < n; i++) {
+            if (events[i].data.fd == timerfd) {
+                handle_timer_event(efd);
+                continue;
+            }
+            if (events[i].data.fd == diskfd) {
+                handle_disk_event(efd);
+                continue;
+            }
+            if (events[i].data.fd == sigfd) {
+                handle_signal_event(sigfd, efd, &listenfd, &upgradefd);
+                continue;
+            }
+            if (events[i].data.fd == upgradefd) {
+                rc = handle_upgrade_event(efd, upgradefd);
+                if (rc == UPGRADE_PENDING) continue;
+                upgradefd = INVALID_FD; /* closed */
+                if (rc == UPGRADE_ACCEPTING) start_draining(efd, &listenfd);
+                continue;
+            }
             if ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP)) {
                 app_error("epoll error");
                 handle_epoll_error(events[i].data.fd, efd); // TODO error handler
@@ -69,6 +181,52 @@ int main(int argc, char **argv) {
             }
             handle_request(events[i].data.fd, listenfd, efd);
         }
+        /* the handlers above only queued the transactions they woke up */
+        budget_wake(efd); /* disk jobs may have completed */
+        run_transactions(efd);
+        if (drained()) {
+            printf("drained, exiting\n");
+            return 0;
+        }
     }
     return 0;
 }
+
+/*
+ * handle_signal_event - reload the config on SIGHUP without dropping connections,
+ * hand the listen socket to a new binary on SIGUSR2, drain and exit on SIGQUIT
+ */
+static void handle_signal_event(int sigfd, int efd, int *listenfd, int *upgradefd) {
+    struct signalfd_siginfo info;
+    int fd;
+    while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+            case SIGHUP:
+                printf("SIGHUP: reloading configuration\n");
+                if (reload_config() == ERROR) {
+                    app_error("reload failed, keeping the current configuration");
+                    break;
+                }
+                /* the backlog of a listening socket can be changed in place */
+                if (*listenfd >= 0 && listen(*listenfd, config.listenq) < 0) {
+                    unix_error("listen");
+                }
+                if (*listenfd >= 0) tune_listenfd(*listenfd);
+                break;
+            case SIGUSR2:
+                printf("SIGUSR2: upgrading binary\n");
+                if (*listenfd < 0) {
+                    app_error("upgrade: not accepting any more");
+                    break;
+                }
+                if ((fd = start_upgrade(efd, *listenfd)) >= 0) *upgradefd = fd;
+                break;
+            case SIGQUIT:
+                printf("SIGQUIT: graceful shutdown\n");
+                start_draining(efd, listenfd);
+                break;
+            default:
+                break;
+        }
+    }
+}
@@ -0,0 +1,229 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * mkbundle - pack a directory into an asset bundle, see bundle.h
+ *
+ *   mkbundle <bundle> <dir>
+ *
+ * Every regular file beneath dir becomes an entry named by its path relative
+ * to dir, served as if dir were the root. The bundle is written next to its
+ * final name and renamed over it, so a running build never leaves half a bundle.
+ */
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include "bundle.h"
+#include "error_handler.h"
+#include "misc.h"
+
+typedef struct {
+    char *path; /* relative to dir */
+    char *file; /* as given to nftw */
+    const char *type;
+    uint64_t size;
+} source_t;
+
+static source_t *sources = NULL;
+static size_t n_sources = 0, cap_sources = 0;
+static size_t dir_len;
+
+static const struct {
+    const char *ext, *type;
+} mime_types[] = {
+        {".html", "text/html"},
+        {".htm", "text/html"},
+        {".css", "text/css"},
+        {".js", "text/javascript"},
+        {".mjs", "text/javascript"},
+        {".json", "application/json"},
+        {".map", "application/json"},
+        {".txt", "text/plain"},
+        {".xml", "application/xml"},
+        {".svg", "image/svg+xml"},
+        {".png", "image/png"},
+        {".gif", "image/gif"},
+        {".jpg", "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".webp", "image/webp"},
+        {".ico", "image/x-icon"},
+        {".woff", "font/woff"},
+        {".woff2", "font/woff2"},
+        {".wasm", "application/wasm"},
+        {".pdf", "application/pdf"},
+};
+
+static int visit(const char *file, const struct stat *sbuf, int flag, struct FTW *ftw);
+
+static const char *mime_type(const char *path);
+
+static int by_path(const void *a, const void *b);
+
+static uint64_t align(uint64_t off);
+
+static void copy_payload(int out, const source_t *src, uint64_t offset, char *etag);
+
+static void fatal(const char *msg);
+
+int main(int argc, char **argv) {
+    bundle_header_t h;
+    bundle_entry_t *entries;
+    uint32_t *slots, i;
+    char *strings, tmp[MAXLINE];
+    uint64_t strings_len = 0, off, mask;
+    size_t j;
+    int out;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <bundle> <dir>\n", argv[0]);
+        return 1;
+    }
+    dir_len = strlen(argv[2]);
+    while (dir_len > 1 && argv[2][dir_len - 1] == '/') argv[2][--dir_len] = '\0';
+    if (nftw(argv[2], visit, 64, FTW_PHYS) != 0) fatal("walk");
+    if (n_sources > UINT32_MAX / 4) {
+        app_error("too many files");
+        return 1;
+    }
+    qsort(sources, n_sources, sizeof(source_t), by_path);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BUNDLE_MAGIC, sizeof(h.magic));
+    h.n_entries = (uint32_t) n_sources;
+    for (h.n_slots = 2; h.n_slots < 2 * h.n_entries; h.n_slots *= 2);
+    h.slots_off = sizeof(h);
+    h.entries_off = h.slots_off + (uint64_t) h.n_slots * sizeof(uint32_t);
+    h.strings_off = h.entries_off + (uint64_t) h.n_entries * sizeof(bundle_entry_t);
+    for (j = 0; j < n_sources; j++) strings_len += strlen(sources[j].path) + strlen(sources[j].type) + 2;
+    h.strings_len = strings_len + 1; /* never empty */
+    h.payloads_off = align(h.strings_off + h.strings_len);
+
+    slots = calloc(h.n_slots, sizeof(uint32_t));
+    entries = calloc(n_sources + 1, sizeof(bundle_entry_t));
+    strings = calloc(h.strings_len, 1);
+    if (slots == NULL || entries == NULL || strings == NULL) fatal("calloc");
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", argv[1]);
+    if ((out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) fatal(tmp);
+
+    /* payloads first, so entries carry the ETags */
+    strings_len = 0;
+    mask = h.n_slots - 1;
+    for (j = 0, off = h.payloads_off; j < n_sources; j++) {
+        bundle_entry_t *e = &entries[j];
+        e->path = (uint32_t) strings_len;
+        strings_len += sprintf(strings + strings_len, "%s", sources[j].path) + 1;
+        e->type = (uint32_t) strings_len;
+        strings_len += sprintf(strings + strings_len, "%s", sources[j].type) + 1;
+        e->hash = bundle_hash(sources[j].path, strlen(sources[j].path));
+        e->offset = off;
+        e->length = sources[j].size;
+        copy_payload(out, &sources[j], off, e->etag);
+        off = align(off + e->length);
+        for (i = e->hash & mask; slots[i] != 0; i = (i + 1) & mask);
+        slots[i] = (uint32_t) j + 1;
+    }
+    h.size = n_sources > 0 ? entries[n_sources - 1].offset + entries[n_sources - 1].length : h.payloads_off;
+    if (ftruncate(out, (off_t) h.size) < 0) fatal("ftruncate");
+
+    if (pwrite(out, &h, sizeof(h), 0) != sizeof(h) ||
+        pwrite(out, slots, h.n_slots * sizeof(uint32_t), (off_t) h.slots_off) != h.n_slots * sizeof(uint32_t) ||
+        pwrite(out, entries, n_sources * sizeof(bundle_entry_t), (off_t) h.entries_off) !=
+        (ssize_t) (n_sources * sizeof(bundle_entry_t)) ||
+        pwrite(out, strings, h.strings_len, (off_t) h.strings_off) != (ssize_t) h.strings_len) {
+        fatal("write index");
+    }
+    if (fsync(out) < 0 || close(out) < 0) fatal("close");
+    if (rename(tmp, argv[1]) < 0) fatal("rename");
+    printf("%s: %zu entries, %lu bytes\n", argv[1], n_sources, (unsigned long) h.size);
+    return 0;
+}
+
+static int visit(const char *file, const struct stat *sbuf, int flag, struct FTW *ftw) {
+    source_t *src;
+    if (flag != FTW_F || !S_ISREG(sbuf->st_mode)) return 0;
+    if (n_sources == cap_sources) {
+        cap_sources = cap_sources ? cap_sources * 2 : 1024;
+        if ((sources = realloc(sources, cap_sources * sizeof(source_t))) == NULL) fatal("realloc");
+    }
+    src = &sources[n_sources++];
+    if ((src->file = strdup(file)) == NULL || (src->path = strdup(file + dir_len + 1)) == NULL) fatal("strdup");
+    if (strlen(src->path) >= MAXLINE) {
+        fprintf(stderr, "%s: name too long\n", file);
+        exit(1);
+    }
+    src->type = mime_type(src->path);
+    src->size = (uint64_t) sbuf->st_size;
+    return 0;
+}
+
+static const char *mime_type(const char *path) {
+    const char *dot = strrchr(path, '.');
+    size_t i;
+    if (dot != NULL && strchr(dot, '/') == NULL) {
+        for (i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+            if (strcasecmp(dot, mime_types[i].ext) == 0) return mime_types[i].type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+static int by_path(const void *a, const void *b) {
+    return strcmp(((const source_t *) a)->path, ((const source_t *) b)->path);
+}
+
+static uint64_t align(uint64_t off) {
+    return (off + BUNDLE_ALIGN - 1) & ~(uint64_t) (BUNDLE_ALIGN - 1);
+}
+
+/* copy src to offset of out, and its digest into etag */
+static void copy_payload(int out, const source_t *src, uint64_t offset, char *etag) {
+    static const char hex[] = "0123456789abcdef";
+    char buf[65536];
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len, i;
+    uint64_t copied = 0;
+    ssize_t n;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    int in = open(src->file, O_RDONLY);
+
+    if (in < 0) fatal(src->file);
+    if (ctx == NULL || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) fatal("EVP_DigestInit_ex");
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (copied + n > src->size) break;
+        if (pwrite(out, buf, n, (off_t) (offset + copied)) != n) fatal("write payload");
+        EVP_DigestUpdate(ctx, buf, n);
+        copied += n;
+    }
+    if (n < 0) fatal(src->file);
+    if (copied != src->size) {
+        fprintf(stderr, "%s: changed while building\n", src->file);
+        exit(1);
+    }
+    EVP_DigestFinal_ex(ctx, md, &md_len);
+    for (i = 0; i < BUNDLE_ETAG_LEN / 2; i++) {
+        etag[i * 2] = hex[md[i] >> 4];
+        etag[i * 2 + 1] = hex[md[i] & 15];
+    }
+    EVP_MD_CTX_free(ctx);
+    close(in);
+}
+
+static void fatal(const char *msg) {
+    unix_error((char *) msg);
+    exit(1);
+}
@@ -0,0 +1,427 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE /* O_PATH */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include "namespace.h"
+#include "error_handler.h"
+#include "misc.h"
+#include "timer.h"
+#include "config.h"
+
+/*
+ * The served namespace.
+ * Every path is resolved beneath a root directory fd with openat2(RESOLVE_BENEATH),
+ * so neither ".." nor symlinks can escape it. Directory fds of hot prefixes are
+ * cached, and deep paths are walked from their longest cached ancestor.
+ * Called from the disk workers, so the cache is protected by a mutex.
+ */
+typedef struct {
+    char path[MAXLINE]; /* directory relative to root, "" for root itself */
+    int fd;
+    int refs; /* users between lookup and release */
+    bool stale; /* evicted while in use, closed on last release */
+    long long expires;
+} dircache_entry_t;
+
+static int rootfd = INVALID_FD;
+static dircache_entry_t root_entry; /* never evicted */
+static bool has_openat2 = true;
+static dircache_entry_t **dircache;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int normalize_uri(char *uri, char *filename);
+
+static int hexval(char c);
+
+static int resolve_beneath(int dirfd, const char *path, int flags, mode_t mode);
+
+static dircache_entry_t *get_dir(const char *dir, int len, bool create);
+
+static void put_dir(dircache_entry_t *entry);
+
+static unsigned int hash_path(const char *path, int len);
+
+/*
+ * init_namespace - open the served root directory
+ */
+int init_namespace(char *root) {
+    if ((dircache = calloc(config.dircache_size, sizeof(dircache_entry_t *))) == NULL) {
+        unix_error("calloc dircache");
+        return ERROR;
+    }
+    rootfd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (rootfd < 0) {
+        unix_error("open root directory");
+        return ERROR;
+    }
+    struct open_how how = {.flags = O_PATH | O_DIRECTORY | O_CLOEXEC, .resolve = RESOLVE_BENEATH};
+    int fd = syscall(SYS_openat2, rootfd, ".", &how, sizeof(how));
+    if (fd < 0 && errno == ENOSYS) {
+        app_error("openat2 unavailable, resolving paths one component at a time without following symlinks");
+        has_openat2 = false;
+    }
+    if (fd >= 0) close(fd);
+    root_entry.path[0] = '\0';
+    root_entry.fd = rootfd;
+    root_entry.refs = 1;
+    root_entry.stale = false;
+    return OKAY;
+}
+
+/*
+ * parse_uri - percent-decode and normalize URI into a path relative to the root.
+ * The query and fragment are dropped, empty and "." segments are skipped and
+ * ".." pops a segment. Returns ERROR for NUL bytes, bad escapes, paths climbing
+ * above the root, or an empty result.
+ */
+int parse_uri(char *uri, char *filename) {
+    return normalize_uri(uri, filename) > 0 ? OKAY : ERROR;
+}
+
+/*
+ * parse_dir - like parse_uri, but the root itself is accepted as ""
+ */
+int parse_dir(char *uri, char *dir) {
+    return normalize_uri(uri, dir) >= 0 ? OKAY : ERROR;
+}
+
+/* normalize into filename, returns its length or ERROR */
+static int normalize_uri(char *uri, char *filename) {
+    char decoded[MAXLINE];
+    int i, j, hi, lo;
+    int seg_start, out = 0;
+
+    /* decode */
+    for (i = 0, j = 0; uri[i] && uri[i] != '?' && uri[i] != '#'; i++) {
+        if (j >= MAXLINE - 1) return ERROR;
+        if (uri[i] == '%') {
+            if ((hi = hexval(uri[i + 1])) < 0 || (lo = hexval(uri[i + 2])) < 0) return ERROR;
+            decoded[j] = (char) (hi * 16 + lo);
+            if (decoded[j] == '\0') return ERROR;
+            j++;
+            i += 2;
+        } else {
+            decoded[j++] = uri[i];
+        }
+    }
+    decoded[j] = '\0';
+    if (decoded[0] != '/') return ERROR;
+
+    /* normalize segment by segment */
+    for (i = 0; decoded[i];) {
+        while (decoded[i] == '/') i++;
+        seg_start = i;
+        while (decoded[i] && decoded[i] != '/') i++;
+        int seg_len = i - seg_start;
+        if (seg_len == 0 || (seg_len == 1 && decoded[seg_start] == '.')) continue;
+        if (seg_len == 2 && decoded[seg_start] == '.' && decoded[seg_start + 1] == '.') {
+            if (out == 0) return ERROR; /* above the root */
+            while (out > 0 && filename[out - 1] != '/') out--;
+            if (out > 0) out--; /* the separator */
+            continue;
+        }
+        if (out > 0) filename[out++] = '/';
+        memcpy(filename + out, decoded + seg_start, seg_len);
+        out += seg_len;
+    }
+    filename[out] = '\0';
+    return out;
+}
+
+/*
+ * ns_open - open a normalized path beneath the root.
+ * With O_CREAT, missing parent directories are created (owner only, like files).
+ */
+int ns_open(const char *path, int flags, mode_t mode) {
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int) (slash - path) : 0;
+    dircache_entry_t *dir = get_dir(path, dir_len, (flags & O_CREAT) != 0);
+    if (dir == NULL) return ERROR;
+    int fd = resolve_beneath(dir->fd, slash ? slash + 1 : path, flags | O_CLOEXEC, mode);
+    int saved = errno;
+    put_dir(dir);
+    errno = saved;
+    return fd;
+}
+
+int ns_unlink(const char *path) {
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int) (slash - path) : 0;
+    dircache_entry_t *dir = get_dir(path, dir_len, false);
+    if (dir == NULL) return ERROR;
+    int rc = unlinkat(dir->fd, slash ? slash + 1 : path, 0);
+    int saved = errno;
+    put_dir(dir);
+    errno = saved;
+    return rc;
+}
+/*
+ * ns_rename - atomically replace path to with path from, both beneath the root
+ */
+int ns_rename(const char *from, const char *to) {
+    const char *from_slash = strrchr(from, '/'), *to_slash = strrchr(to, '/');
+    dircache_entry_t *from_dir, *to_dir;
+    int rc, saved;
+
+    if ((from_dir = get_dir(from, from_slash ? (int) (from_slash - from) : 0, false)) == NULL) return ERROR;
+    if ((to_dir = get_dir(to, to_slash ? (int) (to_slash - to) : 0, false)) == NULL) {
+        put_dir(from_dir);
+        return ERROR;
+    }
+    rc = renameat(from_dir->fd, from_slash ? from_slash + 1 : from, to_dir->fd, to_slash ? to_slash + 1 : to);
+    saved = errno;
+    put_dir(from_dir);
+    put_dir(to_dir);
+    errno = saved;
+    return rc;
+}
+
+/*
+ * ns_sync_dir - make the directory entries beside path, beneath the root, durable
+ */
+int ns_sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    dircache_entry_t *dir = get_dir(path, slash ? (int) (slash - path) : 0, false);
+    int fd, rc, saved;
+    if (dir == NULL) return ERROR;
+    /* the cached descriptor is O_PATH, which cannot be synced */
+    fd = openat(dir->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    saved = errno;
+    put_dir(dir);
+    if (fd < 0) {
+        errno = saved;
+        return ERROR;
+    }
+    rc = fsync(fd);
+    saved = errno;
+    close(fd);
+    errno = saved;
+    return rc;
+}
+
+/*
+ * ns_link - make to another name of the file at from, both beneath the root.
+ * Directories leading to to are created. Without replace an existing to fails
+ * with EEXIST; with replace it is swapped for the new name atomically.
+ */
+int ns_link(const char *from, const char *to, bool replace) {
+    const char *from_slash = strrchr(from, '/'), *to_slash = strrchr(to, '/');
+    const char *from_base = from_slash ? from_slash + 1 : from, *to_base = to_slash ? to_slash + 1 : to;
+    dircache_entry_t *from_dir, *to_dir;
+    char tmp[MAXLINE];
+    int rc, saved;
+
+    if ((from_dir = get_dir(from, from_slash ? (int) (from_slash - from) : 0, false)) == NULL) return ERROR;
+    if ((to_dir = get_dir(to, to_slash ? (int) (to_slash - to) : 0, true)) == NULL) {
+        saved = errno;
+        put_dir(from_dir);
+        errno = saved;
+        return ERROR;
+    }
+    if (!replace) {
+        rc = linkat(from_dir->fd, from_base, to_dir->fd, to_base, 0);
+    } else {
+        /* link beside to, then rename over it. The worker thread id keeps the name unique. */
+        snprintf(tmp, sizeof(tmp), ".%s.link-%lx", to_base, (unsigned long) pthread_self());
+        unlinkat(to_dir->fd, tmp, 0); /* left over by a crash */
+        rc = linkat(from_dir->fd, from_base, to_dir->fd, tmp, 0);
+        if (rc == 0 && (rc = renameat(to_dir->fd, tmp, to_dir->fd, to_base)) < 0) {
+            saved = errno;
+            unlinkat(to_dir->fd, tmp, 0);
+            errno = saved;
+        }
+    }
+    saved = errno;
+    put_dir(from_dir);
+    put_dir(to_dir);
+    errno = saved;
+    return rc;
+}
+
+static int hexval(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * resolve_beneath - open path relative to dirfd without leaving it.
+ * Without openat2 the path is walked one component at a time, each opened with
+ * O_NOFOLLOW, so no symlink is followed anywhere on it; absolute paths and ".."
+ * fail with EXDEV like RESOLVE_BENEATH.
+ */
+static int resolve_beneath(int dirfd, const char *path, int flags, mode_t mode) {
+    char buf[MAXLINE], *seg, *next;
+    int cur = dirfd, fd, saved;
+
+    if (has_openat2) {
+        struct open_how how = {.flags = flags, .mode = (flags & O_CREAT) ? mode : 0,
+                .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS};
+        return syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+    }
+    if (strlen(path) >= sizeof(buf)) {
+        errno = ENAMETOOLONG;
+        return ERROR;
+    }
+    if (path[0] == '/') {
+        errno = EXDEV;
+        return ERROR;
+    }
+    strcpy(buf, path);
+    for (seg = buf; (next = strchr(seg, '/')) != NULL; seg = next + 1) {
+        *next = '\0';
+        if (seg[0] == '\0' || strcmp(seg, ".") == 0) continue;
+        if (strcmp(seg, "..") == 0) {
+            errno = EXDEV;
+            fd = ERROR;
+        } else {
+            fd = openat(cur, seg, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        saved = errno;
+        if (cur != dirfd) close(cur);
+        errno = saved;
+        if (fd < 0) return ERROR;
+        cur = fd;
+    }
+    if (strcmp(seg, "..") == 0) {
+        errno = EXDEV;
+        fd = ERROR;
+    } else {
+        fd = openat(cur, seg[0] ? seg : ".", flags | O_NOFOLLOW, mode);
+    }
+    saved = errno;
+    if (cur != dirfd) close(cur);
+    errno = saved;
+    return fd;
+}
+
+/*
+ * get_dir - get a referenced fd for the directory dir[0, len).
+ * Walks from the longest cached ancestor and caches the result.
+ * If create is set, missing directories are created on the way.
+ */
+static dircache_entry_t *get_dir(const char *dir, int len, bool create) {
+    unsigned int h;
+    int prefix, fd, base_fd;
+    dircache_entry_t *entry, *base = NULL;
+    long long now = now_ms();
+    char rest[MAXLINE];
+
+    if (len >= MAXLINE) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (len == 0) {
+        root_entry.refs += 1;
+        pthread_mutex_unlock(&cache_lock);
+        return &root_entry;
+    }
+    /* longest cached prefix, ending at a segment boundary */
+    for (prefix = len; prefix > 0; prefix--) {
+        if (prefix != len && dir[prefix] != '/') continue;
+        entry = dircache[hash_path(dir, prefix) & (config.dircache_size - 1)];
+        if (entry && !entry->stale && entry->expires > now &&
+            strncmp(entry->path, dir, prefix) == 0 && entry->path[prefix] == '\0') {
+            base = entry;
+            base->refs += 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (base && prefix == len) return base;
+
+    /* walk the rest beneath the ancestor, or the root */
+    base_fd = base ? base->fd : rootfd;
+    int skip = prefix > 0 ? prefix + 1 : 0;
+    memcpy(rest, dir + skip, len - skip);
+    rest[len - skip] = '\0';
+
+    fd = resolve_beneath(base_fd, rest, O_PATH | O_DIRECTORY | O_CLOEXEC, 0);
+    if (fd < 0 && errno == ENOENT && create) {
+        /* create missing components one by one */
+        char *seg = rest, *next;
+        int cur = base_fd, nfd;
+        while (seg) {
+            next = strchr(seg, '/');
+            if (next) *next = '\0';
+            if (mkdirat(cur, seg, S_IRWXU) < 0 && errno != EEXIST) break;
+            nfd = resolve_beneath(cur, seg, O_PATH | O_DIRECTORY | O_CLOEXEC, 0);
+            if (cur != base_fd) close(cur);
+            cur = base_fd;
+            if (nfd < 0) break;
+            cur = nfd;
+            seg = next ? next + 1 : NULL;
+        }
+        if (seg == NULL) {
+            fd = cur;
+        } else if (cur != base_fd) {
+            close(cur);
+        }
+    }
+    if (base) put_dir(base);
+    if (fd < 0) return NULL;
+
+    entry = malloc(sizeof(dircache_entry_t));
+    if (entry == NULL) {
+        unix_error("fatal: malloc");
+        exit(-1);
+    }
+    memcpy(entry->path, dir, len);
+    entry->path[len] = '\0';
+    entry->fd = fd;
+    entry->refs = 1;
+    entry->stale = false;
+    entry->expires = now + config.dircache_ttl * 1000L;
+
+    /* replace whatever occupies the slot */
+    h = hash_path(dir, len) & (config.dircache_size - 1);
+    pthread_mutex_lock(&cache_lock);
+    dircache_entry_t *old = dircache[h];
+    dircache[h] = entry;
+    entry->refs += 1; /* the cache's own reference */
+    if (old) old->stale = true;
+    pthread_mutex_unlock(&cache_lock);
+    if (old) put_dir(old); /* drop the cache's reference */
+    return entry;
+}
+
+static void put_dir(dircache_entry_t *entry) {
+    bool last;
+    pthread_mutex_lock(&cache_lock);
+    entry->refs -= 1;
+    last = entry->refs == 0;
+    pthread_mutex_unlock(&cache_lock);
+    if (last) {
+        close(entry->fd);
+        free(entry);
+    }
+}
+
+static unsigned int hash_path(const char *path, int len) { /* FNV-1a */
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) path[i];
+        h *= 16777619u;
+    }
+    return h;
+}
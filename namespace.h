@@ -0,0 +1,33 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_NAMESPACE_H
+#define NAIVE_HTTP_NAMESPACE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+int init_namespace(char *root);
+
+int parse_uri(char *uri, char *filename);
+
+int parse_dir(char *uri, char *dir);
+
+int ns_open(const char *path, int flags, mode_t mode);
+
+int ns_unlink(const char *path);
+
+int ns_rename(const char *from, const char *to);
+
+int ns_link(const char *from, const char *to, bool replace);
+
+int ns_sync_dir(const char *path);
+
+#endif //NAIVE_HTTP_NAMESPACE_H
@@ -0,0 +1,936 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include "objstore.h"
+#include "config.h"
+#include "arena.h"
+#include "dedup.h"
+#include "durable.h"
+#include "errors.h"
+#include "error_handler.h"
+
+#define REC_MAGIC 0x524f484eU /* "NHOR" */
+#define CHECKPOINT_MAGIC 0x50434e4eU /* "NHCP" */
+#define REC_ALIGN 8
+#define REC_TOMBSTONE 1 /* the name was replaced by a file, or deleted */
+#define REC_COPY 2 /* written by the compactor, only moves a version the index has */
+
+/* on disk, followed by the key and the data, padded to REC_ALIGN */
+typedef struct {
+    uint32_t magic;
+    uint32_t crc; /* CRC-32C of what follows it, key and data included */
+    uint64_t seq; /* orders versions of a name */
+    uint32_t key_len;
+    uint32_t flags;
+    uint64_t len; /* data bytes */
+} obj_record_t;
+
+/* checkpoint file: a header, then one checkpoint_entry_t and its key per object */
+typedef struct {
+    uint32_t magic;
+    uint32_t crc; /* of the rest of the file */
+    uint64_t seq; /* next sequence number */
+    uint32_t seg; /* replay starts at the beginning of this segment */
+    uint32_t n;
+    uint64_t len; /* of the file */
+} checkpoint_header_t;
+
+typedef struct {
+    uint64_t seq;
+    uint64_t off;
+    uint64_t len;
+    uint32_t seg;
+    uint32_t key_len; /* the key follows, padded to REC_ALIGN */
+} checkpoint_entry_t;
+
+/* the current version of a name */
+typedef struct _obj {
+    struct _obj *next; /* hash chain */
+    struct _obj *seg_prev, *seg_next; /* objects in the same segment */
+    uint64_t seq;
+    uint32_t seg;
+    uint32_t key_len;
+    long off; /* of the record */
+    long len; /* of the data */
+    bool dead; /* a tombstone seen during recovery, dropped once it is done */
+    char key[];
+} obj_t;
+
+typedef struct _segment {
+    uint32_t id;
+    int fd;
+    long end; /* bytes written or reserved */
+    long live; /* bytes of records the index points to */
+    int inflight; /* appends and compactions writing into it */
+    bool durable; /* its directory entry is synced */
+    obj_t *objs;
+} segment_t;
+
+static struct {
+    bool enabled;
+    char dir[MAXLINE - 32]; /* leaves room for the file names */
+    segment_t **segs; /* by id, NULL once deleted */
+    uint32_t n_segs;
+    segment_t *active; /* appended to */
+    obj_t **buckets;
+    size_t n_buckets, n_objs;
+    uint64_t next_seq;
+    /* index checkpoint, due whenever a segment is sealed */
+    bool checkpoint_due, checkpointing;
+    bool flushing; /* draining: checkpoint after every append, stop compacting */
+    uint32_t checkpoint_seg; /* replay starts here after the last completed checkpoint */
+    disk_job_t checkpoint_job;
+    char *checkpoint_buf;
+    /* compaction, one segment at a time */
+    disk_job_t compact_job;
+    segment_t *victim, *compact_dst;
+    disk_move_t *moves;
+    int n_moves;
+} store;
+
+static uint32_t crc_table[256];
+
+/* defined in http.c */
+void queue_protocol(transaction_t *trans);
+
+void queue_transmission(transaction_t *trans);
+
+bool finish_if_aborted(int efd, transaction_t *trans);
+
+void client_error(int efd, transaction_t *trans, char *cause, error_e err);
+
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+static uint32_t record_crc(const obj_record_t *rec, const char *key, const char *data);
+
+static long record_len(long key_len, long len);
+
+static void seg_path(uint32_t id, char *path);
+
+static segment_t *open_segment(uint32_t id, bool create);
+
+static void replay_segment(segment_t *seg, bool last);
+
+static int load_checkpoint(uint32_t *first_replayed);
+
+static obj_t *find_obj(const char *key, size_t key_len);
+
+static obj_t *insert_obj(const char *key, size_t key_len);
+
+static void remove_obj(obj_t *obj);
+
+static void place_obj(obj_t *obj, uint32_t seg, long off);
+
+static void unplace_obj(obj_t *obj);
+
+static void apply_record(const obj_record_t *rec, const char *key, uint32_t seg, long off, bool recovering);
+
+static segment_t *reserve(long len, long *off);
+
+static void roll();
+
+static void release(segment_t *seg);
+
+static void try_checkpoint();
+
+static void on_checkpointed(int efd, disk_job_t *job);
+
+static void maybe_compact();
+
+static void on_compacted(int efd, disk_job_t *job);
+
+static int by_from(const void *a, const void *b);
+
+static void submit_append(transaction_t *trans, segment_t *seg, long off, const char *buf, long len,
+                          disk_done_cb_t done);
+
+static void on_appended(int efd, disk_job_t *job);
+
+static void on_put(int efd, disk_job_t *job);
+
+static void on_dropped(int efd, disk_job_t *job);
+
+/*
+ * init_objstore - open the store in dir and rebuild its index, a no-op for "".
+ * Runs before the event loop, so it uses blocking calls throughout.
+ */
+int init_objstore(const char *dir) {
+    DIR *d;
+    struct dirent *ent;
+    uint32_t id, first = 0, last = 0, i;
+    bool any = false;
+    size_t b;
+    obj_t *obj, **link;
+
+    if (dir[0] == '\0') return OKAY;
+    for (i = 0; i < 256; i++) { /* CRC-32C, reflected */
+        uint32_t c = i;
+        int k;
+        for (k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0x82f63b78U : c >> 1;
+        crc_table[i] = c;
+    }
+    if (strlen(dir) >= sizeof(store.dir)) {
+        app_error("objstore: directory name too long");
+        return ERROR;
+    }
+    strcpy(store.dir, dir);
+    if (mkdir(dir, S_IRWXU) < 0 && errno != EEXIST) {
+        unix_error("objstore: mkdir");
+        return ERROR;
+    }
+    store.n_buckets = 1024;
+    if ((store.buckets = calloc(store.n_buckets, sizeof(obj_t *))) == NULL) {
+        unix_error("objstore: calloc");
+        return ERROR;
+    }
+
+    if ((d = opendir(dir)) == NULL) {
+        unix_error("objstore: opendir");
+        return ERROR;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        if (sscanf(ent->d_name, "seg-%8u", &id) != 1 || strlen(ent->d_name) != 12) continue;
+        if (open_segment(id, false) == NULL) {
+            closedir(d);
+            return ERROR;
+        }
+        if (!any || id > last) last = id;
+        any = true;
+    }
+    closedir(d);
+
+    if (load_checkpoint(&first) == ERROR) return ERROR;
+    store.checkpoint_seg = first;
+    for (id = first; any && id <= last; id++) {
+        if (id < store.n_segs && store.segs[id] != NULL) replay_segment(store.segs[id], id == last);
+    }
+
+    /* drop tombstones and versions in deleted segments, then account the rest */
+    for (b = 0; b < store.n_buckets; b++) {
+        for (link = &store.buckets[b]; (obj = *link) != NULL;) {
+            if (obj->dead || obj->seg >= store.n_segs || store.segs[obj->seg] == NULL) {
+                *link = obj->next;
+                store.n_objs--;
+                free(obj);
+                continue;
+            }
+            place_obj(obj, obj->seg, obj->off);
+            link = &obj->next;
+        }
+    }
+
+    if (any && store.segs[last] != NULL && store.segs[last]->end < config.objstore_segment_size) {
+        store.active = store.segs[last];
+    } else if ((store.active = open_segment(any ? last + 1 : 0, true)) == NULL) {
+        return ERROR;
+    }
+    store.enabled = true;
+    printf("objstore %s: %zu objects, replayed from segment %u, appending to %u\n",
+           dir, store.n_objs, first, store.active->id);
+    maybe_compact();
+    return OKAY;
+}
+
+/* checkpoint once the appends in flight are done, before exiting */
+void objstore_flush() {
+    if (!store.enabled) return;
+    store.flushing = true;
+    store.checkpoint_due = true;
+    try_checkpoint();
+}
+
+/* a POST the store takes: small, and the whole record fits in read_buf */
+bool objstore_wanted(transaction_t *trans) {
+    if (!store.enabled || trans->filesize > config.objstore_max_size) return false;
+    return (long) sizeof(obj_record_t) + (long) strlen(trans->req->filename) + trans->filesize + REC_ALIGN <=
+           config.max_buf;
+}
+
+bool objstore_holds(const char *key) {
+    return store.enabled && find_obj(key, strlen(key)) != NULL;
+}
+
+/*
+ * objstore_open - a descriptor for reading the object at key, and where its data is in it.
+ * etag gets a strong ETag, unique to the version. ERROR if the store has no such object.
+ */
+int objstore_open(const char *key, long *off, long *len, char *etag) {
+    obj_t *obj;
+    int fd;
+    if (!store.enabled || (obj = find_obj(key, strlen(key))) == NULL) return ERROR;
+    /* its own descriptor keeps the data readable after compaction deletes the segment */
+    if ((fd = dup(store.segs[obj->seg]->fd)) < 0) {
+        unix_error("objstore: dup");
+        return ERROR;
+    }
+    *off = obj->off + (long) sizeof(obj_record_t) + obj->key_len;
+    *len = obj->len;
+    sprintf(etag, "o%lx", (unsigned long) obj->seq);
+    return fd;
+}
+
+/*
+ * objstore_step - the P_OBJSTORE stage of a POST.
+ * A small body is read whole into read_buf behind room for the record header
+ * and appended to the active segment. A body going to a file instead first
+ * appends a tombstone, so the stored version does not shadow the file.
+ */
+void objstore_step(int efd, transaction_t *trans) {
+    const char *key = trans->req->filename;
+    long key_len = (long) strlen(key), len, off, head = (long) sizeof(obj_record_t) + key_len;
+    obj_record_t *rec;
+    segment_t *seg;
+    char *buf;
+
+    if (!objstore_wanted(trans)) {
+        len = record_len(key_len, 0);
+        if ((buf = arena_alloc(&trans->headers.arena, len)) == NULL) {
+            unix_error("fatal: malloc");
+            exit(-2);
+        }
+        memset(buf, 0, len);
+        rec = (obj_record_t *) buf;
+        rec->magic = REC_MAGIC;
+        rec->seq = store.next_seq++;
+        rec->key_len = key_len;
+        rec->flags = REC_TOMBSTONE;
+        memcpy(buf + sizeof(obj_record_t), key, key_len);
+        rec->crc = record_crc(rec, key, NULL);
+        seg = reserve(len, &off);
+        submit_append(trans, seg, off, buf, len, on_dropped);
+        return;
+    }
+
+    if (trans->obj_rec < 0) { /* make room for the header and read the rest of the body */
+        if (trans->read_pos > trans->filesize) trans->read_pos = trans->filesize; /* ignore what follows it */
+        memmove(trans->read_buf + head, trans->read_buf, trans->read_pos);
+        trans->read_pos += head;
+        trans->read_len = head + trans->filesize;
+        trans->obj_rec = 0;
+        trans->state = S_READ;
+        queue_transmission(trans); /* read_n comes back here */
+        return;
+    }
+
+    len = record_len(key_len, trans->filesize);
+    rec = (obj_record_t *) trans->read_buf;
+    rec->magic = REC_MAGIC;
+    rec->seq = store.next_seq++;
+    rec->key_len = key_len;
+    rec->flags = 0;
+    rec->len = trans->filesize;
+    memcpy(trans->read_buf + sizeof(obj_record_t), key, key_len);
+    memset(trans->read_buf + head + trans->filesize, 0, len - head - trans->filesize);
+    rec->crc = record_crc(rec, key, trans->read_buf + head);
+    seg = reserve(len, &off);
+    submit_append(trans, seg, off, trans->read_buf, len, on_put);
+}
+
+/*
+ * objstore_copy - D_COMPACT on a disk worker: copy the records of job->moves,
+ * marked as relocations so recovery never takes them for new versions.
+ */
+int objstore_copy(disk_job_t *job) {
+    char *buf = NULL, *grown;
+    long cap = 0;
+    obj_record_t *rec;
+    int i, saved;
+
+    for (i = 0; i < job->n_moves; i++) {
+        const disk_move_t *m = &job->moves[i];
+        if (m->len > cap) {
+            if ((grown = realloc(buf, m->len)) == NULL) goto fail;
+            buf = grown;
+            cap = m->len;
+        }
+        if (pread(job->src_fd, buf, m->len, m->from) != m->len) goto fail;
+        rec = (obj_record_t *) buf;
+        rec->flags |= REC_COPY;
+        rec->crc = record_crc(rec, buf + sizeof(obj_record_t), buf + sizeof(obj_record_t) + rec->key_len);
+        if (pwrite(job->fd, buf, m->len, m->to) != m->len) goto fail;
+    }
+    free(buf);
+    return OKAY;
+fail:
+    saved = errno ? errno : EIO;
+    free(buf);
+    errno = saved;
+    return ERROR;
+}
+
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    crc = ~crc;
+    while (len--) crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t record_crc(const obj_record_t *rec, const char *key, const char *data) {
+    uint32_t crc = crc32c(0, &rec->seq, sizeof(obj_record_t) - offsetof(obj_record_t, seq));
+    crc = crc32c(crc, key, rec->key_len);
+    return data != NULL ? crc32c(crc, data, rec->len) : crc;
+}
+
+static long record_len(long key_len, long len) {
+    return ((long) sizeof(obj_record_t) + key_len + len + REC_ALIGN - 1) & ~(long) (REC_ALIGN - 1);
+}
+
+static void seg_path(uint32_t id, char *path) {
+    snprintf(path, MAXLINE, "%s/seg-%08u", store.dir, id);
+}
+
+/* open or create segment id and register it */
+static segment_t *open_segment(uint32_t id, bool create) {
+    char path[MAXLINE];
+    struct stat sbuf;
+    segment_t *seg, **grown;
+    uint32_t n;
+
+    if (id >= store.n_segs) {
+        for (n = store.n_segs ? store.n_segs : 16; n <= id; n *= 2);
+        if ((grown = realloc(store.segs, n * sizeof(segment_t *))) == NULL) {
+            unix_error("objstore: realloc");
+            return NULL;
+        }
+        memset(grown + store.n_segs, 0, (n - store.n_segs) * sizeof(segment_t *));
+        store.segs = grown;
+        store.n_segs = n;
+    }
+    if ((seg = calloc(1, sizeof(segment_t))) == NULL) {
+        unix_error("objstore: calloc");
+        return NULL;
+    }
+    seg_path(id, path);
+    /* a metadata operation on the loop, once per objstore_segment_size bytes written */
+    seg->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), S_IRUSR | S_IWUSR);
+    if (seg->fd < 0 || fstat(seg->fd, &sbuf) < 0) {
+        unix_error("objstore: open segment");
+        if (seg->fd >= 0) close(seg->fd);
+        free(seg);
+        return NULL;
+    }
+    seg->id = id;
+    seg->durable = !create;
+    seg->end = (sbuf.st_size + REC_ALIGN - 1) & ~(long) (REC_ALIGN - 1);
+    store.segs[id] = seg;
+    return seg;
+}
+
+/*
+ * replay_segment - apply the records of a segment written after the checkpoint.
+ * Writes complete out of order, so a crash can leave holes between records:
+ * an invalid record is skipped by scanning ahead for the next valid one.
+ * The last segment is cut after its last valid record, where appends resume.
+ */
+static void replay_segment(segment_t *seg, bool last) {
+    struct stat sbuf;
+    const char *map;
+    const obj_record_t *rec;
+    long off = 0, size, valid_end = 0, skipped = 0;
+
+    if (fstat(seg->fd, &sbuf) < 0 || (size = sbuf.st_size) < (long) sizeof(obj_record_t)) {
+        if (last) seg->end = 0;
+        return;
+    }
+    if ((map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, seg->fd, 0)) == MAP_FAILED) {
+        unix_error("objstore: mmap segment");
+        return;
+    }
+    madvise((void *) map, size, MADV_SEQUENTIAL);
+    while (off + (long) sizeof(obj_record_t) <= size) {
+        rec = (const obj_record_t *) (map + off);
+        if (rec->magic == REC_MAGIC && rec->key_len > 0 && rec->key_len < MAXLINE &&
+            rec->len <= (uint64_t) (size - off) &&
+            record_len(rec->key_len, (long) rec->len) <= size - off &&
+            memchr(map + off + sizeof(obj_record_t), '\0', rec->key_len) == NULL &&
+            rec->crc == record_crc(rec, map + off + sizeof(obj_record_t),
+                                   rec->flags & REC_TOMBSTONE ? NULL : map + off + sizeof(obj_record_t) +
+                                                                       rec->key_len)) {
+            apply_record(rec, map + off + sizeof(obj_record_t), seg->id, off, true);
+            if (rec->seq >= store.next_seq) store.next_seq = rec->seq + 1;
+            off += record_len(rec->key_len, (long) rec->len);
+            valid_end = off;
+        } else {
+            off += REC_ALIGN;
+            skipped++;
+        }
+    }
+    munmap((void *) map, size);
+    if (last && valid_end < size) {
+        if (ftruncate(seg->fd, valid_end) < 0) unix_error("objstore: truncate torn tail");
+        seg->end = valid_end;
+    }
+    if (skipped) printf("objstore: segment %u, skipped %ld bytes of torn records\n", seg->id, skipped * REC_ALIGN);
+}
+
+/* load the index saved by the last checkpoint, if any, and where replay starts */
+static int load_checkpoint(uint32_t *first_replayed) {
+    char path[MAXLINE];
+    struct stat sbuf;
+    checkpoint_header_t h;
+    const checkpoint_entry_t *e;
+    char *buf;
+    long pos;
+    uint32_t i;
+    obj_t *obj;
+    int fd;
+
+    *first_replayed = 0;
+    snprintf(path, sizeof(path), "%s/checkpoint", store.dir);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno == ENOENT) return OKAY; /* replay everything */
+        unix_error("objstore: open checkpoint");
+        return ERROR;
+    }
+    if (fstat(fd, &sbuf) < 0 || sbuf.st_size < (long) sizeof(h) || (buf = malloc(sbuf.st_size)) == NULL ||
+        read(fd, buf, sbuf.st_size) != sbuf.st_size) {
+        app_error("objstore: cannot read the checkpoint");
+        close(fd);
+        return ERROR;
+    }
+    close(fd);
+    memcpy(&h, buf, sizeof(h));
+    if (h.magic != CHECKPOINT_MAGIC || h.len != (uint64_t) sbuf.st_size ||
+        h.crc != crc32c(0, buf + offsetof(checkpoint_header_t, seq), h.len - offsetof(checkpoint_header_t, seq))) {
+        /* rename makes a torn checkpoint impossible, so this is damage. Replay it all instead. */
+        app_error("objstore: corrupt checkpoint, replaying all segments");
+        free(buf);
+        return OKAY;
+    }
+    for (i = 0, pos = sizeof(h); i < h.n; i++) {
+        e = (const checkpoint_entry_t *) (buf + pos);
+        if ((obj = insert_obj(buf + pos + sizeof(*e), e->key_len)) == NULL) {
+            free(buf);
+            return ERROR;
+        }
+        obj->seq = e->seq;
+        obj->seg = e->seg;
+        obj->off = (long) e->off;
+        obj->len = (long) e->len;
+        pos += (sizeof(*e) + e->key_len + REC_ALIGN - 1) & ~(size_t) (REC_ALIGN - 1);
+    }
+    store.next_seq = h.seq;
+    *first_replayed = h.seg;
+    free(buf);
+    return OKAY;
+}
+
+static size_t hash_key(const char *key, size_t len) { /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    while (len--) {
+        h ^= (unsigned char) *key++;
+        h *= 1099511628211ULL;
+    }
+    return (size_t) h;
+}
+
+static obj_t *find_obj(const char *key, size_t key_len) {
+    obj_t *obj = store.buckets[hash_key(key, key_len) & (store.n_buckets - 1)];
+    for (; obj != NULL; obj = obj->next) {
+        if (obj->key_len == key_len && memcmp(obj->key, key, key_len) == 0) return obj->dead ? NULL : obj;
+    }
+    return NULL;
+}
+
+/* a new entry for key, not yet placed in a segment. The table doubles as it fills. */
+static obj_t *insert_obj(const char *key, size_t key_len) {
+    obj_t *obj, **grown, *next;
+    size_t b, n;
+
+    if (store.n_objs >= store.n_buckets) {
+        n = store.n_buckets * 2;
+        if ((grown = calloc(n, sizeof(obj_t *))) != NULL) {
+            for (b = 0; b < store.n_buckets; b++) {
+                for (obj = store.buckets[b]; obj != NULL; obj = next) {
+                    next = obj->next;
+                    obj->next = grown[hash_key(obj->key, obj->key_len) & (n - 1)];
+                    grown[hash_key(obj->key, obj->key_len) & (n - 1)] = obj;
+                }
+            }
+            free(store.buckets);
+            store.buckets = grown;
+            store.n_buckets = n;
+        }
+    }
+    if ((obj = calloc(1, sizeof(obj_t) + key_len + 1)) == NULL) {
+        unix_error("objstore: calloc");
+        return NULL;
+    }
+    memcpy(obj->key, key, key_len);
+    obj->key_len = key_len;
+    b = hash_key(key, key_len) & (store.n_buckets - 1);
+    obj->next = store.buckets[b];
+    store.buckets[b] = obj;
+    store.n_objs++;
+    return obj;
+}
+
+static void remove_obj(obj_t *obj) {
+    obj_t **link = &store.buckets[hash_key(obj->key, obj->key_len) & (store.n_buckets - 1)];
+    while (*link != obj) link = &(*link)->next;
+    *link = obj->next;
+    unplace_obj(obj);
+    store.n_objs--;
+    free(obj);
+}
+
+/* point obj at a record, accounting it live there */
+static void place_obj(obj_t *obj, uint32_t seg_id, long off) {
+    segment_t *seg = store.segs[seg_id];
+    obj->seg = seg_id;
+    obj->off = off;
+    obj->seg_prev = NULL;
+    obj->seg_next = seg->objs;
+    if (seg->objs) seg->objs->seg_prev = obj;
+    seg->objs = obj;
+    seg->live += record_len(obj->key_len, obj->len);
+}
+
+/* the record of obj becomes garbage */
+static void unplace_obj(obj_t *obj) {
+    segment_t *seg = obj->seg < store.n_segs ? store.segs[obj->seg] : NULL;
+    if (seg == NULL || (obj->seg_prev == NULL && seg->objs != obj)) return; /* not placed */
+    if (obj->seg_prev) obj->seg_prev->seg_next = obj->seg_next;
+    else seg->objs = obj->seg_next;
+    if (obj->seg_next) obj->seg_next->seg_prev = obj->seg_prev;
+    obj->seg_prev = obj->seg_next = NULL;
+    seg->live -= record_len(obj->key_len, obj->len);
+}
+
+/*
+ * apply_record - make the index reflect a record at (seg, off).
+ * Higher sequence numbers win, whatever order the records completed or are
+ * replayed in. A relocated copy only moves the version it copied. While
+ * recovering, objects are not placed yet and tombstones are kept as dead
+ * entries, so a stale copy replayed after them stays deleted.
+ */
+static void apply_record(const obj_record_t *rec, const char *key, uint32_t seg, long off, bool recovering) {
+    obj_t *obj = store.buckets[hash_key(key, rec->key_len) & (store.n_buckets - 1)];
+    for (; obj != NULL && !(obj->key_len == rec->key_len && memcmp(obj->key, key, rec->key_len) == 0);
+           obj = obj->next);
+
+    if (rec->flags & REC_COPY) {
+        if (obj == NULL || obj->dead || obj->seq != rec->seq) return;
+        if (!recovering) unplace_obj(obj);
+        obj->seg = seg;
+        obj->off = off;
+        if (!recovering) place_obj(obj, seg, off);
+        return;
+    }
+    if (obj != NULL && obj->seq >= rec->seq) return; /* a newer version is known */
+    if (rec->flags & REC_TOMBSTONE) {
+        if (!recovering) {
+            if (obj != NULL) remove_obj(obj);
+            return;
+        }
+        if (obj == NULL && (obj = insert_obj(key, rec->key_len)) == NULL) return;
+        obj->dead = true;
+        obj->seq = rec->seq;
+        return;
+    }
+    if (obj == NULL && (obj = insert_obj(key, rec->key_len)) == NULL) return;
+    if (!recovering) unplace_obj(obj);
+    obj->dead = false;
+    obj->seq = rec->seq;
+    obj->len = (long) rec->len;
+    obj->seg = seg;
+    obj->off = off;
+    if (!recovering) place_obj(obj, seg, off);
+}
+
+/* space for len bytes at the end of the active segment, sealing it first if full */
+static segment_t *reserve(long len, long *off) {
+    if (store.active->end > 0 && store.active->end + len > config.objstore_segment_size) roll();
+    *off = store.active->end;
+    store.active->end += len;
+    store.active->inflight++;
+    return store.active;
+}
+
+/* seal the active segment and start the next one, then checkpoint. Uploads completing in it compact it. */
+static void roll() {
+    segment_t *next = open_segment(store.active->id + 1, true);
+    if (next == NULL) return; /* keep appending to the old one */
+    store.active = next;
+    store.checkpoint_due = true;
+    try_checkpoint();
+}
+
+/* an append or compaction into seg completed */
+static void release(segment_t *seg) {
+    seg->inflight--;
+    if (store.flushing) store.checkpoint_due = true; /* the last one covers every append */
+    try_checkpoint();
+}
+
+/*
+ * try_checkpoint - save the index once the sealed segments have no writes in flight.
+ * Everything before the active segment is then in the index, and recovery
+ * replays from the start of the active segment.
+ */
+static void try_checkpoint() {
+    checkpoint_header_t *h;
+    checkpoint_entry_t *e;
+    size_t b, len = sizeof(checkpoint_header_t);
+    uint32_t i;
+    obj_t *obj;
+    char *buf;
+
+    if (!store.checkpoint_due || store.checkpointing) return;
+    for (i = 0; i < store.n_segs; i++) {
+        if (store.segs[i] != NULL && store.segs[i] != store.active && store.segs[i]->inflight > 0) return;
+    }
+    for (b = 0; b < store.n_buckets; b++) {
+        for (obj = store.buckets[b]; obj != NULL; obj = obj->next) {
+            len += (sizeof(checkpoint_entry_t) + obj->key_len + REC_ALIGN - 1) & ~(size_t) (REC_ALIGN - 1);
+        }
+    }
+    if ((buf = calloc(1, len)) == NULL) {
+        unix_error("objstore: checkpoint");
+        return; /* retried on the next release */
+    }
+    h = (checkpoint_header_t *) buf;
+    h->magic = CHECKPOINT_MAGIC;
+    h->seq = store.next_seq;
+    h->seg = store.active->id;
+    h->n = store.n_objs;
+    h->len = len;
+    len = sizeof(checkpoint_header_t);
+    for (b = 0; b < store.n_buckets; b++) {
+        for (obj = store.buckets[b]; obj != NULL; obj = obj->next) {
+            e = (checkpoint_entry_t *) (buf + len);
+            e->seq = obj->seq;
+            e->off = obj->off;
+            e->len = obj->len;
+            e->seg = obj->seg;
+            e->key_len = obj->key_len;
+            memcpy(buf + len + sizeof(*e), obj->key, obj->key_len);
+            len += (sizeof(*e) + obj->key_len + REC_ALIGN - 1) & ~(size_t) (REC_ALIGN - 1);
+        }
+    }
+    h->crc = crc32c(0, buf + offsetof(checkpoint_header_t, seq), len - offsetof(checkpoint_header_t, seq));
+
+    store.checkpoint_due = false;
+    store.checkpointing = true;
+    store.checkpoint_buf = buf;
+    store.checkpoint_job.op = D_SAVE;
+    store.checkpoint_job.done = on_checkpointed;
+    store.checkpoint_job.arg = NULL;
+    snprintf(store.checkpoint_job.path, MAXLINE, "%s/checkpoint", store.dir);
+    store.checkpoint_job.buf = buf;
+    store.checkpoint_job.len = (long) len;
+    submit_disk_job(&store.checkpoint_job);
+}
+
+static void on_checkpointed(int efd, disk_job_t *job) {
+    uint32_t seg = ((const checkpoint_header_t *) store.checkpoint_buf)->seg;
+    free(store.checkpoint_buf);
+    store.checkpoint_buf = NULL;
+    store.checkpointing = false;
+    if (job->result == ERROR) {
+        posix_error(job->err, "objstore: checkpoint");
+        store.checkpoint_due = true; /* with the next release */
+        return;
+    }
+    store.checkpoint_seg = seg;
+    printf("objstore: checkpoint of %zu objects, replay from segment %u\n", store.n_objs, seg);
+    try_checkpoint();
+    maybe_compact();
+}
+
+/*
+ * maybe_compact - copy the live records out of the sealed segment with the
+ * most garbage, if it has at least objstore_compact_garbage percent of it.
+ * The copies go to the active segment; on_compacted repoints the index.
+ * Replay only moves objects the checkpoint holds, so only segments before the
+ * one the last completed checkpoint replays from are taken.
+ */
+static void maybe_compact() {
+    segment_t *victim = NULL, *seg;
+    obj_t *obj;
+    uint32_t i;
+    long total = 0, off;
+    int n = 0;
+
+    if (store.victim != NULL || store.checkpointing || store.flushing || config.objstore_compact_garbage <= 0) return;
+    for (i = 0; i < store.checkpoint_seg && i < store.n_segs; i++) {
+        seg = store.segs[i];
+        if (seg == NULL || seg == store.active || seg->inflight > 0) continue;
+        if ((seg->end - seg->live) * 100 < seg->end * config.objstore_compact_garbage && seg->live > 0) continue;
+        if (victim == NULL || seg->end - seg->live > victim->end - victim->live) victim = seg;
+    }
+    if (victim == NULL) return;
+
+    for (obj = victim->objs; obj != NULL; obj = obj->seg_next) n++;
+    if (n > 0 && (store.moves = malloc(n * sizeof(disk_move_t))) == NULL) {
+        unix_error("objstore: compaction");
+        return;
+    }
+    for (obj = victim->objs, n = 0; obj != NULL; obj = obj->seg_next, n++) {
+        store.moves[n].from = obj->off;
+        store.moves[n].len = record_len(obj->key_len, obj->len);
+        total += store.moves[n].len;
+    }
+    qsort(store.moves, n, sizeof(disk_move_t), by_from);
+    store.victim = victim;
+    store.compact_dst = reserve(total, &off);
+    for (i = 0; i < (uint32_t) n; i++) {
+        store.moves[i].to = off;
+        off += store.moves[i].len;
+    }
+    store.n_moves = n;
+
+    store.compact_job.op = D_COMPACT;
+    store.compact_job.done = on_compacted;
+    store.compact_job.arg = NULL;
+    seg_path(victim->id, store.compact_job.path);
+    store.compact_job.fd = store.compact_dst->fd;
+    store.compact_job.src_fd = victim->fd;
+    store.compact_job.moves = store.moves;
+    store.compact_job.n_moves = n;
+    submit_disk_job(&store.compact_job);
+}
+
+static void on_compacted(int efd, disk_job_t *job) {
+    segment_t *victim = store.victim, *dst = store.compact_dst;
+    disk_move_t key, *m;
+    obj_t *obj, *next;
+    long moved = 0;
+
+    store.victim = NULL;
+    if (job->result == ERROR) {
+        posix_error(job->err, "objstore: compaction"); /* what was copied is garbage */
+    } else {
+        /* objects replaced meanwhile are not in the victim any more, their copies are garbage */
+        for (obj = victim->objs; obj != NULL; obj = next) {
+            next = obj->seg_next;
+            key.from = obj->off;
+            m = bsearch(&key, store.moves, store.n_moves, sizeof(disk_move_t), by_from);
+            unplace_obj(obj);
+            place_obj(obj, dst->id, m->to);
+            moved += m->len;
+        }
+        printf("objstore: compacted segment %u, moved %ld of %ld bytes\n", victim->id, moved, victim->end);
+        store.segs[victim->id] = NULL;
+        submit_disk_close(victim->fd, NULL, NULL);
+        free(victim);
+    }
+    free(store.moves);
+    store.moves = NULL;
+    release(dst);
+    if (job->result == OKAY) maybe_compact(); /* otherwise with the next upload */
+}
+
+static int by_from(const void *a, const void *b) {
+    long x = ((const disk_move_t *) a)->from, y = ((const disk_move_t *) b)->from;
+    return (x > y) - (x < y);
+}
+
+/* like wait_disk, for a record of trans */
+static void submit_append(transaction_t *trans, segment_t *seg, long off, const char *buf, long len,
+                          disk_done_cb_t done) {
+    disk_job_t *job = &trans->disk_job;
+    trans->obj_seg = seg;
+    trans->obj_rec = off;
+    job->op = D_APPEND;
+    job->done = durable_uploads() ? on_appended : done;
+    job->arg = trans;
+    job->fd = seg->fd;
+    job->file = NULL;
+    job->target = NULL;
+    job->buf = buf;
+    job->off = off;
+    job->len = len;
+    trans->state = S_WAIT_DISK;
+    submit_disk_job(job);
+}
+
+/* sync the record before it is acknowledged, buf and off stay for the next callback */
+static void on_appended(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    segment_t *seg = trans->obj_seg;
+    disk_done_cb_t then = ((const obj_record_t *) job->buf)->flags & REC_TOMBSTONE ? on_dropped : on_put;
+    if (job->result == ERROR) {
+        then(efd, job);
+        return;
+    }
+    job->path[0] = '\0';
+    job->target = seg->durable ? NULL : store.dir; /* a new segment */
+    wait_sync(trans, then);
+}
+
+static void on_put(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    segment_t *seg = trans->obj_seg;
+    epoll_event_t event;
+    char etag[32];
+
+    trans->obj_seg = NULL;
+    if (job->result == OKAY) {
+        if (job->target != NULL) seg->durable = true;
+        apply_record((const obj_record_t *) job->buf, job->buf + sizeof(obj_record_t), seg->id, job->off, false);
+        sprintf(etag, "o%lx", (unsigned long) ((const obj_record_t *) job->buf)->seq);
+    }
+    release(seg);
+    maybe_compact();
+    trans->saved_pos = trans->filesize;
+    if (finish_if_aborted(efd, trans)) return;
+    if (job->result == ERROR) {
+        posix_error(job->err, "objstore: append");
+        client_error(efd, trans, trans->req->filename, E_WRITE_FAILED);
+        return;
+    }
+
+    outq_printf(&trans->outq, "HTTP/1.0 201 Created\r\n"
+                              "Server: Naive HTTP Server\r\n"
+                              "Connection: close\r\n"
+                              "ETag: \"%s\"\r\nContent-Length: 0\r\n\r\n", etag);
+    event.data.fd = trans->fd;
+    event.events = EPOLLOUT | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
+        unix_error("epoll ctl");
+    }
+    trans->state = S_WRITE;
+    trans->next_stage = P_DONE;
+    queue_transmission(trans);
+}
+
+/* the stored version is gone, upload the body to a file as usual */
+static void on_dropped(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    segment_t *seg = trans->obj_seg;
+
+    trans->obj_seg = NULL;
+    if (job->result == OKAY) {
+        if (job->target != NULL) seg->durable = true;
+        apply_record((const obj_record_t *) job->buf, job->buf + sizeof(obj_record_t), seg->id, job->off, false);
+    }
+    release(seg);
+    maybe_compact();
+    if (finish_if_aborted(efd, trans)) return;
+    if (job->result == ERROR) {
+        posix_error(job->err, "objstore: append");
+        client_error(efd, trans, trans->req->filename, E_WRITE_FAILED);
+        return;
+    }
+    trans->state = S_READ;
+    trans->next_stage = dedup_requested(trans) ? P_DEDUP : P_READ_REQ_BODY;
+    queue_protocol(trans);
+}
@@ -0,0 +1,50 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_OBJSTORE_H
+#define NAIVE_HTTP_OBJSTORE_H
+
+#include <stdbool.h>
+#include "transaction.h"
+#include "diskio.h"
+
+/*
+ * Log-structured store for small uploads, on when config.objstore_dir is set.
+ *
+ * Uploads of at most objstore_max_size bytes are appended as one record each
+ * to the active segment file (seg-NNNNNNNN) instead of getting a file of their
+ * own, and an in-memory index maps names to (segment, offset, length). GETs
+ * dup the segment fd and sendfile the range. Overwrites leave the old record
+ * behind as garbage; a compactor copies the live records out of segments that
+ * are mostly garbage and deletes them.
+ *
+ * Every record carries a CRC-32C, so recovery replays whole records only.
+ * The index is saved as a checkpoint whenever the active segment fills up;
+ * startup loads it and replays the segments written since, and a last one is
+ * written on drain. Relocated copies written by the compactor never resurrect
+ * a name that was deleted meanwhile; the compactor only takes segments the
+ * last completed checkpoint covers, whose objects replay can move.
+ */
+
+int init_objstore(const char *dir);
+
+bool objstore_wanted(transaction_t *trans);
+
+bool objstore_holds(const char *key);
+
+int objstore_open(const char *key, long *off, long *len, char *etag);
+
+void objstore_step(int efd, transaction_t *trans);
+
+int objstore_copy(disk_job_t *job);
+
+void objstore_flush();
+
+#endif //NAIVE_HTTP_OBJSTORE_H
@@ -0,0 +1,176 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include "outq.h"
+#include "misc.h"
+#include "probes.h"
+
+static int reserve_seg(outq_t *q);
+
+void outq_init(outq_t *q) {
+    q->head = 0;
+    q->n = 0;
+    q->pending = 0;
+    q->scratch_len = 0;
+}
+
+bool outq_empty(outq_t *q) {
+    return q->n == 0;
+}
+
+/*
+ * outq_push_mem - queue len bytes at base. The memory is not copied and must stay valid until sent.
+ */
+int outq_push_mem(outq_t *q, const char *base, long len) {
+    if (len <= 0) return OKAY;
+    if (reserve_seg(q) == ERROR) return ERROR;
+    out_seg_t *seg = &q->segs[q->head + q->n];
+    /* extend the previous segment if contiguous, e.g. consecutive scratch fragments */
+    if (q->n > 0 && seg[-1].type == SEG_MEM && seg[-1].base + seg[-1].off + seg[-1].len == base) {
+        seg[-1].len += len;
+    } else {
+        seg->type = SEG_MEM;
+        seg->base = base;
+        seg->off = 0;
+        seg->len = len;
+        q->n++;
+    }
+    q->pending += len;
+    return OKAY;
+}
+
+int outq_push_str(outq_t *q, const char *str) {
+    return outq_push_mem(q, str, strlen(str));
+}
+
+/*
+ * outq_printf - format into the scratch area and queue the result
+ */
+int outq_printf(outq_t *q, const char *fmt, ...) {
+    va_list ap;
+    int len, room = OUTQ_SCRATCH - q->scratch_len;
+    va_start(ap, fmt);
+    len = vsnprintf(q->scratch + q->scratch_len, room, fmt, ap);
+    va_end(ap);
+    if (len < 0 || len >= room) return ERROR;
+    if (outq_push_mem(q, q->scratch + q->scratch_len, len) == ERROR) return ERROR;
+    q->scratch_len += len;
+    return len;
+}
+
+/*
+ * outq_push_copy - copy len binary bytes into the scratch area and queue them
+ */
+int outq_push_copy(outq_t *q, const void *data, int len) {
+    if (len > OUTQ_SCRATCH - q->scratch_len) return ERROR;
+    memcpy(q->scratch + q->scratch_len, data, len);
+    if (outq_push_mem(q, q->scratch + q->scratch_len, len) == ERROR) return ERROR;
+    q->scratch_len += len;
+    return len;
+}
+
+int outq_push_file(outq_t *q, int fd, long off, long len) {
+    if (len <= 0) return OKAY;
+    if (reserve_seg(q) == ERROR) return ERROR;
+    out_seg_t *seg = &q->segs[q->head + q->n];
+    seg->type = SEG_FILE;
+    seg->fd = fd;
+    seg->off = off;
+    seg->len = len;
+    q->n++;
+    q->pending += len;
+    return OKAY;
+}
+
+/*
+ * outq_flush - send up to budget bytes from the head of the queue with one syscall.
+ * Memory segments are gathered into a single sendmsg, corked with MSG_MORE
+ * when a file follows so the header and the first file bytes share packets.
+ * Returns the bytes sent, or -1 with errno set.
+ */
+ssize_t outq_flush(int sockfd, outq_t *q, long budget) {
+    struct iovec iov[OUTQ_SEGS];
+    struct msghdr msg;
+    out_seg_t *seg = &q->segs[q->head];
+    ssize_t rc;
+    long want;
+    int i, niov = 0, flags = MSG_NOSIGNAL;
+
+    if (q->n == 0) return 0;
+    if (seg->type == SEG_FILE) {
+        want = MIN(seg->len, budget);
+        rc = sendfile(sockfd, seg->fd, &seg->off, want);
+        PROBE3(sendfile, sockfd, want, rc);
+    } else {
+        for (i = 0, want = 0; i < q->n && seg[i].type == SEG_MEM && want < budget; i++, niov++) {
+            iov[i].iov_base = (void *) (seg[i].base + seg[i].off);
+            iov[i].iov_len = MIN(seg[i].len, budget - want);
+            want += iov[i].iov_len;
+        }
+        if (i < q->n && seg[i].type == SEG_FILE) flags |= MSG_MORE;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+        rc = sendmsg(sockfd, &msg, flags);
+        PROBE3(write, sockfd, want, rc);
+    }
+    if (rc < 0 && errno == EAGAIN) PROBE2(eagain, sockfd, seg->type == SEG_FILE ? 's' : 'w');
+    if (rc <= 0) return rc;
+
+    outq_consume(q, rc);
+    return rc;
+}
+
+/*
+ * outq_consume - drop n sent bytes from the head of the queue.
+ * The offset of a file segment is left alone, sendfile advances it itself.
+ */
+void outq_consume(outq_t *q, long n) {
+    out_seg_t *seg;
+    long used;
+    q->pending -= n;
+    while (n > 0) {
+        seg = &q->segs[q->head];
+        used = MIN(seg->len, n);
+        if (seg->type == SEG_MEM) seg->off += used;
+        seg->len -= used;
+        n -= used;
+        if (seg->len == 0) {
+            q->head++;
+            q->n--;
+        }
+    }
+    if (q->n == 0) outq_init(q);
+}
+
+/*
+ * outq_file_offset - file offset at the head of the queue, or -1 if it is not a file segment
+ */
+long outq_file_offset(outq_t *q) {
+    if (q->n == 0 || q->segs[q->head].type != SEG_FILE) return -1;
+    return q->segs[q->head].off;
+}
+
+/* make room for one more segment at the tail, moving the unsent ones down if needed */
+static int reserve_seg(outq_t *q) {
+    if (q->head + q->n < OUTQ_SEGS) return OKAY;
+    if (q->n == OUTQ_SEGS) return ERROR;
+    memmove(q->segs, q->segs + q->head, sizeof(out_seg_t) * q->n);
+    q->head = 0;
+    return OKAY;
+}
@@ -0,0 +1,68 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_OUTQ_H
+#define NAIVE_HTTP_OUTQ_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define OUTQ_SEGS 16 /* maximum queued segments */
+#define OUTQ_SCRATCH 1024 /* bytes for formatted fragments, e.g. the response header */
+
+/* where the bytes of a segment live */
+typedef enum {
+    SEG_MEM, /* memory that outlives the queue: static fragments, cached bodies, transaction fields */
+    SEG_FILE /* a range of a file, sent with sendfile */
+} seg_type_e;
+
+typedef struct {
+    seg_type_e type;
+    const char *base; /* SEG_MEM */
+    int fd; /* SEG_FILE */
+    long off; /* bytes of base already sent, or the file offset */
+    long len; /* bytes left */
+} out_seg_t;
+
+/*
+ * Per-connection output queue.
+ * Responses are queued as segments and flushed with writev/sendfile,
+ * without copying memory segments into a connection buffer.
+ */
+typedef struct {
+    out_seg_t segs[OUTQ_SEGS];
+    int head; /* first unsent segment */
+    int n; /* queued segments */
+    long pending; /* bytes left */
+    char scratch[OUTQ_SCRATCH];
+    int scratch_len;
+} outq_t;
+
+void outq_init(outq_t *q);
+
+int outq_push_mem(outq_t *q, const char *base, long len);
+
+int outq_push_str(outq_t *q, const char *str);
+
+int outq_printf(outq_t *q, const char *fmt, ...);
+
+int outq_push_copy(outq_t *q, const void *data, int len);
+
+int outq_push_file(outq_t *q, int fd, long off, long len);
+
+ssize_t outq_flush(int sockfd, outq_t *q, long budget);
+
+void outq_consume(outq_t *q, long n);
+
+bool outq_empty(outq_t *q);
+
+long outq_file_offset(outq_t *q);
+
+#endif //NAIVE_HTTP_OUTQ_H
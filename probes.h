@@ -0,0 +1,46 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_PROBES_H
+#define NAIVE_HTTP_PROBES_H
+
+/*
+ * USDT probes of provider naive_http, for the bpftrace scripts in test/trace.
+ * With systemtap's <sys/sdt.h> each probe is a nop and an ELF note, the
+ * arguments are only materialised when a tracer attaches. Without the
+ * header the probes compile to nothing.
+ *
+ *   accept(fd, admit)                  connection accepted, admit is the RATE_* verdict
+ *   header_done(fd, method, uri)       request header parsed
+ *   transmission(fd, state, stage)     run_transactions transmission step
+ *   protocol(fd, state, stage)         run_transactions protocol step
+ *   read(fd, len, result)              read from a client
+ *   write(fd, len, result)             sendmsg or SSL_write to a client
+ *   sendfile(fd, len, result)          sendfile to a client
+ *   eagain(fd, op)                     socket not ready, op is 'r', 'w' or 's'
+ *   finish(fd, state, stage)           transaction finished
+ *   pause(fd, paused, in_flight)       body reads stopped by the budget, see budget.h
+ *   resume(fd, paused, in_flight)      and started again, paused counts the ones still waiting
+ */
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define PROBE2(name, a, b) DTRACE_PROBE2(naive_http, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(naive_http, name, a, b, c)
+
+#else
+
+#define PROBE2(name, a, b) do { (void) (a); (void) (b); } while (0)
+#define PROBE3(name, a, b, c) do { (void) (a); (void) (b); (void) (c); } while (0)
+
+#endif
+
+#endif //NAIVE_HTTP_PROBES_H
@@ -0,0 +1,613 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE /* splice, pipe2, memmem */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <iso646.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "proxy.h"
+#include "socket_util.h"
+#include "error_handler.h"
+#include "errors.h"
+#include "config.h"
+
+/*
+ * Reverse proxy.
+ * Requests under a configured URI prefix are forwarded to an upstream. The
+ * request header is rewritten in place in read_buf and sent from there; bodies
+ * in both directions are spliced through a pipe, so they never pass through
+ * user space. Upstream connections are nonblocking, registered in the same epoll
+ * set, and kept alive in a small per-upstream pool together with their pipe.
+ *
+ * Routes are configured as whitespace-separated prefix=host:port[,connect_ms[,response_ms]].
+ */
+#define PIPE_CHUNK 65536 /* bytes spliced per call, the default pipe capacity */
+#define CHUNK_LINE 256 /* longest chunk-size line accepted */
+
+/* outcome of a relay step */
+enum {
+    RELAY_DONE, RELAY_AGAIN, RELAY_EOF, RELAY_ERROR
+};
+
+static upstream_t upstreams[MAX_UPSTREAMS];
+static int n_upstreams = 0;
+static upstream_conn_t **conn_map = NULL; /* upstream fd -> connection */
+static int conn_map_size = 0;
+
+/* defined in http.c */
+void client_error(int efd, transaction_t *trans, char *cause, error_e err);
+
+void finish_transaction(int efd, transaction_t *trans);
+
+static void proxy_run(int efd, upstream_conn_t *c);
+
+static void conn_timeout(int efd, void *arg);
+
+static const char *hop_headers[] = {"Connection", "Keep-Alive", "Proxy-Connection", "Transfer-Encoding", "TE",
+                                    "Upgrade", "Trailer", NULL};
+
+/*
+ * init_proxy - parse config.proxy and resolve the upstreams
+ */
+int init_proxy() {
+    char routes[MAXLINE], *save, *tok, *target, *opt, *colon, *host;
+    upstream_t *u;
+
+    strncpy(routes, config.proxy, MAXLINE - 1);
+    routes[MAXLINE - 1] = '\0';
+    for (tok = strtok_r(routes, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+        if (n_upstreams == MAX_UPSTREAMS) {
+            app_error("proxy: too many routes");
+            return ERROR;
+        }
+        u = &upstreams[n_upstreams];
+        memset(u, 0, sizeof(upstream_t));
+        if (tok[0] != '/' || (target = strchr(tok, '=')) == NULL) {
+            fprintf(stderr, "proxy: expected prefix=host:port, got %s\n", tok);
+            return ERROR;
+        }
+        *target++ = '\0';
+        if ((opt = strchr(target, ',')) != NULL) {
+            *opt++ = '\0';
+            u->connect_timeout = atoi(opt);
+            if ((opt = strchr(opt, ',')) != NULL) u->response_timeout = atoi(opt + 1);
+        }
+        if ((colon = strrchr(target, ':')) == NULL) {
+            fprintf(stderr, "proxy: expected host:port, got %s\n", target);
+            return ERROR;
+        }
+        strncpy(u->name, target, MAXLINE - 1);
+        *colon = '\0';
+        host = target;
+        if (host[0] == '[' && colon[-1] == ']') { /* [v6 address] */
+            host++;
+            colon[-1] = '\0';
+        }
+        if (resolve_addr(host, colon + 1, &u->addr, &u->addrlen) != 0) return ERROR;
+        strncpy(u->prefix, tok, MAXLINE - 1);
+        u->prefix_len = strlen(u->prefix);
+        printf("proxy: %s -> %s\n", u->prefix, u->name);
+        n_upstreams++;
+    }
+    return OKAY;
+}
+
+/*
+ * proxy_route - the upstream with the longest prefix of uri, or NULL to serve a file
+ */
+upstream_t *proxy_route(const char *uri) {
+    upstream_t *best = NULL;
+    int i;
+    for (i = 0; i < n_upstreams; i++) {
+        if (strncmp(uri, upstreams[i].prefix, upstreams[i].prefix_len) == 0 &&
+            (best == NULL || upstreams[i].prefix_len > best->prefix_len))
+            best = &upstreams[i];
+    }
+    return best;
+}
+
+static long connect_timeout(upstream_t *u) {
+    return u->connect_timeout > 0 ? u->connect_timeout : config.proxy_connect_timeout;
+}
+
+static long response_timeout(upstream_t *u) {
+    return u->response_timeout > 0 ? u->response_timeout : config.proxy_response_timeout;
+}
+
+static void map_conn(int fd, upstream_conn_t *c) {
+    upstream_conn_t **map;
+    int size;
+    if (fd >= conn_map_size) {
+        for (size = conn_map_size ? conn_map_size : 64; size <= fd; size *= 2);
+        if ((map = realloc(conn_map, sizeof(upstream_conn_t *) * size)) == NULL) {
+            unix_error("fatal: realloc");
+            exit(-1);
+        }
+        memset(map + conn_map_size, 0, sizeof(upstream_conn_t *) * (size - conn_map_size));
+        conn_map = map;
+        conn_map_size = size;
+    }
+    conn_map[fd] = c;
+}
+
+/*
+ * new_conn - start connecting to an upstream. Returns NULL on failure.
+ */
+static upstream_conn_t *new_conn(int efd, upstream_t *u) {
+    upstream_conn_t *c;
+    epoll_event_t event;
+
+    if ((c = malloc(sizeof(upstream_conn_t))) == NULL) {
+        unix_error("fatal: malloc");
+        exit(-1);
+    }
+    if ((c->fd = open_clientfd_nb((SA *) &u->addr, u->addrlen)) < 0) {
+        unix_error("proxy: connect");
+        free(c);
+        return NULL;
+    }
+    if (pipe2(c->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        unix_error("proxy: pipe");
+        close(c->fd);
+        free(c);
+        return NULL;
+    }
+    event.data.fd = c->fd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+        unix_error("proxy: epoll add");
+        close(c->fd);
+        close(c->pipe[0]);
+        close(c->pipe[1]);
+        free(c);
+        return NULL;
+    }
+    c->in_pipe = 0;
+    c->upstream = u;
+    c->trans = NULL;
+    c->phase = PX_CONNECT;
+    c->reused = false;
+    c->next = NULL;
+    init_timer_entry(&c->timer, conn_timeout, c);
+    map_conn(c->fd, c);
+    return c;
+}
+
+static void close_conn(int efd, upstream_conn_t *c) {
+    cancel_timer(&c->timer);
+    if (epoll_ctl(efd, EPOLL_CTL_DEL, c->fd, NULL) < 0) unix_error("proxy: epoll del");
+    conn_map[c->fd] = NULL;
+    close(c->fd);
+    close(c->pipe[0]);
+    close(c->pipe[1]);
+    free(c);
+}
+
+static upstream_conn_t *pool_get(upstream_t *u) {
+    upstream_conn_t *c = u->idle;
+    if (c == NULL) return NULL;
+    u->idle = c->next;
+    u->n_idle--;
+    cancel_timer(&c->timer);
+    c->reused = true;
+    c->phase = PX_SEND_REQ;
+    return c;
+}
+
+static void pool_put(int efd, upstream_conn_t *c) {
+    upstream_t *u = c->upstream;
+    if (u->n_idle >= config.proxy_pool_size) {
+        close_conn(efd, c);
+        return;
+    }
+    c->trans = NULL;
+    c->next = u->idle;
+    u->idle = c;
+    u->n_idle++;
+    schedule_timer(&c->timer, config.proxy_idle_timeout * 1000L);
+}
+
+static void pool_remove(upstream_conn_t *c) {
+    upstream_conn_t **p;
+    for (p = &c->upstream->idle; *p; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            c->upstream->n_idle--;
+            return;
+        }
+    }
+}
+
+/* header name of line is name, followed by a colon */
+static bool has_name(const char *line, const char *name) {
+    size_t len = strlen(name);
+    return strncasecmp(line, name, len) == 0 && line[len] == ':';
+}
+
+/*
+ * strip_hop_headers - drop hop-by-hop headers in place.
+ * buf holds a header of len bytes including the blank line; the first line is kept.
+ * Returns the length of what is left, without the blank line.
+ */
+static long strip_hop_headers(char *buf, long len) {
+    char *end = buf + len - 2, *line, *eol, *out;
+    int i;
+    bool drop;
+
+    line = out = (char *) memmem(buf, len, "\r\n", 2) + 2;
+    while (line < end) {
+        eol = (char *) memmem(line, end - line, "\r\n", 2) + 2;
+        for (i = 0, drop = false; hop_headers[i] && !drop; i++) drop = has_name(line, hop_headers[i]);
+        if (!drop) {
+            if (out != line) memmove(out, line, eol - line);
+            out += eol - line;
+        }
+        line = eol;
+    }
+    return out - buf;
+}
+
+/* request header, then the body bytes that came in with it */
+static void queue_request(upstream_conn_t *c) {
+    char *buf = c->trans->read_buf;
+    outq_init(&c->outq);
+    outq_push_mem(&c->outq, buf, c->req_head_len);
+    outq_push_str(&c->outq, "Connection: keep-alive\r\n\r\n");
+    outq_push_mem(&c->outq, buf + c->req_body_off, c->req_body_len);
+}
+
+static void attach(upstream_conn_t *c, transaction_t *trans) {
+    c->trans = trans;
+    trans->upstream = c;
+    c->resp_started = false;
+    c->chunked = false;
+    c->reusable = false;
+    c->moved = 0;
+    queue_request(c);
+    if (c->phase == PX_CONNECT) schedule_timer(&c->timer, connect_timeout(c->upstream));
+    else schedule_timer(&c->timer, response_timeout(c->upstream));
+}
+
+/*
+ * proxy_start - forward the request in trans, whose header has just been read
+ */
+void proxy_start(int efd, transaction_t *trans, upstream_t *u) {
+    long content_len = 0, head_len = trans->parse_pos + 4;
+    const char *length = get_header(&trans->headers, H_CONTENT_LENGTH);
+    upstream_conn_t *c;
+    epoll_event_t event;
+
+    if (get_header(&trans->headers, H_TRANSFER_ENCODING) != NULL) { /* only length-delimited bodies are relayed */
+        content_len = -1;
+    } else if (length != NULL) {
+        content_len = strtol(length, NULL, 10);
+    }
+    if (content_len < 0) {
+        client_error(efd, trans, "", E_NO_LENGTH);
+        return;
+    }
+    if (trans->tls != NULL) { /* bodies are spliced, which needs plaintext or kernel TLS */
+        client_error(efd, trans, "proxying over userspace TLS", E_NOT_IMPLEMENTED);
+        return;
+    }
+    if ((c = pool_get(u)) == NULL && (c = new_conn(efd, u)) == NULL) {
+        client_error(efd, trans, "", E_BAD_GATEWAY);
+        return;
+    }
+    c->req_head_len = strip_hop_headers(trans->read_buf, head_len);
+    c->req_body_off = head_len;
+    c->req_body_len = MIN(trans->read_pos - head_len, content_len);
+    c->req_remaining = content_len - c->req_body_len;
+    c->replayable = c->req_remaining == 0;
+    attach(c, trans);
+
+    /* the client is read from and written to while proxying */
+    event.data.fd = trans->fd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
+        unix_error("epoll ctl");
+    }
+    trans->state = S_PROXY;
+    printf("proxy: %s %s -> %s%s\n", trans->req->method, trans->req->uri, u->name, c->reused ? " (pooled)" : "");
+    proxy_run(efd, c);
+}
+
+/*
+ * proxy_fail - give up on the upstream, answering err if the client has not seen a response yet
+ */
+static void proxy_fail(int efd, upstream_conn_t *c, error_e err) {
+    transaction_t *trans = c->trans;
+    bool answered = c->phase >= PX_SEND_HEADER;
+    trans->upstream = NULL;
+    close_conn(efd, c);
+    if (answered) finish_transaction(efd, trans);
+    else client_error(efd, trans, "", err);
+}
+
+/*
+ * upstream_broken - the upstream closed or reset the connection before answering.
+ * A pooled connection may have been closed while idle, so the request is replayed
+ * once on a fresh one if it is still entirely in read_buf.
+ */
+static void upstream_broken(int efd, upstream_conn_t *c) {
+    transaction_t *trans = c->trans;
+    upstream_conn_t *fresh;
+
+    if (c->reused && c->replayable && !c->resp_started && (fresh = new_conn(efd, c->upstream)) != NULL) {
+        fresh->req_head_len = c->req_head_len;
+        fresh->req_body_off = c->req_body_off;
+        fresh->req_body_len = c->req_body_len;
+        fresh->req_remaining = 0;
+        fresh->replayable = true;
+        close_conn(efd, c);
+        attach(fresh, trans);
+        proxy_run(efd, fresh);
+        return;
+    }
+    app_error("proxy: upstream closed the connection");
+    proxy_fail(efd, c, E_BAD_GATEWAY);
+}
+
+static void conn_timeout(int efd, void *arg) {
+    upstream_conn_t *c = (upstream_conn_t *) arg;
+    if (c->trans == NULL) { /* idle for too long */
+        pool_remove(c);
+        close_conn(efd, c);
+        return;
+    }
+    app_error("proxy: upstream timed out");
+    proxy_fail(efd, c, E_GATEWAY_TIMEOUT);
+}
+
+/*
+ * splice_relay - move *remaining bytes (-1: until EOF) from src to dst through the pipe.
+ * The pipe is drained before more is pulled in, so DONE and EOF mean everything is out.
+ */
+static int splice_relay(upstream_conn_t *c, int src, int dst, long *remaining) {
+    ssize_t n;
+    long want;
+    while (true) {
+        if (c->in_pipe > 0) {
+            n = splice(c->pipe[0], NULL, dst, NULL, c->in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) return errno == EAGAIN ? RELAY_AGAIN : RELAY_ERROR;
+            c->in_pipe -= n;
+            c->moved += n;
+            continue;
+        }
+        if (*remaining == 0) return RELAY_DONE;
+        want = *remaining < 0 ? PIPE_CHUNK : MIN(*remaining, PIPE_CHUNK);
+        n = splice(src, NULL, c->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) return errno == EAGAIN ? RELAY_AGAIN : RELAY_ERROR;
+        if (n == 0) return RELAY_EOF;
+        c->in_pipe += n;
+        if (*remaining > 0) *remaining -= n;
+    }
+}
+
+/*
+ * relay_chunked - relay a chunked body as a plain one.
+ * Chunk framing is peeked and consumed from the socket, chunk data is spliced.
+ */
+static int relay_chunked(upstream_conn_t *c, int dst) {
+    char line[CHUNK_LINE], *eol;
+    ssize_t n;
+    int rc;
+    while (true) {
+        if (c->chunk_phase == CH_DATA) {
+            if ((rc = splice_relay(c, c->fd, dst, &c->chunk_left)) != RELAY_DONE)
+                return rc == RELAY_EOF ? RELAY_ERROR : rc;
+            c->chunk_phase = CH_DATA_END;
+            continue;
+        }
+        /* a framing line: chunk size, the CRLF after the data, or a trailer */
+        n = recv(c->fd, line, sizeof(line) - 1, MSG_PEEK);
+        if (n < 0) return errno == EAGAIN ? RELAY_AGAIN : RELAY_ERROR;
+        if (n == 0) return RELAY_ERROR;
+        if ((eol = memmem(line, n, "\r\n", 2)) == NULL)
+            return n == sizeof(line) - 1 ? RELAY_ERROR : RELAY_AGAIN;
+        if (recv(c->fd, line, eol + 2 - line, 0) != eol + 2 - line) return RELAY_ERROR;
+        *eol = '\0';
+        switch (c->chunk_phase) {
+            case CH_SIZE:
+                c->chunk_left = strtol(line, NULL, 16);
+                if (c->chunk_left < 0) return RELAY_ERROR;
+                c->chunk_phase = c->chunk_left > 0 ? CH_DATA : CH_TRAILER;
+                break;
+            case CH_DATA_END:
+                if (eol != line) return RELAY_ERROR;
+                c->chunk_phase = CH_SIZE;
+                break;
+            case CH_TRAILER: /* trailers are dropped, the blank line ends the body */
+                if (eol == line) return RELAY_DONE;
+                break;
+            default:
+                return RELAY_ERROR;
+        }
+    }
+}
+
+/*
+ * read_resp_header - take the response header off the upstream socket into read_buf,
+ * leaving the body in the socket, and queue the rewritten header for the client
+ */
+static int read_resp_header(upstream_conn_t *c) {
+    transaction_t *trans = c->trans;
+    char *buf = trans->read_buf, *end, *line, *eol;
+    long head_len;
+    ssize_t n;
+    int major, minor, status;
+
+    while (true) {
+        n = recv(c->fd, buf, config.max_buf, MSG_PEEK);
+        if (n < 0) return errno == EAGAIN ? RELAY_AGAIN : RELAY_ERROR;
+        if (n == 0) return RELAY_EOF;
+        c->resp_started = true;
+        if ((end = memmem(buf, n, "\r\n\r\n", 4)) == NULL)
+            return n == config.max_buf ? RELAY_ERROR : RELAY_AGAIN;
+        head_len = end + 4 - buf;
+        if (recv(c->fd, buf, head_len, 0) != head_len) return RELAY_ERROR;
+        if (sscanf(buf, "HTTP/%d.%d %d", &major, &minor, &status) != 3) return RELAY_ERROR;
+        if (status >= 200) break;
+        /* interim response, e.g. 100 Continue: not forwarded */
+    }
+
+    trans->response_code = status;
+    c->reusable = major == 1 && minor >= 1;
+    c->chunked = false;
+    c->resp_remaining = -1;
+    for (line = memmem(buf, head_len, "\r\n", 2) + 2; line < buf + head_len - 2; line = eol + 2) {
+        eol = memmem(line, buf + head_len - line, "\r\n", 2);
+        *eol = '\0';
+        if (has_name(line, "Content-Length")) c->resp_remaining = strtol(line + 15, NULL, 10);
+        else if (has_name(line, "Transfer-Encoding")) c->chunked = strcasestr(line, "chunked") != NULL;
+        else if (has_name(line, "Connection") && strcasestr(line, "close") != NULL) c->reusable = false;
+        *eol = '\r';
+    }
+    if (status == 204 || status == 304 || strcasecmp(trans->req->method, "HEAD") == 0) {
+        c->chunked = false;
+        c->resp_remaining = 0;
+    } else if (c->chunked) {
+        c->resp_remaining = -1;
+        c->chunk_phase = CH_SIZE;
+    } else if (c->resp_remaining < 0) { /* delimited by the upstream closing */
+        c->reusable = false;
+    }
+
+    outq_init(&trans->outq);
+    outq_push_mem(&trans->outq, buf, strip_hop_headers(buf, head_len));
+    outq_push_str(&trans->outq, "Connection: close\r\n\r\n");
+    return RELAY_DONE;
+}
+
+static void proxy_run(int efd, upstream_conn_t *c) {
+    transaction_t *trans = c->trans;
+    struct sockaddr_storage peer;
+    socklen_t len;
+    long moved;
+    ssize_t n;
+    int rc, err;
+
+    switch (c->phase) {
+        case PX_CONNECT:
+            len = sizeof(err);
+            if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+            if (err != 0) {
+                posix_error(err, "proxy: connect");
+                proxy_fail(efd, c, E_BAD_GATEWAY);
+                return;
+            }
+            len = sizeof(peer);
+            if (getpeername(c->fd, (SA *) &peer, &len) < 0) return; /* still connecting */
+            c->phase = PX_SEND_REQ;
+            schedule_timer(&c->timer, response_timeout(c->upstream));
+            /* fall through */
+        case PX_SEND_REQ:
+            while (not outq_empty(&c->outq)) {
+                if (outq_flush(c->fd, &c->outq, LONG_MAX) < 0) {
+                    if (errno != EAGAIN) upstream_broken(efd, c);
+                    return;
+                }
+            }
+            c->phase = PX_SEND_BODY;
+            /* fall through */
+        case PX_SEND_BODY:
+            rc = splice_relay(c, trans->fd, c->fd, &c->req_remaining);
+            if (rc == RELAY_AGAIN) return;
+            if (rc != RELAY_DONE) {
+                proxy_fail(efd, c, E_BAD_GATEWAY);
+                return;
+            }
+            c->phase = PX_READ_HEADER;
+            /* fall through */
+        case PX_READ_HEADER:
+            rc = read_resp_header(c);
+            if (rc == RELAY_AGAIN) return;
+            if (rc != RELAY_DONE) {
+                upstream_broken(efd, c);
+                return;
+            }
+            schedule_timer(&c->timer, response_timeout(c->upstream));
+            c->phase = PX_SEND_HEADER;
+            /* fall through */
+        case PX_SEND_HEADER:
+            while (not outq_empty(&trans->outq)) {
+                if ((n = outq_flush(trans->fd, &trans->outq, LONG_MAX)) < 0) {
+                    if (errno != EAGAIN) finish_transaction(efd, trans);
+                    return;
+                }
+            }
+            c->phase = PX_RELAY;
+            /* fall through */
+        case PX_RELAY:
+            moved = c->moved;
+            if (c->chunked) rc = relay_chunked(c, trans->fd);
+            else rc = splice_relay(c, c->fd, trans->fd, &c->resp_remaining);
+            if (c->moved != moved) schedule_timer(&c->timer, response_timeout(c->upstream));
+            if (rc == RELAY_AGAIN) return;
+            if (rc == RELAY_EOF && not c->chunked && c->resp_remaining < 0) rc = RELAY_DONE;
+            if (rc != RELAY_DONE) {
+                app_error("proxy: response cut short");
+                c->reusable = false;
+            } else {
+                c->phase = PX_DONE;
+            }
+            cancel_timer(&c->timer);
+            finish_transaction(efd, trans);
+            return;
+        case PX_DONE:
+            return;
+    }
+}
+
+/*
+ * proxy_event - socket event on the client side of a proxied transaction
+ */
+void proxy_event(int efd, transaction_t *trans) {
+    if (trans->upstream) proxy_run(efd, trans->upstream);
+}
+
+/*
+ * proxy_handle_event - socket event on an upstream connection.
+ * Returns false if fd is not one.
+ */
+bool proxy_handle_event(int fd, int efd) {
+    upstream_conn_t *c;
+    char byte;
+
+    if (fd < 0 || fd >= conn_map_size || (c = conn_map[fd]) == NULL) return false;
+    if (c->trans == NULL) { /* idle: fine unless the upstream closed it or sent something unasked */
+        if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN) return true;
+        pool_remove(c);
+        close_conn(efd, c);
+        return true;
+    }
+    update_access(c->trans);
+    proxy_run(efd, c);
+    return true;
+}
+
+/*
+ * proxy_finish - detach the upstream from a finishing transaction, pooling it if it is clean
+ */
+void proxy_finish(int efd, transaction_t *trans) {
+    upstream_conn_t *c = trans->upstream;
+    if (c == NULL) return;
+    trans->upstream = NULL;
+    c->trans = NULL;
+    if (c->phase == PX_DONE && c->reusable && c->in_pipe == 0) pool_put(efd, c);
+    else close_conn(efd, c);
+}
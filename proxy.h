@@ -0,0 +1,95 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_PROXY_H
+#define NAIVE_HTTP_PROXY_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include "transaction.h"
+#include "outq.h"
+#include "timer.h"
+
+#define MAX_UPSTREAMS 32
+
+/* where a proxied exchange is */
+typedef enum {
+    PX_CONNECT, /* nonblocking connect in progress */
+    PX_SEND_REQ, /* request header and buffered body bytes to the upstream */
+    PX_SEND_BODY, /* rest of the request body, spliced from the client */
+    PX_READ_HEADER, /* waiting for the response header */
+    PX_SEND_HEADER, /* response header to the client */
+    PX_RELAY, /* response body, spliced to the client */
+    PX_DONE
+} proxy_phase_e;
+
+/* framing of a chunked response body, which is relayed unchunked */
+typedef enum {
+    CH_SIZE, CH_DATA, CH_DATA_END, CH_TRAILER
+} chunk_phase_e;
+
+struct _upstream_conn;
+
+/* a configured route: requests whose URI starts with prefix go to addr */
+typedef struct {
+    char prefix[MAXLINE];
+    size_t prefix_len;
+    char name[MAXLINE]; /* host:port, for logs */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int connect_timeout; /* ms, 0 uses config.proxy_connect_timeout */
+    int response_timeout; /* ms, 0 uses config.proxy_response_timeout */
+    struct _upstream_conn *idle; /* keep-alive pool */
+    int n_idle;
+} upstream_t;
+
+/*
+ * A connection to an upstream, with the pipe its bodies are spliced through.
+ * Both live on in the pool between requests.
+ */
+typedef struct _upstream_conn {
+    int fd;
+    int pipe[2];
+    long in_pipe; /* bytes spliced into the pipe, not yet out */
+    upstream_t *upstream;
+    transaction_t *trans; /* NULL while idle */
+    proxy_phase_e phase;
+    timer_entry_t timer; /* connect, response or idle timeout */
+    bool reused; /* came from the pool, may have been closed by the upstream */
+    outq_t outq; /* request header to the upstream */
+    /* request */
+    long req_head_len; /* rewritten header at the start of read_buf */
+    long req_body_off, req_body_len; /* body bytes read along with the header */
+    long req_remaining; /* body bytes still to come from the client */
+    bool replayable; /* the whole request is in read_buf, it can be sent again */
+    /* response */
+    bool resp_started;
+    long resp_remaining; /* -1 until the upstream closes */
+    bool chunked;
+    chunk_phase_e chunk_phase;
+    long chunk_left;
+    bool reusable;
+    long moved; /* bytes relayed, to tell progress from a stall */
+    struct _upstream_conn *next; /* pool link */
+} upstream_conn_t;
+
+int init_proxy();
+
+upstream_t *proxy_route(const char *uri);
+
+void proxy_start(int efd, transaction_t *trans, upstream_t *upstream);
+
+void proxy_event(int efd, transaction_t *trans);
+
+bool proxy_handle_event(int fd, int efd);
+
+void proxy_finish(int efd, transaction_t *trans);
+
+#endif //NAIVE_HTTP_PROXY_H
@@ -0,0 +1,169 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include "ratelimit.h"
+#include "timer.h"
+#include "config.h"
+#include "error_handler.h"
+
+/*
+ * Per-source-IP limiter.
+ * A fixed-size open-addressing table. Buckets refill lazily on access,
+ * and idle entries without connections decay away and get reused, so the table never grows.
+ */
+static rate_bucket_t *table;
+
+static void addr_key(struct sockaddr_storage *clientaddr, unsigned char *key);
+
+static unsigned int hash_key(unsigned char *key);
+
+static rate_bucket_t *lookup_bucket(unsigned char *key, long long now);
+
+static void refill(rate_bucket_t *bucket, long long now);
+
+void init_rate_limiter() {
+    table = calloc(config.rate_table_size, sizeof(rate_bucket_t));
+    if (table == NULL) {
+        unix_error("fatal: calloc");
+        exit(-1);
+    }
+}
+
+/*
+ * rate_admit - account a new connection from clientaddr.
+ * On RATE_OK *bucket is set (may be NULL if the table is saturated, which fails open)
+ * and must be given back with rate_release when the connection closes.
+ */
+int rate_admit(struct sockaddr_storage *clientaddr, rate_bucket_t **bucket) {
+    unsigned char key[16];
+    long long now = now_ms();
+    rate_bucket_t *b;
+
+    *bucket = NULL;
+    addr_key(clientaddr, key);
+    b = lookup_bucket(key, now);
+    if (b == NULL) return RATE_OK;
+
+    refill(b, now);
+    if (config.rate_max_conns > 0 && b->conns >= config.rate_max_conns) return RATE_TOO_MANY_CONNS;
+    if (config.rate_reqs_per_sec > 0) {
+        if (b->req_tokens < 1) return RATE_TOO_MANY_REQS;
+        b->req_tokens -= 1;
+    }
+    b->conns += 1;
+    *bucket = b;
+    return RATE_OK;
+}
+
+void rate_release(rate_bucket_t *bucket) {
+    if (bucket && bucket->conns > 0) bucket->conns -= 1;
+}
+
+/*
+ * rate_take_request - take a request token for another request on an admitted
+ * connection, false if the client is over config.rate_reqs_per_sec
+ */
+bool rate_take_request(rate_bucket_t *bucket) {
+    if (bucket == NULL || config.rate_reqs_per_sec <= 0) return true;
+    refill(bucket, now_ms());
+    if (bucket->req_tokens < 1) return false;
+    bucket->req_tokens -= 1;
+    return true;
+}
+
+/*
+ * rate_take_bytes - take up to want bytes from the byte bucket.
+ * Returns the granted amount. If nothing can be granted, *wait_ms is set
+ * to the time until the bucket holds enough tokens for a useful chunk.
+ */
+long rate_take_bytes(rate_bucket_t *bucket, long want, long *wait_ms) {
+    *wait_ms = 0;
+    if (bucket == NULL || config.rate_bytes_per_sec <= 0) return want;
+    refill(bucket, now_ms());
+    if (bucket->byte_tokens < 1) {
+        /* wait for at least a few packets worth of tokens, not a single byte */
+        double need = want < 16384 ? want : 16384;
+        *wait_ms = (long) ((need - bucket->byte_tokens) * 1000 / (double) config.rate_bytes_per_sec) + 1;
+        return 0;
+    }
+    long granted = want < (long) bucket->byte_tokens ? want : (long) bucket->byte_tokens;
+    bucket->byte_tokens -= granted;
+    return granted;
+}
+
+/*
+ * rate_return_bytes - give back tokens taken by rate_take_bytes but not transferred
+ */
+void rate_return_bytes(rate_bucket_t *bucket, long unused) {
+    if (bucket == NULL || config.rate_bytes_per_sec <= 0 || unused <= 0) return;
+    bucket->byte_tokens += unused;
+}
+
+static void addr_key(struct sockaddr_storage *clientaddr, unsigned char *key) {
+    memset(key, 0, 16);
+    if (clientaddr->ss_family == AF_INET6) {
+        memcpy(key, &((struct sockaddr_in6 *) clientaddr)->sin6_addr, 16);
+    } else if (clientaddr->ss_family == AF_INET) {
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((struct sockaddr_in *) clientaddr)->sin_addr, 4);
+    }
+}
+
+static unsigned int hash_key(unsigned char *key) { /* FNV-1a */
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < 16; i++) {
+        h ^= key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * lookup_bucket - find or claim the entry for key.
+ * Probes RATE_PROBE slots; a free or decayed slot is claimed, otherwise the
+ * least recently refilled slot without connections is evicted.
+ */
+static rate_bucket_t *lookup_bucket(unsigned char *key, long long now) {
+    unsigned int h = hash_key(key);
+    rate_bucket_t *b, *victim, *free_slot = NULL, *lru = NULL;
+    int i;
+    for (i = 0; i < RATE_PROBE; i++) {
+        b = &table[(h + i) & (config.rate_table_size - 1)];
+        if (b->used && memcmp(b->addr, key, 16) == 0) return b;
+        if (!b->used || (b->conns == 0 && now - b->last_refill > config.rate_decay * 1000L)) {
+            if (free_slot == NULL) free_slot = b;
+        } else if (b->conns == 0 && (lru == NULL || b->last_refill < lru->last_refill)) {
+            lru = b;
+        }
+    }
+    victim = free_slot ? free_slot : lru;
+    if (victim == NULL) return NULL;
+    victim->used = true;
+    memcpy(victim->addr, key, 16);
+    victim->conns = 0;
+    victim->req_tokens = config.rate_reqs_burst;
+    victim->byte_tokens = config.rate_bytes_burst;
+    victim->last_refill = now;
+    return victim;
+}
+
+static void refill(rate_bucket_t *bucket, long long now) {
+    double elapsed = (now - bucket->last_refill) / 1000.0;
+    if (elapsed <= 0) return;
+    bucket->req_tokens += elapsed * config.rate_reqs_per_sec;
+    if (bucket->req_tokens > config.rate_reqs_burst) bucket->req_tokens = config.rate_reqs_burst;
+    bucket->byte_tokens += elapsed * config.rate_bytes_per_sec;
+    if (bucket->byte_tokens > config.rate_bytes_burst) bucket->byte_tokens = config.rate_bytes_burst;
+    bucket->last_refill = now;
+}
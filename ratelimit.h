@@ -0,0 +1,49 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_RATELIMIT_H
+#define NAIVE_HTTP_RATELIMIT_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/* limits are the rate_* settings in config.h */
+#define RATE_PROBE 8 /* linear probe length before evicting */
+
+#define RATE_OK 0
+#define RATE_TOO_MANY_CONNS 1
+#define RATE_TOO_MANY_REQS 2
+
+/*
+ * Token buckets of one client address.
+ * An entry is pinned while it has open connections, so transactions may hold a pointer to it.
+ */
+typedef struct {
+    bool used;
+    unsigned char addr[16]; /* IPv4 addresses are stored v4-mapped */
+    int conns;
+    double req_tokens;
+    double byte_tokens;
+    long long last_refill; /* monotonic ms */
+} rate_bucket_t;
+
+void init_rate_limiter();
+
+int rate_admit(struct sockaddr_storage *clientaddr, rate_bucket_t **bucket);
+
+void rate_release(rate_bucket_t *bucket);
+
+bool rate_take_request(rate_bucket_t *bucket);
+
+long rate_take_bytes(rate_bucket_t *bucket, long want, long *wait_ms);
+
+void rate_return_bytes(rate_bucket_t *bucket, long unused);
+
+#endif //NAIVE_HTTP_RATELIMIT_H
@@ -15,8 +15,12 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #include <stdio.h>
 #include <sys/errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "socket_util.h"
 #include "error_handler.h"
+#include "config.h"
 
 /*
  * Helper functions to create sockets.
@@ -27,7 +31,7 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
  *       -1 with errno set for other errors.
  */
 
-int open_listenfd(char *port) {
+int open_listenfd(char *port, int backlog) {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval = 1;
 
@@ -72,7 +76,7 @@ int open_listenfd(char *port) {
         return -1;
 
     /* Make it a listening socket ready to accept connection requests */
-    if (listen(listenfd, LISTENQ) < 0) {
+    if (listen(listenfd, backlog) < 0) {
         close(listenfd);
         return -1;
     }
@@ -135,6 +139,46 @@ int open_clientfd(char *hostname, char *port) {
         return clientfd;
 }
 
+/*
+ * resolve_addr - resolve <hostname, port> once, e.g. an upstream at startup.
+ * Returns 0, or -2 for getaddrinfo error.
+ */
+int resolve_addr(char *hostname, char *port, struct sockaddr_storage *addr, socklen_t *addrlen) {
+    struct addrinfo hints, *listp;
+    int rc;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
+        return -2;
+    }
+    memcpy(addr, listp->ai_addr, listp->ai_addrlen);
+    *addrlen = listp->ai_addrlen;
+    freeaddrinfo(listp);
+    return 0;
+}
+
+/*
+ * open_clientfd_nb - nonblocking counterpart of open_clientfd for the event loop.
+ * The address is resolved beforehand, the connect is only started: wait for
+ * writability and check SO_ERROR before use.
+ * Returns the socket, or -1 with errno set.
+ */
+int open_clientfd_nb(const struct sockaddr *addr, socklen_t addrlen) {
+    int clientfd;
+
+    if ((clientfd = socket(addr->sa_family, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (set_nonblocking(clientfd) < 0 ||
+        (connect(clientfd, addr, addrlen) < 0 && errno != EINPROGRESS)) {
+        close(clientfd);
+        return -1;
+    }
+    return clientfd;
+}
+
 /*
  * set_nonblocking: set a fd into nonblocking mode
  * http://www.kegel.com/dkftpbench/nonblocking.html
@@ -145,3 +189,92 @@ int set_nonblocking(int fd) {
         flags = 0;
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
+
+/*
+ * Socket tuning from the configuration.
+ * Options that new connections inherit (defer accept, fast open, buffer sizes)
+ * are set on the listener; the rest on every accepted socket. Both are re-applied
+ * on reload, and the values the kernel actually took are read back and printed.
+ */
+static bool conn_opts_shown = false;
+/* per-connection option failures already reported, cleared on reload */
+static bool nodelay_failed, busy_poll_failed, notsent_lowat_failed;
+
+/* set one option, failures are reported unless *reported is already set */
+static int set_opt(int fd, int level, int opt, int val, const char *name, bool *reported) {
+    if (setsockopt(fd, level, opt, &val, sizeof(val)) < 0) {
+        if (reported == NULL || !*reported)
+            fprintf(stderr, "setsockopt %s=%d: %s\n", name, val, strerror(errno));
+        if (reported != NULL) *reported = true;
+        return -1;
+    }
+    return 0;
+}
+
+static int get_opt(int fd, int level, int opt) {
+    int val = 0;
+    socklen_t len = sizeof(val);
+    if (getsockopt(fd, level, opt, &val, &len) < 0) return -1;
+    return val;
+}
+
+/*
+ * tune_listenfd - apply listener options, returns -1 if any of them failed
+ */
+int tune_listenfd(int fd) {
+    int rc = 0;
+    FILE *fp;
+    int sysctl;
+
+    /* 0 turns these two off again on reload */
+    rc |= set_opt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, config.tcp_defer_accept, "TCP_DEFER_ACCEPT", NULL);
+    if (config.tcp_fastopen > 0 || get_opt(fd, IPPROTO_TCP, TCP_FASTOPEN) > 0)
+        rc |= set_opt(fd, IPPROTO_TCP, TCP_FASTOPEN, config.tcp_fastopen, "TCP_FASTOPEN", NULL);
+    /* buffers can't be reset to autotuning once set, 0 only leaves them alone */
+    if (config.so_rcvbuf > 0) rc |= set_opt(fd, SOL_SOCKET, SO_RCVBUF, config.so_rcvbuf, "SO_RCVBUF", NULL);
+    if (config.so_sndbuf > 0) rc |= set_opt(fd, SOL_SOCKET, SO_SNDBUF, config.so_sndbuf, "SO_SNDBUF", NULL);
+
+    if (config.tcp_fastopen > 0 && (fp = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r")) != NULL) {
+        if (fscanf(fp, "%i", &sysctl) == 1 && !(sysctl & 2))
+            fprintf(stderr, "TCP_FASTOPEN: net.ipv4.tcp_fastopen=%d has no server bit (2), SYN data is ignored\n", sysctl);
+        fclose(fp);
+    }
+    conn_opts_shown = false;
+    nodelay_failed = busy_poll_failed = notsent_lowat_failed = false;
+    print_sockopts(fd, "listener");
+    return rc;
+}
+
+/*
+ * tune_connfd - apply per-connection options to an accepted socket.
+ * Failures are reported once, they would repeat for every connection.
+ */
+int tune_connfd(int fd) {
+    int rc = 0;
+    if (config.tcp_nodelay) rc |= set_opt(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY", &nodelay_failed);
+    if (config.so_busy_poll > 0)
+        rc |= set_opt(fd, SOL_SOCKET, SO_BUSY_POLL, config.so_busy_poll, "SO_BUSY_POLL", &busy_poll_failed);
+    if (config.tcp_notsent_lowat > 0)
+        rc |= set_opt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, config.tcp_notsent_lowat, "TCP_NOTSENT_LOWAT",
+                      &notsent_lowat_failed);
+    if (!conn_opts_shown) {
+        conn_opts_shown = true;
+        print_sockopts(fd, "first connection");
+    }
+    return rc;
+}
+
+/*
+ * print_sockopts - print the tunables as the kernel sees them, -1 is unsupported
+ */
+void print_sockopts(int fd, const char *what) {
+    printf("%s socket options: defer_accept=%d fastopen=%d nodelay=%d rcvbuf=%d sndbuf=%d busy_poll=%d notsent_lowat=%d\n",
+           what,
+           get_opt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT),
+           get_opt(fd, IPPROTO_TCP, TCP_FASTOPEN),
+           get_opt(fd, IPPROTO_TCP, TCP_NODELAY),
+           get_opt(fd, SOL_SOCKET, SO_RCVBUF),
+           get_opt(fd, SOL_SOCKET, SO_SNDBUF),
+           get_opt(fd, SOL_SOCKET, SO_BUSY_POLL),
+           get_opt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT));
+}
@@ -12,12 +12,22 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #ifndef NAIVE_HTTP_SOCKET_UTIL_H
 #define NAIVE_HTTP_SOCKET_UTIL_H
 
-#define LISTENQ  1024 /* backlog, constant as in CS:APP3e */
+#include <sys/socket.h>
 
 int open_clientfd(char *hostname, char *port);
 
-int open_listenfd(char *port);
+int open_listenfd(char *port, int backlog);
+
+int resolve_addr(char *hostname, char *port, struct sockaddr_storage *addr, socklen_t *addrlen);
+
+int open_clientfd_nb(const struct sockaddr *addr, socklen_t addrlen);
 
 int set_nonblocking(int fd);
 
+int tune_listenfd(int fd);
+
+int tune_connfd(int fd);
+
+void print_sockopts(int fd, const char *what);
+
 #endif //NAIVE_HTTP_SOCKET_UTIL_H
@@ -0,0 +1,86 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <unistd.h>
+#include "stream.h"
+#include "config.h"
+
+/*
+ * Large-file streaming.
+ * Keeps the page cache one window ahead of write_pos with readahead and, for
+ * one-shot files, drops the pages behind it so big transfers do not evict
+ * the hot small files. The hints are issued by the disk workers, on a dup of
+ * the file descriptor so a concurrent close cannot retarget them.
+ */
+
+static void submit_readahead(transaction_t *trans, long ra_len, long drop_len);
+
+static bool should_evict(transaction_t *trans);
+
+/*
+ * stream_start - enable streaming for a freshly opened download if it is large enough
+ */
+void stream_start(transaction_t *trans) {
+    trans->streaming = trans->filesize >= config.stream_min_size;
+    trans->ra_pos = 0;
+    trans->drop_pos = 0;
+    if (trans->streaming) submit_readahead(trans, MIN(config.stream_window, trans->filesize), 0);
+}
+
+/*
+ * stream_advance - slide the window after write_pos moved
+ */
+void stream_advance(transaction_t *trans) {
+    long ra_len = 0, drop_len = 0;
+    if (!trans->streaming) return;
+    /* refill once the cursor crossed the middle of the window */
+    if (trans->ra_pos < trans->filesize && trans->write_pos + config.stream_window / 2 >= trans->ra_pos) {
+        ra_len = MIN(config.stream_window, trans->filesize - trans->ra_pos);
+    }
+    /*
+     * Drop whole windows, one window behind the cursor: pages just handed
+     * to sendfile are still referenced by the socket and would not be dropped.
+     */
+    if (should_evict(trans) && trans->write_pos - trans->drop_pos >= 2 * config.stream_window) {
+        drop_len = (trans->write_pos - trans->drop_pos - config.stream_window) / config.stream_window * config.stream_window;
+    }
+    if (ra_len > 0 || drop_len > 0) submit_readahead(trans, ra_len, drop_len);
+}
+
+/*
+ * stream_finish - drop what is left of a one-shot file when the transfer ends
+ */
+void stream_finish(transaction_t *trans) {
+    if (!trans->streaming || !should_evict(trans) || trans->drop_pos >= trans->filesize) return;
+    submit_readahead(trans, 0, trans->filesize - trans->drop_pos);
+    trans->streaming = false;
+}
+
+static bool should_evict(transaction_t *trans) {
+    switch (config.stream_evict) {
+        case EVICT_LARGE:
+            return trans->filesize >= config.stream_evict_min_size;
+        case EVICT_STREAMED:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void submit_readahead(transaction_t *trans, long ra_len, long drop_len) {
+    int fd = dup(trans->read_fd);
+    if (fd < 0) {
+        unix_error("dup for readahead");
+        return;
+    }
+    submit_disk_advice(fd, trans->ra_pos, ra_len, trans->drop_pos, drop_len);
+    trans->ra_pos += ra_len;
+    trans->drop_pos += drop_len;
+}
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Upload many small files under each durability policy and compare ingest rates.
+# usage: test/durability_bench.sh <naive_http binary> [port]
+# WORK must be on the disk under test: on tmpfs every sync is a no-op.
+BIN=$1
+PORT=${2:-18080}
+DIR=$(dirname "$0")
+BENCH=${BENCH:-/tmp/loopback_bench}
+WORK=${WORK:-/var/tmp/durability_bench}
+THREADS=${THREADS:-16}
+REQUESTS=${REQUESTS:-200}
+SIZE=${SIZE:-4096}
+
+cc -O2 -pthread -o "$BENCH" "$DIR/loopback_bench.c" || exit 1
+
+run() {
+    name=$1
+    shift
+    rm -rf "$WORK"
+    mkdir -p "$WORK/root"
+    "$BIN" --root="$WORK/root" --rate-reqs-per-sec=0 --rate-max-conns=0 "$@" "$PORT" > /tmp/durability_bench.log 2>&1 &
+    pid=$!
+    sleep 0.3
+    printf '%-22s ' "$name"
+    "$BENCH" -t "$THREADS" -n "$REQUESTS" -P "$SIZE" 127.0.0.1 "$PORT" "/up-%d"
+    kill $pid
+    wait $pid 2>/dev/null
+}
+
+run none --upload-durability=none
+run fsync --upload-durability=fsync
+run "group 0ms" --upload-durability=group --upload-sync-window=0
+run "group 2ms" --upload-durability=group
+run "objstore none" --upload-durability=none --objstore-dir="$WORK/store"
+run "objstore fsync" --upload-durability=fsync --objstore-dir="$WORK/store"
+run "objstore group 2ms" --upload-durability=group --objstore-dir="$WORK/store"
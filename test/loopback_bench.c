@@ -0,0 +1,170 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * Loopback load generator for the socket tunables.
+ * Threads open a connection per request (the server closes after each response),
+ * send a GET and read until EOF, recording connect-to-EOF latency.
+ *
+ *   cc -O2 -pthread -o loopback_bench test/loopback_bench.c
+ *   ./loopback_bench [-t threads] [-n requests per thread] [-F] [-d ms] [-P bytes] 127.0.0.1 8080 /a.txt
+ *
+ * -F sends the request in the SYN with TCP fast open, -d waits before sending it
+ * (which shows TCP_DEFER_ACCEPT holding the accept back). See test/sockopt_bench.sh.
+ * -P uploads a body of that many bytes instead, to the path with a %d in it
+ * replaced by a request number. The server may close without a response. See test/objstore_bench.sh.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+static int n_threads = 8, n_requests = 1000, fastopen = 0, delay_ms = 0;
+static long post_size = 0;
+static struct sockaddr_in addr;
+static char request[1024];
+static size_t request_len;
+static const char *post_path;
+static char *post_body;
+static long posted; /* numbers uploads */
+static double *latencies;
+static long total_bytes, failures;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* a POST request with its body, in buf */
+static size_t post_request(char *buf, size_t size) {
+    char path[1024];
+    size_t len;
+    snprintf(path, sizeof(path), post_path, (int) __atomic_fetch_add(&posted, 1, __ATOMIC_RELAXED));
+    len = snprintf(buf, size, "POST %s HTTP/1.1\r\nHost: bench\r\nContent-Length: %ld\r\n\r\n", path, post_size);
+    memcpy(buf + len, post_body, post_size);
+    return len + post_size;
+}
+
+static long one_request() {
+    char buf[65536];
+    long got = 0;
+    ssize_t n;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (post_size > 0) {
+        size_t len = post_request(buf, sizeof(buf));
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) goto fail;
+        if (write(fd, buf, len) != (ssize_t) len) goto fail;
+    } else if (fastopen) {
+        /* connect and send in one go, falls back to a normal handshake without a cookie */
+        if (sendto(fd, request, request_len, MSG_FASTOPEN, (struct sockaddr *) &addr, sizeof(addr)) < 0) goto fail;
+    } else {
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) goto fail;
+        if (delay_ms) usleep(delay_ms * 1000);
+        if (write(fd, request, request_len) != (ssize_t) request_len) goto fail;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) got += n;
+    if (n < 0) goto fail;
+    close(fd);
+    return post_size > 0 ? got + 1 : got; /* an upload may end without a response */
+fail:
+    close(fd);
+    return -1;
+}
+
+static void *worker(void *arg) {
+    double *lat = arg, start;
+    long bytes = 0, failed = 0, got;
+    int i;
+    for (i = 0; i < n_requests; i++) {
+        start = now_us();
+        got = one_request();
+        lat[i] = now_us() - start;
+        if (got <= 0) failed++;
+        else bytes += got;
+    }
+    pthread_mutex_lock(&lock);
+    total_bytes += bytes;
+    failures += failed;
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    int opt, i;
+    long total;
+    double start, elapsed;
+    pthread_t *tids;
+
+    while ((opt = getopt(argc, argv, "t:n:Fd:P:")) != -1) {
+        switch (opt) {
+            case 't': n_threads = atoi(optarg); break;
+            case 'n': n_requests = atoi(optarg); break;
+            case 'F': fastopen = 1; break;
+            case 'd': delay_ms = atoi(optarg); break;
+            case 'P': post_size = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-t threads] [-n requests] [-F] [-d ms] [-P bytes] host port path\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 3) {
+        fprintf(stderr, "usage: %s [-t threads] [-n requests] [-F] [-d ms] [-P bytes] host port path\n", argv[0]);
+        return 1;
+    }
+    if (post_size > 32768) {
+        fprintf(stderr, "-P: at most 32768 bytes\n");
+        return 1;
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, argv[optind], &addr.sin_addr) != 1) {
+        fprintf(stderr, "bad address %s\n", argv[optind]);
+        return 1;
+    }
+    request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                           argv[optind + 2], argv[optind]);
+    post_path = argv[optind + 2];
+    if (post_size > 0) {
+        post_body = malloc(post_size);
+        memset(post_body, 'x', post_size);
+    }
+
+    total = (long) n_threads * n_requests;
+    latencies = malloc(sizeof(double) * total);
+    tids = malloc(sizeof(pthread_t) * n_threads);
+    start = now_us();
+    for (i = 0; i < n_threads; i++)
+        pthread_create(&tids[i], NULL, worker, latencies + (long) i * n_requests);
+    for (i = 0; i < n_threads; i++)
+        pthread_join(tids[i], NULL);
+    elapsed = (now_us() - start) / 1e6;
+
+    qsort(latencies, total, sizeof(double), cmp_double);
+    printf("requests %ld failed %ld  %.0f req/s  %.1f MB/s  latency us p50 %.0f p99 %.0f max %.0f\n",
+           total, failures, total / elapsed, total_bytes / elapsed / 1e6,
+           latencies[total / 2], latencies[total * 99 / 100], latencies[total - 1]);
+    return failures != 0;
+}
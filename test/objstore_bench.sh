@@ -0,0 +1,38 @@
+#!/bin/sh
+# Upload many small objects as files, then into the object store, and compare.
+# usage: test/objstore_bench.sh <naive_http binary> [port]
+# Each run starts from empty directories and reports upload throughput,
+# GET throughput over what was uploaded, and the space the uploads take.
+BIN=$1
+PORT=${2:-18080}
+DIR=$(dirname "$0")
+BENCH=${BENCH:-/tmp/loopback_bench}
+WORK=${WORK:-/tmp/objstore_bench}
+THREADS=${THREADS:-8}
+REQUESTS=${REQUESTS:-2000}
+
+cc -O2 -pthread -o "$BENCH" "$DIR/loopback_bench.c" || exit 1
+
+run() {
+    name=$1
+    size=$2
+    shift 2
+    rm -rf "$WORK"
+    mkdir -p "$WORK/root"
+    "$BIN" --root="$WORK/root" --rate-reqs-per-sec=0 --rate-max-conns=0 "$@" "$PORT" > /tmp/objstore_bench.log 2>&1 &
+    pid=$!
+    sleep 0.3
+    printf '%-10s %6s POST ' "$name" "$size"
+    "$BENCH" -t "$THREADS" -n "$REQUESTS" -P "$size" 127.0.0.1 "$PORT" "/obj-%d"
+    printf '%-10s %6s GET  ' "$name" "$size"
+    "$BENCH" -t "$THREADS" -n "$REQUESTS" 127.0.0.1 "$PORT" "/obj-1"
+    kill $pid
+    wait $pid 2>/dev/null
+    printf '%-10s %6s disk %s KiB in %s files\n' "$name" "$size" "$(du -sk "$WORK" | cut -f1)" \
+        "$(find "$WORK" -type f | wc -l)"
+}
+
+for size in 128 1024 4096; do
+    run files $size
+    run objstore $size --objstore-dir="$WORK/store"
+done
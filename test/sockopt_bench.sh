@@ -0,0 +1,34 @@
+#!/bin/sh
+# Run the loopback benchmark against the server once per socket option.
+# usage: test/sockopt_bench.sh <naive_http binary> <served dir> <path> [port]
+# The server prints the options the kernel applied ("listener socket options: ...").
+BIN=$1
+ROOT=$2
+FILE=$3
+PORT=${4:-18080}
+DIR=$(dirname "$0")
+BENCH=${BENCH:-/tmp/loopback_bench}
+
+cc -O2 -pthread -o "$BENCH" "$DIR/loopback_bench.c" || exit 1
+
+run() {
+    name=$1
+    shift
+    "$BIN" --root="$ROOT" --rate-reqs-per-sec=0 --rate-max-conns=0 "$@" "$PORT" > /tmp/sockopt_bench.log 2>&1 &
+    pid=$!
+    sleep 0.3
+    printf '%-28s ' "$name"
+    "$BENCH" $BENCH_ARGS 127.0.0.1 "$PORT" "$FILE"
+    kill $pid
+    wait $pid 2>/dev/null
+    grep "socket options" /tmp/sockopt_bench.log | sed 's/^/    /'
+}
+
+run baseline --tcp-nodelay=0
+run tcp_nodelay --tcp-nodelay=1
+run tcp_defer_accept --tcp-defer-accept=5
+run tcp_fastopen --tcp-fastopen=256
+run "so_rcvbuf/sndbuf 64K" --so-rcvbuf=64K --so-sndbuf=64K
+run "so_sndbuf 4M" --so-sndbuf=4M
+run so_busy_poll --so-busy-poll=50
+run "tcp_notsent_lowat 16K" --tcp-notsent-lowat=16K
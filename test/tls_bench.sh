@@ -0,0 +1,48 @@
+#!/bin/sh
+# Loopback download throughput and server CPU of plaintext, kernel TLS and userspace TLS.
+# usage: test/tls_bench.sh <naive_http binary> [size in MB] [runs] [port]
+# Kernel TLS needs CONFIG_TLS (modprobe tls); without it that run falls back to userspace.
+BIN=$1
+SIZE=${2:-256}
+RUNS=${3:-5}
+PORT=${4:-18443}
+WORK=${WORK:-/tmp/tls_bench}
+
+mkdir -p "$WORK/root"
+[ -f "$WORK/root/blob" ] || head -c $((SIZE * 1048576)) /dev/urandom > "$WORK/root/blob"
+[ -f "$WORK/cert.pem" ] || openssl req -x509 -newkey rsa:2048 -nodes -keyout "$WORK/key.pem" \
+    -out "$WORK/cert.pem" -days 30 -subj /CN=localhost 2>/dev/null
+cat "$WORK/root/blob" > /dev/null # warm the page cache
+
+# server CPU seconds, utime + stime
+cpu() {
+    awk -v hz="$(getconf CLK_TCK)" '{ printf "%.2f", ($14 + $15) / hz }' "/proc/$1/stat"
+}
+
+run() {
+    name=$1
+    scheme=$2
+    shift 2
+    "$BIN" --root="$WORK/root" --rate-reqs-per-sec=0 "$@" "$PORT" > "$WORK/server.log" 2>&1 &
+    pid=$!
+    sleep 0.3
+    start=$(date +%s.%N)
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        curl -sk -o /dev/null "$scheme://127.0.0.1:$PORT/blob" || echo "$name: download failed"
+        i=$((i + 1))
+    done
+    end=$(date +%s.%N)
+    used=$(cpu $pid)
+    kill $pid
+    wait $pid 2>/dev/null
+    awk -v n="$name" -v mb=$((SIZE * RUNS)) -v t0="$start" -v t1="$end" -v c="$used" \
+        'BEGIN { printf "%-12s %8.0f MB/s  server cpu %6.2fs  %6.2f ms/MB\n", n, mb / (t1 - t0), c, c * 1000 / mb }'
+    if grep -q "kernel TLS unavailable" "$WORK/server.log"; then
+        echo "             (kernel TLS unavailable, ran in userspace)"
+    fi
+}
+
+run plaintext http
+run ktls https --tls-cert="$WORK/cert.pem" --tls-key="$WORK/key.pem" --tls-ktls=1
+run userspace https --tls-cert="$WORK/cert.pem" --tls-key="$WORK/key.pem" --tls-ktls=0
@@ -0,0 +1,176 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "timer.h"
+#include "error_handler.h"
+#include "misc.h"
+
+/*
+ * Binary min-heap of timer entries keyed by deadline.
+ * The timerfd is always armed for the earliest deadline.
+ */
+static timer_entry_t **heap = NULL;
+static int heap_len = 0;
+static int heap_cap = 0;
+static int timerfd = INVALID_FD;
+
+static void heap_swap(int i, int j);
+
+static void sift_up(int i);
+
+static void sift_down(int i);
+
+static void rearm();
+
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * init_timers - create the timerfd and register it to epoll.
+ * Returns the timerfd, or ERROR.
+ */
+int init_timers(int efd) {
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd < 0) {
+        unix_error("timerfd_create");
+        return ERROR;
+    }
+    epoll_event_t event;
+    event.data.fd = timerfd;
+    event.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, timerfd, &event) < 0) {
+        unix_error("epoll add timerfd");
+        close(timerfd);
+        timerfd = INVALID_FD;
+        return ERROR;
+    }
+    return timerfd;
+}
+
+void init_timer_entry(timer_entry_t *t, timer_cb_t cb, void *arg) {
+    t->deadline = 0;
+    t->cb = cb;
+    t->arg = arg;
+    t->heap_idx = -1;
+}
+
+bool timer_pending(timer_entry_t *t) {
+    return t->heap_idx >= 0;
+}
+
+/*
+ * schedule_timer - fire t after ms milliseconds. Reschedules if already pending.
+ */
+void schedule_timer(timer_entry_t *t, long ms) {
+    if (timer_pending(t)) cancel_timer(t);
+    if (heap_len == heap_cap) {
+        int new_cap = heap_cap ? heap_cap * 2 : 64;
+        timer_entry_t **new_heap = realloc(heap, sizeof(timer_entry_t *) * new_cap);
+        if (!new_heap) {
+            unix_error("fatal: realloc");
+            exit(-1);
+        }
+        heap = new_heap;
+        heap_cap = new_cap;
+    }
+    t->deadline = now_ms() + ms;
+    t->heap_idx = heap_len;
+    heap[heap_len++] = t;
+    sift_up(t->heap_idx);
+    if (heap[0] == t) rearm();
+}
+
+void cancel_timer(timer_entry_t *t) {
+    if (!timer_pending(t)) return;
+    int i = t->heap_idx;
+    bool was_first = (i == 0);
+    heap_len--;
+    if (i != heap_len) {
+        timer_entry_t *moved = heap[heap_len];
+        heap_swap(i, heap_len);
+        sift_up(i);
+        sift_down(moved->heap_idx);
+    }
+    t->heap_idx = -1;
+    if (was_first) rearm();
+}
+
+/*
+ * handle_timer_event - run every expired timer.
+ * Callbacks may schedule or cancel timers freely.
+ */
+void handle_timer_event(int efd) {
+    uint64_t expirations;
+    if (read(timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        unix_error("read timerfd");
+    }
+    long long now = now_ms();
+    while (heap_len > 0 && heap[0]->deadline <= now) {
+        timer_entry_t *t = heap[0];
+        cancel_timer(t);
+        t->cb(efd, t->arg);
+    }
+    rearm();
+}
+
+static void rearm() {
+    struct itimerspec its = {{0, 0}, {0, 0}}; /* all zero disarms */
+    if (heap_len > 0) {
+        long long delta = heap[0]->deadline - now_ms();
+        if (delta < 1) delta = 1;
+        its.it_value.tv_sec = delta / 1000;
+        its.it_value.tv_nsec = (delta % 1000) * 1000000;
+    }
+    if (timerfd >= 0 && timerfd_settime(timerfd, 0, &its, NULL) < 0) {
+        unix_error("timerfd_settime");
+    }
+}
+
+static void heap_swap(int i, int j) {
+    timer_entry_t *tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+    heap[i]->heap_idx = i;
+    heap[j]->heap_idx = j;
+}
+
+static void sift_up(int i) {
+    while (i > 0 && heap[(i - 1) / 2]->deadline > heap[i]->deadline) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sift_down(int i) {
+    int smallest;
+    while (true) {
+        smallest = i;
+        if (2 * i + 1 < heap_len && heap[2 * i + 1]->deadline < heap[smallest]->deadline) smallest = 2 * i + 1;
+        if (2 * i + 2 < heap_len && heap[2 * i + 2]->deadline < heap[smallest]->deadline) smallest = 2 * i + 2;
+        if (smallest == i) return;
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
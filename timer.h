@@ -0,0 +1,45 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_TIMER_H
+#define NAIVE_HTTP_TIMER_H
+
+#include <stdbool.h>
+
+/*
+ * One-shot timers multiplexed on a single timerfd.
+ * Entries are embedded in their owner (e.g. a transaction), so scheduling never allocates.
+ */
+typedef void (*timer_cb_t)(int efd, void *arg);
+
+typedef struct {
+    long long deadline; /* monotonic, in milliseconds */
+    timer_cb_t cb;
+    void *arg;
+    int heap_idx; /* position in the heap, -1 if not scheduled */
+} timer_entry_t;
+
+int init_timers(int efd);
+
+void init_timer_entry(timer_entry_t *t, timer_cb_t cb, void *arg);
+
+void schedule_timer(timer_entry_t *t, long ms);
+
+void cancel_timer(timer_entry_t *t);
+
+bool timer_pending(timer_entry_t *t);
+
+void handle_timer_event(int efd);
+
+long long now_ms();
+
+long long now_us();
+
+#endif //NAIVE_HTTP_TIMER_H
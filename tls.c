@@ -0,0 +1,405 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <iso646.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/kdf.h>
+#include <openssl/evp.h>
+#include "tls.h"
+#include "error_handler.h"
+#include "config.h"
+#include "probes.h"
+
+/*
+ * TLS termination.
+ * The handshake runs in OpenSSL on the nonblocking socket. For TLS 1.3 the
+ * application traffic secrets are captured through the keylog callback, expanded
+ * into record keys and pushed to the kernel with setsockopt(SOL_TLS), after which
+ * the session is dropped and the connection is served like a plaintext one:
+ * read, sendmsg, sendfile and splice all go through kernel TLS.
+ * When the kernel has no TLS support, or the session cannot be offloaded
+ * (TLS 1.2, data already buffered in OpenSSL), it stays in userspace: reads go
+ * through SSL_read and files are copied through a bounce buffer into SSL_write.
+ */
+typedef struct _tls_conn {
+    SSL *ssl;
+    unsigned char rx_secret[EVP_MAX_MD_SIZE]; /* client application traffic secret */
+    unsigned char tx_secret[EVP_MAX_MD_SIZE]; /* server application traffic secret */
+    size_t rx_len, tx_len;
+    long retry_len; /* length of an SSL_write to be retried, OpenSSL wants it repeated */
+} tls_conn_t;
+
+/* outcome of offloading a session to the kernel */
+enum {
+    KTLS_OK, KTLS_FALLBACK, KTLS_FAILED
+};
+
+static SSL_CTX *ctx = NULL;
+static bool ktls_missing = false; /* the kernel refused the tls ULP once, don't retry */
+
+/* defined in http.c */
+void queue_transmission(transaction_t *trans);
+
+void finish_transaction(int efd, transaction_t *trans);
+
+static void keylog_cb(const SSL *ssl, const char *line);
+
+static ssize_t ssl_flush(transaction_t *trans, long budget);
+
+/*
+ * init_tls - load the certificate, if TLS is configured
+ */
+int init_tls() {
+    if (not tls_enabled()) return OKAY;
+    if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+        ERR_print_errors_fp(stderr);
+        return ERROR;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    /* session tickets would be sent under the traffic keys before they are offloaded */
+    SSL_CTX_set_num_tickets(ctx, 0);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_keylog_callback(ctx, keylog_cb);
+    if (SSL_CTX_use_certificate_chain_file(ctx, config.tls_cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, config.tls_key[0] ? config.tls_key : config.tls_cert, SSL_FILETYPE_PEM) != 1) {
+        ERR_print_errors_fp(stderr);
+        return ERROR;
+    }
+    printf("TLS enabled with %s, kernel TLS %s\n", config.tls_cert, config.tls_ktls ? "preferred" : "off");
+    return OKAY;
+}
+
+bool tls_enabled() {
+    return config.tls_cert[0] != '\0';
+}
+
+/* the traffic secrets of TLS 1.3, as "LABEL <client random> <secret>" */
+static void keylog_cb(const SSL *ssl, const char *line) {
+    tls_conn_t *t = SSL_get_app_data(ssl);
+    const char *hex;
+    unsigned char *secret;
+    size_t *len;
+    unsigned int byte;
+
+    if (strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24) == 0) {
+        secret = t->rx_secret;
+        len = &t->rx_len;
+    } else if (strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24) == 0) {
+        secret = t->tx_secret;
+        len = &t->tx_len;
+    } else {
+        return;
+    }
+    if ((hex = strchr(line + 24, ' ')) == NULL) return;
+    for (hex++, *len = 0; *len < EVP_MAX_MD_SIZE && sscanf(hex, "%2x", &byte) == 1; hex += 2)
+        secret[(*len)++] = byte;
+}
+
+/* HKDF-Expand-Label of RFC 8446 with an empty context */
+static int expand_label(const EVP_MD *md, const unsigned char *secret, size_t secret_len,
+                        const char *label, unsigned char *out, size_t out_len) {
+    unsigned char info[64];
+    size_t n = 0, label_len = strlen(label);
+    EVP_PKEY_CTX *pctx;
+    int ok;
+
+    info[n++] = out_len >> 8;
+    info[n++] = out_len & 0xff;
+    info[n++] = 6 + label_len;
+    memcpy(info + n, "tls13 ", 6);
+    n += 6;
+    memcpy(info + n, label, label_len);
+    n += label_len;
+    info[n++] = 0;
+
+    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    ok = pctx != NULL &&
+         EVP_PKEY_derive_init(pctx) > 0 &&
+         EVP_PKEY_CTX_set_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+         EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+         EVP_PKEY_CTX_set1_hkdf_key(pctx, secret, secret_len) > 0 &&
+         EVP_PKEY_CTX_add1_hkdf_info(pctx, info, n) > 0 &&
+         EVP_PKEY_derive(pctx, out, &out_len) > 0;
+    EVP_PKEY_CTX_free(pctx);
+    return ok ? OKAY : ERROR;
+}
+
+/*
+ * set_crypto - install the record keys of one direction, sequence number 0
+ */
+static int set_crypto(int fd, int dir, int cipher, const EVP_MD *md, const unsigned char *secret, size_t secret_len) {
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes128;
+        struct tls12_crypto_info_aes_gcm_256 aes256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+    } info;
+    unsigned char key[32], iv[12];
+    size_t key_len = cipher == 0x1301 ? 16 : 32;
+    socklen_t len;
+    int rc;
+
+    if (expand_label(md, secret, secret_len, "key", key, key_len) == ERROR ||
+        expand_label(md, secret, secret_len, "iv", iv, sizeof(iv)) == ERROR)
+        return ERROR;
+    memset(&info, 0, sizeof(info));
+    switch (cipher) {
+        case 0x1301: /* TLS_AES_128_GCM_SHA256 */
+            info.aes128.info.version = TLS_1_3_VERSION;
+            info.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+            memcpy(info.aes128.key, key, 16);
+            memcpy(info.aes128.salt, iv, 4);
+            memcpy(info.aes128.iv, iv + 4, 8);
+            len = sizeof(info.aes128);
+            break;
+        case 0x1302: /* TLS_AES_256_GCM_SHA384 */
+            info.aes256.info.version = TLS_1_3_VERSION;
+            info.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+            memcpy(info.aes256.key, key, 32);
+            memcpy(info.aes256.salt, iv, 4);
+            memcpy(info.aes256.iv, iv + 4, 8);
+            len = sizeof(info.aes256);
+            break;
+        case 0x1303: /* TLS_CHACHA20_POLY1305_SHA256 */
+            info.chacha.info.version = TLS_1_3_VERSION;
+            info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+            memcpy(info.chacha.key, key, 32);
+            memcpy(info.chacha.iv, iv, 12);
+            len = sizeof(info.chacha);
+            break;
+        default:
+            return ERROR;
+    }
+    rc = setsockopt(fd, SOL_TLS, dir, &info, len);
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(&info, sizeof(info));
+    return rc < 0 ? ERROR : OKAY;
+}
+
+/*
+ * offload - hand the established session to kernel TLS
+ */
+static int offload(transaction_t *trans) {
+    tls_conn_t *t = trans->tls;
+    const SSL_CIPHER *cipher = SSL_get_current_cipher(t->ssl);
+    const EVP_MD *md = SSL_CIPHER_get_handshake_digest(cipher);
+    int id = SSL_CIPHER_get_protocol_id(cipher);
+
+    if (ktls_missing || SSL_version(t->ssl) != TLS1_3_VERSION || t->rx_len == 0 || t->tx_len == 0 ||
+        SSL_has_pending(t->ssl) || md == NULL)
+        return KTLS_FALLBACK;
+    if (setsockopt(trans->fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+        unix_error("kernel TLS unavailable, serving TLS in userspace");
+        ktls_missing = true;
+        return KTLS_FALLBACK;
+    }
+    /* past this point the socket is committed to kernel TLS */
+    if (set_crypto(trans->fd, TLS_TX, id, md, t->tx_secret, t->tx_len) == ERROR ||
+        set_crypto(trans->fd, TLS_RX, id, md, t->rx_secret, t->rx_len) == ERROR) {
+        unix_error("kernel TLS keys");
+        return KTLS_FAILED;
+    }
+    return KTLS_OK;
+}
+
+static void free_tls(transaction_t *trans) {
+    tls_conn_t *t = trans->tls;
+    SSL_free(t->ssl);
+    OPENSSL_cleanse(t, sizeof(tls_conn_t));
+    free(t);
+    trans->tls = NULL;
+}
+
+/*
+ * tls_accept - start the handshake on a new connection
+ */
+void tls_accept(int efd, transaction_t *trans) {
+    tls_conn_t *t;
+    epoll_event_t event;
+
+    if ((t = calloc(1, sizeof(tls_conn_t))) == NULL || (t->ssl = SSL_new(ctx)) == NULL) {
+        app_error("fatal: TLS session");
+        exit(-1);
+    }
+    SSL_set_fd(t->ssl, trans->fd);
+    SSL_set_app_data(t->ssl, t);
+    SSL_set_accept_state(t->ssl);
+    trans->tls = t;
+    trans->state = S_TLS_HANDSHAKE;
+
+    event.data.fd = trans->fd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
+        unix_error("epoll ctl");
+    }
+    tls_handshake(efd, trans);
+}
+
+/*
+ * tls_handshake - continue the handshake, then read the request over kernel or userspace TLS
+ */
+void tls_handshake(int efd, transaction_t *trans) {
+    tls_conn_t *t = trans->tls;
+    epoll_event_t event;
+    int rc, err;
+    bool kernel;
+
+    ERR_clear_error();
+    if ((rc = SSL_do_handshake(t->ssl)) != 1) {
+        err = SSL_get_error(t->ssl, rc);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return;
+        app_error("TLS handshake failed");
+        ERR_print_errors_fp(stderr);
+        finish_transaction(efd, trans);
+        return;
+    }
+
+    rc = config.tls_ktls ? offload(trans) : KTLS_FALLBACK;
+    printf("TLS %s %s, %s\n", SSL_get_version(t->ssl), SSL_get_cipher_name(t->ssl),
+           rc == KTLS_OK ? "kernel" : "userspace");
+    if (rc == KTLS_FAILED) {
+        finish_transaction(efd, trans);
+        return;
+    }
+    kernel = rc == KTLS_OK;
+    if (kernel) free_tls(trans);
+
+    event.data.fd = trans->fd;
+    event.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
+        unix_error("epoll ctl");
+    }
+    trans->state = S_READ_REQ_HEADER;
+    queue_transmission(trans);
+}
+
+/*
+ * tls_finish - send close_notify, best effort, and free a userspace session
+ */
+void tls_finish(transaction_t *trans) {
+    if (trans->tls == NULL) return;
+    if (trans->state != S_TLS_HANDSHAKE) {
+        ERR_clear_error();
+        SSL_shutdown(trans->tls->ssl);
+    }
+    free_tls(trans);
+}
+
+/* map a failed SSL_read/SSL_write to the read/write convention */
+static ssize_t ssl_result(SSL *ssl, int rc) {
+    switch (SSL_get_error(ssl, rc)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0) errno = ECONNRESET;
+            return -1;
+        default:
+            errno = EIO;
+            return -1;
+    }
+}
+
+/*
+ * conn_read - read from the client, decrypting in userspace if the session was not offloaded
+ */
+ssize_t conn_read(transaction_t *trans, void *buf, size_t len) {
+    ssize_t rc;
+    if (trans->tls == NULL) {
+        rc = read(trans->fd, buf, len);
+    } else {
+        ERR_clear_error();
+        if ((rc = SSL_read(trans->tls->ssl, buf, len > INT_MAX ? INT_MAX : len)) <= 0) {
+            rc = ssl_result(trans->tls->ssl, rc);
+        }
+    }
+    PROBE3(read, trans->fd, len, rc);
+    if (rc > 0) trans->timing.bytes_in += rc;
+    if (rc < 0 && errno == EAGAIN) {
+        PROBE2(eagain, trans->fd, 'r');
+        trans->timing.eagains++;
+    }
+    return rc;
+}
+
+/*
+ * conn_flush - outq_flush for a connection, accounting what was sent
+ */
+ssize_t conn_flush(transaction_t *trans, long budget) {
+    ssize_t rc = trans->tls == NULL ? outq_flush(trans->fd, &trans->outq, budget) : ssl_flush(trans, budget);
+    if (rc > 0) {
+        if (trans->timing.first_byte == 0) trans->timing.first_byte = now_us();
+        trans->timing.bytes_out += rc;
+    } else if (rc < 0 && errno == EAGAIN) {
+        trans->timing.eagains++;
+    }
+    return rc;
+}
+
+/*
+ * ssl_flush - outq_flush through userspace TLS.
+ * One record per call, file segments are copied through a bounce buffer.
+ */
+static ssize_t ssl_flush(transaction_t *trans, long budget) {
+    static char bounce[TLS_RECORD];
+    tls_conn_t *t = trans->tls;
+    outq_t *q = &trans->outq;
+    out_seg_t *seg;
+    const char *data;
+    ssize_t got;
+    long len;
+    int rc;
+
+    if (q->n == 0) return 0;
+    seg = &q->segs[q->head];
+    if (t->retry_len) {
+        len = t->retry_len;
+    } else { /* MIN does not nest, its arguments are unparenthesised */
+        len = seg->len < budget ? seg->len : budget;
+        if (len > (long) sizeof(bounce)) len = sizeof(bounce);
+    }
+    if (seg->type == SEG_FILE) {
+        if ((got = pread(seg->fd, bounce, len, seg->off)) <= 0) {
+            if (got == 0) errno = EIO; /* truncated under us */
+            return -1;
+        }
+        data = bounce;
+        len = got;
+    } else {
+        data = seg->base + seg->off;
+    }
+    ERR_clear_error();
+    if ((rc = SSL_write(t->ssl, data, len)) <= 0) {
+        t->retry_len = len;
+        got = ssl_result(t->ssl, rc);
+        PROBE3(write, trans->fd, len, got);
+        if (errno == EAGAIN) PROBE2(eagain, trans->fd, 'w');
+        return got;
+    }
+    PROBE3(write, trans->fd, len, rc);
+    t->retry_len = 0;
+    if (seg->type == SEG_FILE) seg->off += rc;
+    outq_consume(q, rc);
+    return rc;
+}
@@ -0,0 +1,34 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_TLS_H
+#define NAIVE_HTTP_TLS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "transaction.h"
+
+#define TLS_RECORD 16384 /* largest TLS record payload, the bounce size of userspace TLS */
+
+int init_tls();
+
+bool tls_enabled();
+
+void tls_accept(int efd, transaction_t *trans);
+
+void tls_handshake(int efd, transaction_t *trans);
+
+void tls_finish(transaction_t *trans);
+
+ssize_t conn_read(transaction_t *trans, void *buf, size_t len);
+
+ssize_t conn_flush(transaction_t *trans, long budget);
+
+#endif //NAIVE_HTTP_TLS_H
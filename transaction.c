@@ -9,17 +9,49 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 */
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
 #include "transaction.h"
+#include "config.h"
+
+#define HUGE_PAGE (2UL << 20)
+
+_Static_assert(offsetof(transaction_t, node) + sizeof(void *) <= CACHE_LINE,
+               "hot transaction fields spill out of the first cache line");
 
 static transaction_slots_t slots;
 static transaction_queue_t queue;
+static struct {
+    transaction_node_t *head;
+    transaction_node_t *tail;
+} runq;
+
+/*
+ * Transaction nodes are never malloc'ed. The hot arena holds the nodes,
+ * packed on cache lines; the cold arena holds each node's request strings
+ * and read buffer. Both are mapped up front, so accept and close only move
+ * a node between the free list and the slots.
+ */
+static struct {
+    transaction_node_t *free; /* linked through next */
+    int n; /* nodes mapped */
+} pool;
 
 static void append_front(transaction_node_t *node);
 
 static void remove_from_queue(transaction_node_t *node);
 
+static void remove_from_runq(transaction_node_t *node);
+
+static int grow_pool(int n);
+
+static void *map_arena(size_t len, bool huge);
+
 void finish_transaction(int efd, transaction_t *trans);
 
+void resume_transaction(int efd, void *arg);
+
 void init_transaction(transaction_t *trans) {
     trans->fd = INVALID_FD;
     trans->read_fd = INVALID_FD;
@@ -29,67 +61,153 @@ void init_transaction(transaction_t *trans) {
     trans->state = S_INVALID;
     trans->next_stage = P_INVALID;
     trans->read_pos = 0;
+    trans->read_len = 0;
     trans->write_pos = 0;
+    outq_init(&trans->outq);
     trans->parse_pos = 0;
     trans->saved_pos = 0;
     trans->haslock = false;
+    trans->streaming = false;
+    trans->rate_bucket = NULL;
+    trans->abort_pending = false;
+    trans->paused = false;
+    trans->body_spent = false;
+    trans->body_held = 0;
+    trans->upstream = NULL;
+    trans->tls = NULL;
+    trans->h2 = NULL;
+    trans->batch_next = 0;
+    trans->batch_sent = 0;
+    trans->batch_skipped = 0;
+    trans->untar = NULL;
+    trans->dedup = NULL;
+    trans->obj_rec = -1;
+    trans->obj_seg = NULL;
+    trans->disk_job.digest = NULL;
+    trans->req->etag[0] = '\0';
+    init_timer_entry(&trans->pace_timer, resume_transaction, trans);
     trans->last_accessed = time(NULL);
-    init_headers(&trans->headers);
+    memset(&trans->timing, 0, sizeof(trans_timing_t));
+    init_headers(&trans->headers, trans->req->header_space, HEADER_SPACE);
 }
 
 void init_transaction_slots() {
-    int i;
-    for (i = 0; i < MAXHASH; i++) {
-        slots.transactions[i] = NULL;
+    slots.transactions = calloc(config.max_hash, sizeof(transaction_node_t *));
+    if (slots.transactions == NULL) {
+        unix_error("fatal: calloc");
+        exit(-1);
     }
     queue.n = 0;
     queue.newest = NULL;
     queue.oldest = NULL;
+    /* max_transaction live ones, plus the one accepted before the oldest is kicked out */
+    if (grow_pool(config.max_transaction + 1) == ERROR) {
+        unix_error("fatal: mmap transaction pool");
+        exit(-1);
+    }
+}
+
+/*
+ * grow_pool - map n more nodes onto the free list.
+ * Only at startup, and once more if a reload raises max_transaction.
+ */
+static int grow_pool(int n) {
+    /* read_buf follows the request on its own cache line, bodies are cast to records in place */
+    size_t req_size = (sizeof(trans_request_t) + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+    size_t cold_size = (req_size + config.max_buf + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+    transaction_node_t *nodes;
+    char *cold;
+    int i;
+
+    if ((nodes = map_arena(n * sizeof(transaction_node_t), config.huge_pages)) == NULL) return ERROR;
+    if ((cold = map_arena(n * cold_size, false)) == NULL) {
+        munmap(nodes, n * sizeof(transaction_node_t));
+        return ERROR;
+    }
+    for (i = n - 1; i >= 0; i--) { /* handed out in address order */
+        nodes[i].transaction.req = (trans_request_t *) (cold + i * cold_size);
+        nodes[i].transaction.read_buf = (char *) nodes[i].transaction.req + req_size;
+        nodes[i].next = pool.free;
+        pool.free = &nodes[i];
+    }
+    pool.n += n;
+    return OKAY;
+}
+
+/*
+ * map_arena - anonymous memory, touched lazily.
+ * With huge set, try reserved huge pages first, then ask for transparent ones,
+ * so the nodes the event loop walks share a few TLB entries.
+ */
+static void *map_arena(size_t len, bool huge) {
+    void *p;
+
+    if (huge) {
+        p = mmap(NULL, (len + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) return p;
+        unix_error("transaction pool: no reserved huge pages, using transparent ones");
+    }
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    if (huge) madvise(p, len, MADV_HUGEPAGE);
+    return p;
 }
 
 void remove_transaction_from_slots(transaction_t *trans) {
     if (trans->fd < 0) return;
     transaction_node_t *node = NULL, *prev = NULL;
-    node = slots.transactions[trans->fd % MAXHASH];
+    node = slots.transactions[trans->fd % config.max_hash];
     while (node && node->transaction.fd != trans->fd) {
         prev = node;
         node = node->next;
     }
     if (node) {
         remove_from_queue(node);
+        remove_from_runq(node);
         if (prev) prev->next = node->next;
-        else slots.transactions[trans->fd % MAXHASH] = NULL;
-        free(node);
+        else slots.transactions[trans->fd % config.max_hash] = node->next;
+        node->next = pool.free;
+        pool.free = node;
         slots.n -= 1;
     }
 }
 
 transaction_t *find_empty_transaction_for_fd(int efd, int fd) {
-    if (slots.n > MAXTRANSACTION) {
-        if (queue.oldest && (time(NULL) - queue.oldest->transaction.last_accessed) > TIMEOUT) {
+    if (slots.n > config.max_transaction) {
+        if (queue.oldest && (time(NULL) - queue.oldest->transaction.last_accessed) > config.timeout) {
             /* kick out timed-out transactions */
             finish_transaction(efd, &queue.oldest->transaction);
         } else { /* maximum connection exceeded */
             return NULL;
         }
     }
-    transaction_node_t *node = slots.transactions[fd % MAXHASH];
+    transaction_node_t *node = slots.transactions[fd % config.max_hash];
     transaction_node_t *prev = node;
     while (node != NULL) {
         prev = node;
         node = node->next;
     }
-    transaction_node_t *new_node = malloc(sizeof(transaction_node_t));
-    if (!new_node) {
-        unix_error("fatal: malloc");
-        exit(-1);
+    if (pool.free == NULL) {
+        /* the oldest one is still finishing on a disk worker, or a reload lowered max_transaction */
+        if (config.max_transaction + 1 - pool.n <= 0) return NULL;
+        /* a reload raised max_transaction past the pool */
+        if (grow_pool(config.max_transaction + 1 - pool.n) == ERROR) {
+            unix_error("mmap transaction pool");
+            return NULL;
+        }
     }
+    transaction_node_t *new_node = pool.free;
+    pool.free = new_node->next;
     if (prev) prev->next = new_node;
-    else slots.transactions[fd % MAXHASH] = new_node;
+    else slots.transactions[fd % config.max_hash] = new_node;
     new_node->next = NULL;
-    new_node->slot = &slots.transactions[fd % MAXHASH];
+    new_node->slot = &slots.transactions[fd % config.max_hash];
     new_node->newer = NULL;
     new_node->older = NULL;
+    new_node->run = RUN_NONE;
+    new_node->run_next = NULL;
+    new_node->run_prev = NULL;
     init_transaction(&new_node->transaction);
     new_node->transaction.node = new_node;
     add_transaction(&new_node->transaction);
@@ -98,7 +216,7 @@ transaction_t *find_empty_transaction_for_fd(int efd, int fd) {
 
 transaction_t *find_transaction_for_fd(int fd) {
     transaction_node_t *node = NULL;
-    node = slots.transactions[fd % MAXHASH];
+    node = slots.transactions[fd % config.max_hash];
     while (node && node->transaction.fd != fd) {
         node = node->next;
     }
@@ -125,14 +243,59 @@ static void remove_from_queue(transaction_node_t *node) {
     if (node->newer) node->newer->older = node->older;
     if (node->older) node->older->newer = node->newer;
     if (queue.oldest == node) queue.oldest = node->newer;
+    if (queue.newest == node) queue.newest = node->older;
     queue.n--;
     if (queue.n == 0) {
         queue.newest = queue.oldest = NULL;
     }
 }
 
+int active_transactions() {
+    return slots.n;
+}
+
 void update_access(transaction_t *trans) {
     trans->last_accessed = time(0);
+    trans->timing.wakeups++;
     remove_from_queue(trans->node);
     append_front(trans->node);
-}
\ No newline at end of file
+}
+/*
+ * runq_push - queue trans for its next step.
+ * Queued once at most; a protocol step wins over a transmission step,
+ * as it moves the transaction on and queues the transmission itself.
+ */
+void runq_push(transaction_t *trans, run_e run) {
+    transaction_node_t *node = trans->node;
+    if (node->run != RUN_NONE) {
+        if (run == RUN_PROTOCOL) node->run = RUN_PROTOCOL;
+        return;
+    }
+    node->run = run;
+    node->run_next = NULL;
+    node->run_prev = runq.tail;
+    if (runq.tail) runq.tail->run_next = node;
+    else runq.head = node;
+    runq.tail = node;
+}
+
+/*
+ * runq_pop - oldest ready transaction and the step it waits for, NULL if none
+ */
+transaction_t *runq_pop(run_e *run) {
+    transaction_node_t *node = runq.head;
+    if (node == NULL) return NULL;
+    *run = node->run;
+    remove_from_runq(node);
+    return &node->transaction;
+}
+
+static void remove_from_runq(transaction_node_t *node) {
+    if (node->run == RUN_NONE) return;
+    if (node->run_prev) node->run_prev->run_next = node->run_next;
+    else runq.head = node->run_next;
+    if (node->run_next) node->run_next->run_prev = node->run_prev;
+    else runq.tail = node->run_prev;
+    node->run = RUN_NONE;
+    node->run_next = node->run_prev = NULL;
+}
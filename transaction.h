@@ -11,65 +11,142 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #define NAIVE_HTTP_TRANS_H
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <time.h>
 #include "http.h"
 #include "error_handler.h"
+#include "diskio.h"
+#include "outq.h"
+#include "ratelimit.h"
+#include "timer.h"
 #include "misc.h"
 
 /* which state of transmission */
 typedef enum {
-    S_INVALID, S_READ_REQ_HEADER, S_READ, S_WRITE, S_WRITE_FILE
+    S_INVALID, S_READ_REQ_HEADER, S_READ, S_WRITE, S_WAIT_DISK, S_PROXY, S_TLS_HANDSHAKE, S_H2
 } trans_state_e;
 /* which stage of the protocol */
 typedef enum {
-    P_INVALID, P_SEND_RESP_HEADER, P_SEND_RESP_BODY, P_READ_REQ_BODY, P_DONE
+    P_INVALID, P_SEND_RESP_HEADER, P_SEND_RESP_BODY, P_READ_REQ_BODY, P_READ_MANIFEST, P_BATCH_NEXT, P_UNTAR, P_DEDUP, P_OBJSTORE, P_DONE
 } stage_e;
+/* which step a transaction waits for in the run queue */
+typedef enum {
+    RUN_NONE, RUN_TRANSMISSION, RUN_PROTOCOL
+} run_e;
+
+/*
+ * Where the time of a request went, for the slow-request log.
+ * Timestamps are monotonic microseconds, 0 until the stage is reached.
+ */
+typedef struct {
+    long long accepted;
+    long long header; /* request header parsed */
+    long long opened; /* file opened and locked by a disk worker */
+    long long first_byte; /* first response byte written */
+    long long done;
+    long bytes_in, bytes_out;
+    int eagains; /* socket reads and writes that had to wait for epoll */
+    int wakeups; /* event loop iterations that worked on it */
+} trans_timing_t;
+
+#define HEADER_SPACE 4096 /* header arena bytes before it has to malloc */
+
+/*
+ * Request line, mapped file name and request headers. Cold: written once when
+ * the header is parsed and read again only to open the file and to log, so
+ * they live in the pool's cold arena instead of spreading the transaction out.
+ */
+typedef struct {
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char filename[MAXLINE];
+    char etag[ETAG_LEN + 1]; /* of the file being sent, "" if it has none */
+    _Alignas(max_align_t) char header_space[HEADER_SPACE]; /* first block of headers.arena, after the odd-sized etag */
+} trans_request_t;
 
 struct _transaction_node;
+struct _upstream_conn;
+struct _tls_conn;
+struct _h2_conn;
 typedef struct {
-    /* common field */
+    /* hot: the state machine and socket I/O, the first cache line */
     int fd;
     trans_state_e state;
     stage_e next_stage;
-    int response_code;
-    time_t last_accessed;
-    struct _transaction_node *node;
     bool haslock;
-    /* read from socket */
-    char read_buf[MAXBUF];
+    bool streaming; /* large download, see stream.h */
+    bool abort_pending; /* finish once the disk job completes */
+    char *read_buf; /* config.max_buf bytes */
     long read_len;
     long read_pos;
     long parse_pos;
+    long write_pos; /* file offset of the body being sent */
+    struct _transaction_node *node;
+    /* common field */
+    int response_code;
+    time_t last_accessed;
+    rate_bucket_t *rate_bucket; /* per-client limiter entry, NULL if unlimited */
+    timer_entry_t pace_timer; /* pending while parked by the limiter */
+    bool paused; /* reads stopped by the body budget, see budget.h */
+    bool body_spent; /* the reserved chunk was handed on, given back when the next one starts */
+    long body_held; /* read_buf bytes reserved against config.upload_budget */
+    disk_job_t disk_job; /* in flight while state is S_WAIT_DISK */
+    struct _tls_conn *tls; /* userspace TLS session, NULL for plaintext and kernel TLS, see tls.h */
+    trans_timing_t timing;
+    /* read from socket */
     int write_fd;
-    int saved_pos;
+    long saved_pos; /* body bytes written */
     FILE *dest_file;
     /* write to socket */
-    char write_buf[MAXBUF];
-    long write_len;
-    long write_pos;
+    outq_t outq;
     int read_fd;
+    long ra_pos; /* readahead issued up to here */
+    long drop_pos; /* pages before this are dropped from the page cache */
+    /* reverse proxy */
+    struct _upstream_conn *upstream; /* while state is S_PROXY, see proxy.h */
+    /* batch download, see batch.h */
+    long batch_next; /* manifest offset of the next entry */
+    int batch_sent, batch_skipped;
+    /* tar upload, see untar.h */
+    struct _untar *untar; /* in the header arena, NULL until P_UNTAR runs */
+    /* deduplicated upload, see dedup.h */
+    struct _dedup *dedup; /* in the header arena, NULL until P_DEDUP runs */
+    /* small-object upload, see objstore.h */
+    long obj_rec; /* offset of the record in its segment, -1 until the body is read */
+    struct _segment *obj_seg; /* appended to while state is S_WAIT_DISK */
+    /* HTTP/2 */
+    struct _h2_conn *h2; /* streams of the connection while state is S_H2, see h2.h */
     /* request header */
     long filesize;
-    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE];
+    trans_request_t *req; /* cold arena, see above */
     enum {
         GET, POST, HEAD
     } methodtype;
     http_headers_t headers;
 } transaction_t;
 
+/*
+ * Nodes come from a pool preallocated at startup, see init_transaction_slots().
+ * Each starts on a cache line; a free node is linked through next.
+ */
 typedef struct _transaction_node {
     transaction_t transaction;
     struct _transaction_node **slot;
     struct _transaction_node *next;
     struct _transaction_node *newer;
     struct _transaction_node *older;
-} transaction_node_t; /* Linked-list node */
+    /* run queue, see run_transactions() */
+    run_e run;
+    struct _transaction_node *run_next;
+    struct _transaction_node *run_prev;
+    /* paused by the body budget, see budget.c */
+    struct _transaction_node *budget_newer;
+    struct _transaction_node *budget_older;
+} __attribute__((aligned(CACHE_LINE))) transaction_node_t; /* Linked-list node */
 
 typedef struct {
     int n;
-    transaction_node_t *transactions[MAXHASH];
+    transaction_node_t **transactions; /* config.max_hash buckets */
 } transaction_slots_t;
 
 typedef struct {
@@ -91,8 +168,17 @@ transaction_t *find_transaction_for_fd(int fd);
 
 void remove_transaction_from_slots(transaction_t *trans);
 
-void init_headers(http_headers_t *headers);
+void init_headers(http_headers_t *headers, char *space, size_t size);
+
+void destroy_headers(http_headers_t *hdrs);
 
 void update_access(transaction_t *trans);
 
+int active_transactions();
+
+/* ready transactions, drained by the event loop after every epoll batch */
+void runq_push(transaction_t *trans, run_e run);
+
+transaction_t *runq_pop(run_e *run);
+
 #endif //NAIVE_HTTP_TRANS_H
\ No newline at end of file
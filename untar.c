@@ -0,0 +1,546 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include "untar.h"
+#include "config.h"
+#include "diskio.h"
+#include "arena.h"
+#include "misc.h"
+#include "tar.h"
+#include "durable.h"
+
+typedef struct _tar_entry {
+    char *name; /* beneath the root */
+    char *tmp; /* written here; NULL once renamed over name, or removed */
+    long size;
+    const char *result; /* NULL while being unpacked */
+    bool synced; /* its data is durable, before it is closed */
+    struct _tar_entry *next;
+} tar_entry_t;
+
+/* state of an unpacking, in the request's header arena */
+typedef struct _untar {
+    enum {
+        U_HEADER, U_DATA, U_PAD, U_PUBLISH
+    } state;
+    char *dir; /* entries go beneath it, "" for the root */
+    long parse; /* bytes of read_buf consumed */
+    long consumed; /* archive bytes before read_buf */
+    long left; /* data or padding bytes left of the current entry */
+    long chunk; /* bytes being written by the disk workers */
+    bool end; /* the end-of-archive block was seen, the rest of the body is discarded */
+    const char *error; /* the archive is unusable, stop */
+    tar_entry_t *head, *tail;
+    tar_entry_t *cur; /* being unpacked, then being published */
+    tar_entry_t *last_synced; /* the directory sync pass goes on after it */
+    int n;
+} untar_t;
+
+/* defined in http.c */
+void queue_protocol(transaction_t *trans);
+
+void queue_transmission(transaction_t *trans);
+
+bool finish_if_aborted(int efd, transaction_t *trans);
+
+static untar_t *start_untar(transaction_t *trans);
+
+static int read_header(transaction_t *trans, untar_t *u);
+
+static long parse_octal(const char *p, int len);
+
+static int entry_path(const char *dir, const char *name, char *out);
+
+static bool refill(transaction_t *trans, untar_t *u);
+
+static void submit_entry_job(transaction_t *trans, disk_op_e op, disk_done_cb_t done, const char *path,
+                             const char *target);
+
+static void on_entry_opened(int efd, disk_job_t *job);
+
+static void on_entry_written(int efd, disk_job_t *job);
+
+static void on_entry_closed(int efd, disk_job_t *job);
+
+static void on_entry_published(int efd, disk_job_t *job);
+
+static bool publish_next(transaction_t *trans, untar_t *u);
+
+static void on_entry_synced(int efd, disk_job_t *job);
+
+static bool sync_next(transaction_t *trans, untar_t *u);
+
+static void on_dir_synced(int efd, disk_job_t *job);
+
+static bool published(const tar_entry_t *e);
+
+static bool same_dir(const char *a, const char *b);
+
+static void drop_entry(transaction_t *trans, tar_entry_t *e, const char *result);
+
+static void respond(int efd, transaction_t *trans, untar_t *u);
+
+bool untar_requested(transaction_t *trans) {
+    const char *q = strchr(trans->req->uri, '?');
+    return q != NULL && strcmp(q + 1, "untar") == 0;
+}
+
+/*
+ * untar_step - unpack what read_buf holds, then read more.
+ * Runs as the P_UNTAR stage, and again after every disk job and every read.
+ */
+void untar_step(int efd, transaction_t *trans) {
+    untar_t *u = trans->untar != NULL ? trans->untar : start_untar(trans);
+    long avail;
+
+    trans->state = S_READ;
+    while (u->error == NULL) {
+        avail = trans->read_pos - u->parse;
+        switch (u->state) {
+            case U_HEADER:
+                if (avail < TAR_BLOCK) {
+                    if (refill(trans, u)) return;
+                    u->error = "truncated archive";
+                    break;
+                }
+                if (read_header(trans, u) == ERROR || u->end || u->cur->tmp == NULL) continue;
+                /* create and lock the temporary file off the loop. on_entry_opened continues. */
+                strcpy(trans->req->filename, u->cur->tmp); /* removed by finish_transaction if cut short */
+                submit_entry_job(trans, D_OPEN_WRITE, on_entry_opened, u->cur->tmp, NULL);
+                return;
+            case U_DATA:
+                if (u->left == 0) { /* entry complete */
+                    if (trans->dest_file != NULL && durable_uploads() && !u->cur->synced) {
+                        /* before D_PUBLISH closes it, on_entry_synced comes back here */
+                        u->cur->synced = true;
+                        trans->disk_job.file = trans->dest_file;
+                        trans->disk_job.fd = trans->write_fd;
+                        trans->disk_job.path[0] = '\0';
+                        trans->disk_job.target = NULL;
+                        wait_sync(trans, on_entry_synced);
+                        return;
+                    }
+                    u->state = U_PAD;
+                    u->left = -u->cur->size & (TAR_BLOCK - 1);
+                    if (trans->dest_file == NULL) continue;
+                    submit_entry_job(trans, D_PUBLISH, on_entry_closed, u->cur->tmp,
+                                     config.untar_publish == PUBLISH_ENTRY ? u->cur->name : NULL);
+                    trans->dest_file = NULL; /* closed by the job */
+                    trans->write_fd = INVALID_FD;
+                    return;
+                }
+                if (avail == 0) {
+                    if (refill(trans, u)) return;
+                    u->error = "truncated archive";
+                    break;
+                }
+                u->chunk = u->left < avail ? u->left : avail;
+                if (trans->dest_file != NULL) { /* on_entry_written consumes the chunk */
+                    submit_entry_job(trans, D_WRITE, on_entry_written, u->cur->tmp, NULL);
+                    return;
+                }
+                u->parse += u->chunk; /* a skipped entry */
+                u->left -= u->chunk;
+                continue;
+            case U_PAD:
+                if (u->left == 0) {
+                    u->state = u->end ? U_PUBLISH : U_HEADER;
+                    continue;
+                }
+                if (avail == 0) {
+                    if (refill(trans, u)) return;
+                    u->error = "truncated archive";
+                    break;
+                }
+                avail = u->left < avail ? u->left : avail;
+                u->parse += avail;
+                u->left -= avail;
+                continue;
+            case U_PUBLISH:
+                if (publish_next(trans, u) || sync_next(trans, u)) return;
+                respond(efd, trans, u);
+                return;
+        }
+    }
+
+    /* give up: nothing more is written, and in archive mode nothing is published */
+    if (trans->dest_file != NULL) {
+        submit_disk_close(INVALID_FD, trans->dest_file, u->cur->tmp);
+        trans->dest_file = NULL;
+        trans->write_fd = INVALID_FD;
+        u->cur->tmp = NULL;
+        u->cur->result = "aborted";
+    }
+    if (sync_next(trans, u)) return; /* entries published one by one are reported */
+    untar_finish(trans);
+    respond(efd, trans, u);
+}
+
+/*
+ * untar_finish - remove temporary files of entries that were complete but never published.
+ * The entry being written, if any, is trans->dest_file and removed by finish_transaction.
+ */
+void untar_finish(transaction_t *trans) {
+    untar_t *u = trans->untar;
+    tar_entry_t *e;
+    if (u == NULL) return;
+    for (e = u->head; e != NULL; e = e->next) {
+        if (e->result != NULL && e->tmp != NULL) drop_entry(trans, e, "discarded");
+    }
+    trans->untar = NULL; /* freed with the header arena */
+}
+
+static untar_t *start_untar(transaction_t *trans) {
+    untar_t *u = arena_alloc(&trans->headers.arena, sizeof(untar_t));
+    if (u == NULL) {
+        unix_error("fatal: malloc");
+        exit(-2);
+    }
+    memset(u, 0, sizeof(untar_t));
+    u->state = U_HEADER;
+    /* read_request_header left the target directory in filename */
+    if ((u->dir = arena_strndup(&trans->headers.arena, trans->req->filename, strlen(trans->req->filename))) == NULL) {
+        unix_error("fatal: malloc");
+        exit(-2);
+    }
+    printf("untar into /%s\n", u->dir);
+    trans->untar = u;
+    return u;
+}
+
+/*
+ * read_header - consume the header block at parse and start its entry.
+ * An all-zero block ends the archive. Entries that cannot be unpacked get
+ * a result right away and their data is skipped.
+ */
+static int read_header(transaction_t *trans, untar_t *u) {
+    tar_header_t *h = (tar_header_t *) (trans->read_buf + u->parse);
+    const unsigned char *p;
+    char name[sizeof(h->prefix) + 1 + sizeof(h->name) + 1], path[MAXLINE], tmp[MAXLINE];
+    unsigned long sum = 0;
+    long size, chksum;
+    tar_entry_t *e;
+    int i, len;
+
+    for (p = (const unsigned char *) h, i = 0; i < TAR_BLOCK && p[i] == 0; i++);
+    u->parse += TAR_BLOCK;
+    if (i == TAR_BLOCK) { /* end of archive, skip the zero blocks padding the last record */
+        u->end = true;
+        u->state = U_PAD;
+        u->left = trans->filesize - u->consumed - u->parse;
+        u->cur = u->head;
+        return OKAY;
+    }
+    for (i = 0; i < TAR_BLOCK; i++) sum += i >= 148 && i < 156 ? ' ' : p[i]; /* chksum as spaces */
+    chksum = parse_octal(h->chksum, sizeof(h->chksum));
+    size = parse_octal(h->size, sizeof(h->size));
+    if (chksum < 0 || (unsigned long) chksum != sum || size < 0) {
+        u->error = "bad header checksum";
+        return ERROR;
+    }
+
+    len = 0;
+    if (memcmp(h->magic, "ustar", 5) == 0 && h->prefix[0] != '\0') {
+        len = snprintf(name, sizeof(name), "%.*s/", (int) sizeof(h->prefix), h->prefix);
+    }
+    snprintf(name + len, sizeof(name) - len, "%.*s", (int) sizeof(h->name), h->name);
+
+    if ((e = arena_alloc(&trans->headers.arena, sizeof(tar_entry_t))) == NULL) {
+        unix_error("fatal: malloc");
+        exit(-2);
+    }
+    memset(e, 0, sizeof(tar_entry_t));
+    e->size = size;
+    if (h->typeflag == '5') { /* created along with the files beneath it */
+        e->result = "directory";
+        e->name = arena_strndup(&trans->headers.arena, name, strlen(name));
+    } else if (entry_path(u->dir, name, path) == ERROR) {
+        e->result = "bad name";
+        e->name = arena_strndup(&trans->headers.arena, name, strlen(name));
+    } else {
+        e->name = arena_strndup(&trans->headers.arena, path, strlen(path));
+        if (h->typeflag != '0' && h->typeflag != '\0') e->result = "unsupported type";
+        else if (size > config.max_file_size) e->result = "too large";
+    }
+    if (e->result == NULL) {
+        /* a hidden name next to the final one, so the rename stays in one directory */
+        char *slash = strrchr(path, '/');
+        int dir_len = slash ? (int) (slash - path) + 1 : 0;
+        len = snprintf(tmp, sizeof(tmp), "%.*s.%s.untar-%d-%d", dir_len, path, path + dir_len, trans->fd, u->n);
+        if (len >= (int) sizeof(tmp)) e->result = "bad name";
+        else e->tmp = arena_strndup(&trans->headers.arena, tmp, len);
+    }
+    if (e->name == NULL || (e->result == NULL && e->tmp == NULL)) {
+        unix_error("fatal: malloc");
+        exit(-2);
+    }
+
+    if (u->tail) u->tail->next = e;
+    else u->head = e;
+    u->tail = e;
+    u->cur = e;
+    u->n++;
+    u->state = U_DATA;
+    u->left = size;
+    return OKAY;
+}
+
+/* value of a NUL or space terminated octal field, -1 if malformed */
+static long parse_octal(const char *p, int len) {
+    long v = 0;
+    int i = 0;
+    while (i < len && p[i] == ' ') i++;
+    if (i == len || p[i] < '0' || p[i] > '7') return -1;
+    for (; i < len && p[i] >= '0' && p[i] <= '7'; i++) v = v * 8 + (p[i] - '0');
+    return i == len || p[i] == '\0' || p[i] == ' ' ? v : -1;
+}
+
+/*
+ * entry_path - join an archive member name beneath dir.
+ * Empty and "." segments are dropped. Absolute names are taken as relative,
+ * and ".." is refused rather than resolved.
+ */
+static int entry_path(const char *dir, const char *name, char *out) {
+    int out_len = snprintf(out, MAXLINE, "%s", dir), base = out_len, seg_len;
+    const char *seg = name, *end;
+
+    while (*seg) {
+        if ((end = strchr(seg, '/')) == NULL) end = seg + strlen(seg);
+        seg_len = (int) (end - seg);
+        if (seg_len == 2 && seg[0] == '.' && seg[1] == '.') return ERROR;
+        if (seg_len > 0 && !(seg_len == 1 && seg[0] == '.')) {
+            if (out_len + 1 + seg_len >= MAXLINE) return ERROR;
+            if (out_len > 0) out[out_len++] = '/';
+            memcpy(out + out_len, seg, seg_len);
+            out_len += seg_len;
+        }
+        seg = *end ? end + 1 : end;
+    }
+    out[out_len] = '\0';
+    return out_len > base ? OKAY : ERROR;
+}
+
+/* keep the unconsumed bytes and read more of the body, false if it is all read */
+static bool refill(transaction_t *trans, untar_t *u) {
+    long unread = trans->filesize - u->consumed - trans->read_pos, room;
+    if (unread <= 0) return false;
+    memmove(trans->read_buf, trans->read_buf + u->parse, trans->read_pos - u->parse);
+    u->consumed += u->parse;
+    trans->read_pos -= u->parse;
+    u->parse = 0;
+    room = config.max_buf - trans->read_pos;
+    trans->read_len = trans->read_pos + (unread < room ? unread : room);
+    queue_transmission(trans); /* read_n comes back to P_UNTAR */
+    return true;
+}
+
+/* like wait_disk, for a job on the current entry */
+static void submit_entry_job(transaction_t *trans, disk_op_e op, disk_done_cb_t done, const char *path,
+                             const char *target) {
+    disk_job_t *job = &trans->disk_job;
+    untar_t *u = trans->untar;
+    job->op = op;
+    job->done = done;
+    job->arg = trans;
+    strncpy(job->path, path, MAXLINE - 1);
+    job->path[MAXLINE - 1] = '\0';
+    job->fd = trans->write_fd;
+    job->file = trans->dest_file;
+    job->buf = trans->read_buf + u->parse;
+    job->len = u->chunk;
+    job->target = target;
+    trans->state = S_WAIT_DISK;
+    submit_disk_job(job);
+}
+
+static void on_entry_opened(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    untar_t *u = trans->untar;
+    if (job->result == OKAY) {
+        trans->write_fd = job->fd;
+        trans->dest_file = job->file;
+    } else {
+        posix_error(job->err, "untar: create");
+        u->cur->tmp = NULL;
+        u->cur->result = "create failed"; /* its data is skipped */
+    }
+    if (finish_if_aborted(efd, trans)) return;
+    queue_protocol(trans);
+}
+
+static void on_entry_written(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    untar_t *u = trans->untar;
+    u->parse += u->chunk;
+    u->left -= u->chunk;
+    if (job->result == ERROR) {
+        posix_error(job->err, "untar: fwrite");
+        submit_disk_close(INVALID_FD, trans->dest_file, u->cur->tmp);
+        trans->dest_file = NULL;
+        trans->write_fd = INVALID_FD;
+        u->cur->tmp = NULL;
+        u->cur->result = "write failed"; /* the rest of its data is skipped */
+    }
+    if (finish_if_aborted(efd, trans)) return;
+    queue_protocol(trans);
+}
+
+/* the entry is closed, and published unless the whole archive is published at once */
+static void on_entry_closed(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    untar_t *u = trans->untar;
+    if (job->result == ERROR) {
+        posix_error(job->err, "untar: close");
+        drop_entry(trans, u->cur, "write failed");
+    } else {
+        u->cur->result = "ok";
+        if (job->target != NULL) u->cur->tmp = NULL;
+    }
+    if (finish_if_aborted(efd, trans)) return;
+    queue_protocol(trans);
+}
+
+static void on_entry_published(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    untar_t *u = trans->untar;
+    if (job->result == ERROR) {
+        posix_error(job->err, "untar: rename");
+        drop_entry(trans, u->cur, "publish failed");
+    }
+    u->cur->tmp = NULL;
+    u->cur = u->cur->next;
+    if (finish_if_aborted(efd, trans)) return;
+    queue_protocol(trans);
+}
+
+/* rename the next complete entry over its final name, false once all are done */
+static bool publish_next(transaction_t *trans, untar_t *u) {
+    while (u->cur != NULL && u->cur->tmp == NULL) u->cur = u->cur->next;
+    if (u->cur == NULL) return false;
+    submit_entry_job(trans, D_PUBLISH, on_entry_published, u->cur->tmp, u->cur->name);
+    return true;
+}
+
+static void on_entry_synced(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    untar_t *u = trans->untar;
+    if (job->result == ERROR) {
+        posix_error(job->err, "untar: sync");
+        submit_disk_close(INVALID_FD, trans->dest_file, u->cur->tmp);
+        trans->dest_file = NULL;
+        trans->write_fd = INVALID_FD;
+        u->cur->tmp = NULL;
+        u->cur->result = "sync failed";
+    }
+    if (finish_if_aborted(efd, trans)) return;
+    queue_protocol(trans);
+}
+
+/*
+ * sync_next - sync the directory of the next published entry, false once all are durable.
+ * Entries in the same directory as the last one synced are covered by it.
+ */
+static bool sync_next(transaction_t *trans, untar_t *u) {
+    disk_job_t *job = &trans->disk_job;
+    tar_entry_t *e;
+
+    if (!durable_uploads()) return false;
+    for (e = u->last_synced ? u->last_synced->next : u->head; e != NULL; e = e->next) {
+        if (published(e) && (u->last_synced == NULL || !same_dir(u->last_synced->name, e->name))) break;
+    }
+    if (e == NULL) return false;
+    u->last_synced = e;
+    strncpy(job->path, e->name, MAXLINE - 1);
+    job->path[MAXLINE - 1] = '\0';
+    job->file = NULL;
+    job->fd = INVALID_FD;
+    job->target = NULL;
+    wait_sync(trans, on_dir_synced);
+    return true;
+}
+
+static void on_dir_synced(int efd, disk_job_t *job) {
+    transaction_t *trans = (transaction_t *) job->arg;
+    untar_t *u = trans->untar;
+    const char *dir = u->last_synced->name;
+    tar_entry_t *e;
+    if (job->result == ERROR) {
+        posix_error(job->err, "untar: sync directory");
+        for (e = u->last_synced; e != NULL; e = e->next) {
+            if (!published(e)) continue;
+            if (!same_dir(dir, e->name)) break;
+            e->result = "sync failed";
+        }
+    }
+    if (finish_if_aborted(efd, trans)) return;
+    queue_protocol(trans);
+}
+
+/* renamed over its final name */
+static bool published(const tar_entry_t *e) {
+    return e->tmp == NULL && e->result != NULL && strcmp(e->result, "ok") == 0;
+}
+
+static bool same_dir(const char *a, const char *b) {
+    const char *sa = strrchr(a, '/'), *sb = strrchr(b, '/');
+    long la = sa ? sa - a : 0, lb = sb ? sb - b : 0;
+    return la == lb && strncmp(a, b, la) == 0;
+}
+
+/* remove the temporary file of an entry that will not be published */
+static void drop_entry(transaction_t *trans, tar_entry_t *e, const char *result) {
+    submit_disk_close(INVALID_FD, NULL, e->tmp);
+    e->tmp = NULL;
+    e->result = result;
+}
+
+/* 200 if the whole archive was read, 400 otherwise, with a line per entry */
+static void respond(int efd, transaction_t *trans, untar_t *u) {
+    tar_entry_t *e;
+    long len = 0, pos = 0;
+    int ok = 0;
+    char *body;
+    epoll_event_t event;
+
+    for (e = u->head; e != NULL; e = e->next) {
+        len += snprintf(NULL, 0, "%s %ld %s\n", e->result, e->size, e->name);
+        ok += strcmp(e->result, "ok") == 0;
+    }
+    if (u->error != NULL) len += snprintf(NULL, 0, "error %s\n", u->error);
+    if ((body = arena_alloc(&trans->headers.arena, len + 1)) == NULL) {
+        unix_error("fatal: malloc");
+        exit(-2);
+    }
+    for (e = u->head; e != NULL; e = e->next) {
+        pos += sprintf(body + pos, "%s %ld %s\n", e->result, e->size, e->name);
+    }
+    if (u->error != NULL) sprintf(body + pos, "error %s\n", u->error);
+    printf("untar: %d entries, %d unpacked%s%s\n", u->n, ok, u->error ? ", " : "", u->error ? u->error : "");
+
+    outq_printf(&trans->outq, "HTTP/1.0 %s\r\n"
+                              "Server: Naive HTTP Server\r\n"
+                              "Connection: close\r\n"
+                              "Content-Length: %ld\r\nContent-Type: text/plain\r\n\r\n",
+                u->error ? "400 Bad Request" : "200 OK", len);
+    outq_push_mem(&trans->outq, body, len);
+
+    event.data.fd = trans->fd;
+    event.events = EPOLLOUT | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, trans->fd, &event) < 0) {
+        unix_error("epoll ctl");
+    }
+    trans->state = S_WRITE;
+    trans->next_stage = P_DONE;
+    queue_transmission(trans);
+}
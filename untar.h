@@ -0,0 +1,32 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_UNTAR_H
+#define NAIVE_HTTP_UNTAR_H
+
+#include <stdbool.h>
+#include "transaction.h"
+
+/*
+ * Tar upload: POST <dir>?untar unpacks a ustar body beneath <dir>.
+ * Entry headers are parsed from read_buf as the body arrives, and entry data
+ * is written from there by the disk workers, so the archive is never buffered
+ * whole. Each entry is written to a hidden temporary file next to its final
+ * name and renamed over it, per entry or once the whole archive arrived as set
+ * by config.untar_publish. The response lists the result of every entry.
+ */
+
+bool untar_requested(transaction_t *trans);
+
+void untar_step(int efd, transaction_t *trans);
+
+void untar_finish(transaction_t *trans);
+
+#endif //NAIVE_HTTP_UNTAR_H
@@ -0,0 +1,243 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE /* close_range */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include "upgrade.h"
+#include "error_handler.h"
+#include "transaction.h"
+#include "config.h"
+#include "timer.h"
+#include "diskio.h"
+#include "warmup.h"
+#include "objstore.h"
+
+/*
+ * Zero-downtime binary upgrade.
+ * On SIGUSR2 the server forks and execs the binary at its original path with
+ * UPGRADE_ENV pointing to one end of a socketpair, and passes its listen socket
+ * over it with SCM_RIGHTS. Both processes accept until the new one reports it is
+ * ready; the old one then stops accepting and drains its transactions, up to
+ * drain_timeout seconds, before exiting. SIGQUIT drains without a successor.
+ */
+static char exe_path[MAXLINE];
+static char **saved_argv;
+static int upgrade_sock = INVALID_FD; /* our end, while an upgrade is in progress */
+static bool draining = false;
+static timer_entry_t drain_timer;
+
+static void drain_expired(int efd, void *arg);
+
+void init_upgrade(char **argv) {
+    ssize_t len;
+    saved_argv = argv;
+    /* the path, not the inode: a new build installed over it is what gets exec'd */
+    if ((len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1)) < 0) {
+        unix_error("readlink /proc/self/exe");
+        strncpy(exe_path, argv[0], sizeof(exe_path) - 1);
+    } else {
+        exe_path[len] = '\0';
+        /* a replaced binary shows up as "path (deleted)" */
+        char *deleted = strstr(exe_path, " (deleted)");
+        if (deleted && deleted[10] == '\0') *deleted = '\0';
+    }
+    init_timer_entry(&drain_timer, drain_expired, NULL);
+
+    /* a successor that fails to start is reaped by the kernel */
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = SIG_DFL;
+    act.sa_flags = SA_NOCLDWAIT;
+    if (sigaction(SIGCHLD, &act, NULL) < 0) unix_error("sigaction SIGCHLD");
+}
+
+/*
+ * inherit_listenfd - in an upgraded process, receive the listen socket from the old one.
+ * Returns INVALID_FD when not started by an upgrade, ERROR on failure.
+ */
+int inherit_listenfd() {
+    char *env = getenv(UPGRADE_ENV);
+    char byte, control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fd;
+
+    if (env == NULL) return INVALID_FD;
+    upgrade_sock = atoi(env);
+    unsetenv(UPGRADE_ENV);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(upgrade_sock, &msg, 0) <= 0) {
+        unix_error("upgrade: recvmsg");
+        return ERROR;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        app_error("upgrade: no listen socket received");
+        return ERROR;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    printf("upgrade: inherited listen socket %d\n", fd);
+    return fd;
+}
+
+/*
+ * upgrade_ready - tell the old process we are accepting, so it can start draining
+ */
+void upgrade_ready() {
+    if (upgrade_sock < 0) return;
+    if (write(upgrade_sock, "R", 1) != 1) unix_error("upgrade: ack");
+    close(upgrade_sock);
+    upgrade_sock = INVALID_FD;
+}
+
+/*
+ * start_upgrade - exec the new binary and hand it the listen socket.
+ * Returns our end of the socketpair, registered in epoll, or ERROR.
+ */
+int start_upgrade(int efd, int listenfd) {
+    int sv[2], i, n_env;
+    pid_t pid;
+    char env_entry[64], **envp;
+    extern char **environ;
+
+    if (upgrade_sock >= 0 || draining) {
+        app_error("upgrade: already in progress");
+        return ERROR;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        unix_error("upgrade: socketpair");
+        return ERROR;
+    }
+
+    /* everything the child needs is prepared before fork, it only calls async-signal-safe functions */
+    for (n_env = 0; environ[n_env]; n_env++);
+    if ((envp = malloc(sizeof(char *) * (n_env + 2))) == NULL) {
+        unix_error("upgrade: malloc");
+        close(sv[0]);
+        close(sv[1]);
+        return ERROR;
+    }
+    snprintf(env_entry, sizeof(env_entry), UPGRADE_ENV "=3");
+    for (i = 0; i < n_env; i++) envp[i] = environ[i];
+    envp[n_env] = env_entry;
+    envp[n_env + 1] = NULL;
+
+    if ((pid = fork()) < 0) {
+        unix_error("upgrade: fork");
+        free(envp);
+        close(sv[0]);
+        close(sv[1]);
+        return ERROR;
+    }
+    if (pid == 0) {
+        /* child: keep stdio and the socketpair as fd 3, close connections and everything else */
+        if (dup2(sv[1], 3) < 0) _exit(127);
+        syscall(SYS_close_range, 4, ~0U, 0);
+        execve(exe_path, saved_argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+    upgrade_sock = sv[0];
+
+    /* send the listen socket */
+    char byte = 'L', control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listenfd, sizeof(int));
+    if (sendmsg(upgrade_sock, &msg, 0) < 0) {
+        unix_error("upgrade: sendmsg");
+        close(upgrade_sock);
+        upgrade_sock = INVALID_FD;
+        return ERROR;
+    }
+
+    epoll_event_t event;
+    event.data.fd = upgrade_sock;
+    event.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, upgrade_sock, &event) < 0) {
+        unix_error("upgrade: epoll add");
+        close(upgrade_sock);
+        upgrade_sock = INVALID_FD;
+        return ERROR;
+    }
+    printf("upgrade: started %s as pid %d\n", exe_path, pid);
+    return upgrade_sock;
+}
+
+/*
+ * handle_upgrade_event - the new process answered.
+ * Returns UPGRADE_ACCEPTING, or UPGRADE_FAILED if it died before that; upgradefd
+ * is closed either way. UPGRADE_PENDING on a spurious wakeup, it is still open.
+ */
+int handle_upgrade_event(int efd, int upgradefd) {
+    char byte;
+    ssize_t rc = read(upgradefd, &byte, 1);
+    if (rc < 0 && errno == EAGAIN) return UPGRADE_PENDING;
+    epoll_ctl(efd, EPOLL_CTL_DEL, upgradefd, NULL);
+    close(upgradefd);
+    upgrade_sock = INVALID_FD;
+    if (rc == 1 && byte == 'R') {
+        printf("upgrade: new process is accepting\n");
+        return UPGRADE_ACCEPTING;
+    }
+    app_error("upgrade: new process failed, keep serving");
+    return UPGRADE_FAILED;
+}
+
+/*
+ * start_draining - stop accepting and exit once in-flight transactions are done
+ */
+void start_draining(int efd, int *listenfd) {
+    if (*listenfd >= 0) {
+        if (epoll_ctl(efd, EPOLL_CTL_DEL, *listenfd, NULL) < 0) unix_error("epoll del listen fd");
+        close(*listenfd);
+        *listenfd = INVALID_FD;
+    }
+    if (draining) return;
+    draining = true;
+    warmup_flush(); /* the next process warms up from what this one served */
+    objstore_flush(); /* the next process replays less */
+    schedule_timer(&drain_timer, config.drain_timeout * 1000L);
+    printf("draining %d transactions, for at most %d seconds\n", active_transactions(), config.drain_timeout);
+}
+
+bool drained() {
+    return draining && active_transactions() == 0 && disk_jobs_pending() == 0;
+}
+
+static void drain_expired(int efd, void *arg) {
+    printf("drain timeout, exiting with %d transactions left\n", active_transactions());
+    exit(0);
+}
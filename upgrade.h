@@ -0,0 +1,37 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_UPGRADE_H
+#define NAIVE_HTTP_UPGRADE_H
+
+#include <stdbool.h>
+
+#define UPGRADE_ENV "NAIVE_HTTP_UPGRADE_FD" /* set in a freshly exec'd binary, the fd to receive listeners from */
+
+/* handle_upgrade_event results */
+#define UPGRADE_PENDING 0 /* no answer yet, the fd stays registered */
+#define UPGRADE_ACCEPTING 1
+#define UPGRADE_FAILED 2
+
+void init_upgrade(char **argv);
+
+int inherit_listenfd();
+
+void upgrade_ready();
+
+int start_upgrade(int efd, int listenfd);
+
+int handle_upgrade_event(int efd, int upgradefd);
+
+void start_draining(int efd, int *listenfd);
+
+bool drained();
+
+#endif //NAIVE_HTTP_UPGRADE_H
@@ -0,0 +1,305 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "warmup.h"
+#include "config.h"
+#include "diskio.h"
+#include "timer.h"
+#include "error_handler.h"
+
+#define WARMUP_PROBE 8 /* linear probe length before evicting */
+#define WARMUP_HEADER "# naive_http warmup"
+
+/* download history of a path */
+typedef struct {
+    char *path; /* NULL if the slot is free */
+    double hits; /* decayed, as of last */
+    long size;
+    time_t last;
+    bool warmed; /* read ahead at startup */
+} hot_entry_t;
+
+/* a file to read ahead, hottest first */
+typedef struct {
+    char *path;
+    long size;
+} warm_target_t;
+
+typedef struct {
+    double hits;
+    const hot_entry_t *entry;
+} ranked_t;
+
+static hot_entry_t *table;
+static timer_entry_t save_timer;
+static disk_job_t save_job;
+static char *save_buf;
+static bool saving = false;
+/* startup prefetch */
+static disk_job_t warm_job;
+static warm_target_t *targets;
+static int n_targets, next_target, warmed_files;
+static long warmed_bytes, budget_left;
+static long long warm_started;
+static bool warming = false;
+/* downloads since startup, and those of files read ahead */
+static long downloads, prefetched;
+
+static unsigned int hash_path(const char *path);
+
+static double decayed(const hot_entry_t *e, time_t now);
+
+static hot_entry_t *lookup_entry(const char *path, time_t now, bool claim);
+
+static void load_summary();
+
+static void save_summary();
+
+static void on_saved(int efd, disk_job_t *job);
+
+static void save_expired(int efd, void *arg);
+
+static int by_hits(const void *a, const void *b);
+
+static void warm_next();
+
+static void on_warmed(int efd, disk_job_t *job);
+
+/*
+ * init_warmup - load the summary and start reading its hottest files ahead, a no-op without warmup_file.
+ * Needs the disk workers and the timers.
+ */
+int init_warmup() {
+    if (config.warmup_file[0] == '\0') return OKAY;
+    if ((table = calloc(config.warmup_table_size, sizeof(hot_entry_t))) == NULL) {
+        unix_error("warmup: calloc");
+        return ERROR;
+    }
+    init_timer_entry(&save_timer, save_expired, NULL);
+    if (config.warmup_interval > 0) schedule_timer(&save_timer, config.warmup_interval * 1000L);
+    load_summary();
+    budget_left = config.warmup_budget;
+    warm_started = now_ms();
+    warming = true;
+    warm_next();
+    return OKAY;
+}
+
+/* count a download of path */
+void warmup_hit(const char *path, long size) {
+    time_t now = time(NULL);
+    hot_entry_t *e;
+    if (table == NULL || (e = lookup_entry(path, now, true)) == NULL) return;
+    e->hits = decayed(e, now) + 1;
+    e->last = now;
+    e->size = size;
+    downloads++;
+    if (e->warmed) prefetched++;
+}
+
+/* stop reading ahead and write the summary, before exiting */
+void warmup_flush() {
+    if (table == NULL) return;
+    warming = false; /* the job in flight is the last */
+    save_summary();
+}
+
+static unsigned int hash_path(const char *path) { /* FNV-1a */
+    unsigned int h = 2166136261u;
+    while (*path) {
+        h ^= (unsigned char) *path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static double decayed(const hot_entry_t *e, time_t now) {
+    if (config.warmup_half_life <= 0 || now <= e->last) return e->hits;
+    return e->hits * exp2(-(double) (now - e->last) / config.warmup_half_life);
+}
+
+/*
+ * lookup_entry - find the entry of path, or claim one for it.
+ * Probes WARMUP_PROBE slots; a free slot is claimed, otherwise the coldest one is evicted.
+ */
+static hot_entry_t *lookup_entry(const char *path, time_t now, bool claim) {
+    unsigned int h = hash_path(path);
+    hot_entry_t *e, *victim = NULL;
+    int i;
+    for (i = 0; i < WARMUP_PROBE; i++) {
+        e = &table[(h + i) & (config.warmup_table_size - 1)];
+        if (e->path != NULL && strcmp(e->path, path) == 0) return e;
+        if (victim == NULL || (victim->path != NULL && (e->path == NULL || decayed(e, now) < decayed(victim, now)))) {
+            victim = e;
+        }
+    }
+    if (!claim) return NULL;
+    free(victim->path);
+    memset(victim, 0, sizeof(hot_entry_t));
+    if ((victim->path = strdup(path)) == NULL) return NULL;
+    victim->last = now;
+    return victim;
+}
+
+/* seed the table from the summary, and pick the files to read ahead */
+static void load_summary() {
+    FILE *fp;
+    char *line = NULL, *path;
+    size_t cap = 0;
+    ssize_t len;
+    long saved, size, wanted = 0;
+    double hits;
+    int skip;
+    time_t now = time(NULL);
+    hot_entry_t *e;
+
+    if ((fp = fopen(config.warmup_file, "r")) == NULL) {
+        if (errno != ENOENT) unix_error("warmup: open summary");
+        return;
+    }
+    if ((targets = calloc(config.warmup_files > 0 ? config.warmup_files : 1, sizeof(warm_target_t))) == NULL) {
+        unix_error("warmup: calloc");
+        fclose(fp);
+        return;
+    }
+    saved = now;
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if (line[len - 1] == '\n') line[--len] = '\0';
+        if (line[0] == '#') {
+            sscanf(line, WARMUP_HEADER " %ld", &saved);
+            continue;
+        }
+        if (sscanf(line, "%lf %ld %n", &hits, &size, &skip) != 2 || line[skip] == '\0') continue;
+        path = line + skip;
+        if ((e = lookup_entry(path, now, true)) == NULL) continue;
+        e->hits = hits;
+        e->last = saved; /* decays for the time the server was down too */
+        e->size = size;
+        if (n_targets < config.warmup_files && wanted < config.warmup_budget &&
+            (targets[n_targets].path = strdup(path)) != NULL) {
+            targets[n_targets++].size = size;
+            wanted += size;
+        }
+    }
+    free(line);
+    fclose(fp);
+    printf("warmup: %d files, %.1f MiB to read ahead from %s\n", n_targets, wanted / 1048576.0, config.warmup_file);
+}
+
+/* write the table to warmup_file, hottest first */
+static void save_summary() {
+    time_t now = time(NULL);
+    ranked_t *ranked;
+    size_t len = 64, cap;
+    int i, n = 0, w;
+
+    if (saving) return;
+    if ((ranked = malloc(config.warmup_table_size * sizeof(ranked_t))) == NULL) {
+        unix_error("warmup: save");
+        return;
+    }
+    for (i = 0; i < config.warmup_table_size; i++) {
+        if (table[i].path == NULL || strchr(table[i].path, '\n') != NULL) continue;
+        ranked[n].hits = decayed(&table[i], now);
+        ranked[n++].entry = &table[i];
+        len += strlen(table[i].path) + 48;
+    }
+    qsort(ranked, n, sizeof(ranked_t), by_hits);
+    if ((save_buf = malloc(len)) == NULL) {
+        unix_error("warmup: save");
+        free(ranked);
+        return;
+    }
+    cap = len;
+    len = snprintf(save_buf, cap, WARMUP_HEADER " %ld\n", (long) now);
+    for (i = 0; i < n; i++) {
+        w = snprintf(save_buf + len, cap - len, "%.3f %ld %s\n",
+                     ranked[i].hits, ranked[i].entry->size, ranked[i].entry->path);
+        if (w < 0 || (size_t) w >= cap - len) { /* keep the hotter entries that fit */
+            fprintf(stderr, "warmup: summary truncated after %d of %d entries\n", i, n);
+            save_buf[len] = '\0';
+            break;
+        }
+        len += w;
+    }
+    free(ranked);
+
+    saving = true;
+    save_job.op = D_SAVE;
+    save_job.done = on_saved;
+    save_job.arg = NULL;
+    snprintf(save_job.path, MAXLINE, "%s", config.warmup_file);
+    save_job.buf = save_buf;
+    save_job.len = (long) len;
+    submit_disk_job(&save_job);
+}
+
+static void on_saved(int efd, disk_job_t *job) {
+    free(save_buf);
+    save_buf = NULL;
+    saving = false;
+    if (job->result == ERROR) posix_error(job->err, "warmup: save summary");
+}
+
+static void save_expired(int efd, void *arg) {
+    save_summary();
+    if (downloads > 0) {
+        printf("warmup: %ld of %ld downloads since startup were of files read ahead (%.1f%%)\n",
+               prefetched, downloads, prefetched * 100.0 / downloads);
+    }
+    if (config.warmup_interval > 0) schedule_timer(&save_timer, config.warmup_interval * 1000L);
+}
+
+static int by_hits(const void *a, const void *b) {
+    double x = ((const ranked_t *) a)->hits, y = ((const ranked_t *) b)->hits;
+    return (x < y) - (x > y);
+}
+
+/* read the next target ahead, one at a time so requests keep the other workers */
+static void warm_next() {
+    int i;
+    if (warming && next_target < n_targets && budget_left > 0) {
+        warm_job.op = D_WARM;
+        warm_job.done = on_warmed;
+        warm_job.arg = NULL;
+        snprintf(warm_job.path, MAXLINE, "%s", targets[next_target++].path);
+        warm_job.len = budget_left;
+        submit_disk_job(&warm_job);
+        return;
+    }
+    if (n_targets > 0) {
+        printf("warmup: read ahead %d of %d files, %.1f MiB, in %lld ms\n",
+               warmed_files, n_targets, warmed_bytes / 1048576.0, now_ms() - warm_started);
+    }
+    for (i = 0; i < n_targets; i++) free(targets[i].path);
+    free(targets);
+    targets = NULL;
+    n_targets = next_target = 0;
+    warming = false;
+}
+
+static void on_warmed(int efd, disk_job_t *job) {
+    hot_entry_t *e;
+    if (job->result == OKAY && job->len > 0) {
+        warmed_files++;
+        warmed_bytes += job->len;
+        budget_left -= job->len;
+        if ((e = lookup_entry(job->path, time(NULL), false)) != NULL) e->warmed = true;
+    }
+    if (next_target * 10 / n_targets != (next_target - 1) * 10 / n_targets && next_target < n_targets) {
+        printf("warmup: %d of %d files, %.1f MiB\n", next_target, n_targets, warmed_bytes / 1048576.0);
+    }
+    warm_next();
+}
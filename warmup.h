@@ -0,0 +1,35 @@
+/*
+Copyright 2018 Xavier Yao <xavieryao@me.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NAIVE_HTTP_WARMUP_H
+#define NAIVE_HTTP_WARMUP_H
+
+/*
+ * Page-cache warmup from recorded access history, on when config.warmup_file is set.
+ *
+ * Downloads are counted per path in a fixed-size table of hit counts that halve
+ * every warmup_half_life seconds. Every warmup_interval seconds, and when the
+ * server drains, the table is written to warmup_file, hottest first:
+ *
+ *   # naive_http warmup <unix time>
+ *   <decayed hits> <size> <path>
+ *
+ * At startup the hottest warmup_files entries, up to warmup_budget bytes, are
+ * read ahead into the page cache by the disk workers, one file at a time, while
+ * requests are served. The table carries on from the loaded counts.
+ */
+
+int init_warmup();
+
+void warmup_hit(const char *path, long size);
+
+void warmup_flush();
+
+#endif //NAIVE_HTTP_WARMUP_H